@@ -5,33 +5,175 @@
     The use case is for circuit emulation when there are a lot of
     fibers launched at the beginning and they have to run concurrently.
 
-    We are *not* interested in the launch/join behaviour exposed for
-    example in https://github.com/atemerev/skynet since it is assumed
-    to be amortize on the global long running time.
+    The yield benchmark is *not* interested in the launch/join behaviour
+    exposed for example in https://github.com/atemerev/skynet since it
+    is assumed to be amortize on the global long running time.
+
+    By default, or with "yield" as first argument, sweep the yield()
+    throughput over some "--name value" options, each value being a
+    comma-separated list:
+    --threads 1,2,4 --fibers 10,100 --iterations 1e4 --sched
+    round_robin,shared_work,lockfree_shared_work,work_stealing,numa
+    --idle busy,sleep,adaptive --placement none,compact,scatter,cpu_list
+    --cpus 0,2,4-7
+
+    Each point is run --warmup times (1 by default) and then
+    --repetitions times (5 by default) to report the median and the
+    percentiles. The results can be written with --json file.json and
+    --csv file.csv, and compared with --compare baseline.csv to a CSV
+    file saved earlier, flagging the points whose median is worse by
+    more than --threshold percent (5 by default) with a non-zero exit
+    status.
+
+    Run with "spawn" as argument for the launch/join family instead,
+    which decides how fine-grained the work can be split: a flat spawn
+    of --tasks trivial fibers, a recursive fan-out tree of --depth
+    levels and --fan-out children per node, and the latency of
+    spawning a fiber and joining it from another fiber over --rounds.
+    Each workload runs over --threads and --sched as above and over
+    --join pool,future,channel, which is how the fibers are joined, and
+    --stack default,pooled. The differences between these variants
+    show how much goes into the stack allocation, the future
+    bookkeeping and the channel rendezvous. The --workload list selects
+    among flat, tree and spawn_join, and the results are reported as
+    above.
+
+    Run with "submission" as argument to measure instead how fast the
+    work can be given to the pool, one task at a time or by batches.
+
+    Run with "phase" as argument to measure the turnaround of some
+    short phases of work, on a single pool reused with wait_idle() or
+    on a new pool for each phase.
+
+    Run with "first_yield" as argument to measure how long it takes
+    for all the fibers to reach their first yield() according to the
+    way the work is distributed over the workers.
+
+    Run with "stack" as argument to measure the fiber creation rate
+    and the memory used according to the fiber stack policy.
+
+    Run with "idle" as argument to measure the wake-up latency of an
+    idle pool and the CPU time it burns according to the idle mode.
+
+    Run with "cancel" as argument to measure how long a pool busy with
+    some long yielding loops takes to shut down after cancel(), with
+    the loops polling stop_requested() at each yield.
+
+    Run with "sleep" as argument to measure many fibers sleeping
+    concurrently at a fine granularity, either on the sleep queue of
+    Boost.Fiber or on the timing wheel of each worker of the pool.
+
+    Run with "coroutine" as argument to compare fiber_pool and
+    coro_pool, which runs stackless C++20 coroutines: the yield
+    throughput and the memory used by each task waiting on a channel.
+
+    Run with "elastic" as argument to measure a bursty load on a pool
+    of busy-waiting workers, with a fixed number of workers or with
+    auto-scaling: the time to run each burst and the CPU time burnt
+    between the bursts.
+
+    Run with "placement" as argument to compare the yield throughput
+    according to where the worker threads are pinned, with the same
+    options as above. An explicit placement is added to the comparison
+    by giving some --cpus.
+
+    Run with "priority" as argument to measure the start latency of
+    some urgent fibers when the pool is saturated by a lot of yielding
+    fibers, with and without the priority scheduler.
+
+    Run with "steal" as argument to measure the yield throughput of
+    the work-stealing scheduler according to the victim selection and
+    the steal granularity, when all the fibers start on the same worker.
+
+    Run with "channel" as argument to compare the packet rate of
+    boost::fibers::buffered_channel and of ring_channel, between 2
+    fibers of the same thread or between 2 threads, and with the
+    packets moved one by one or by bursts.
+
+    Run with "clock" as argument to measure the simulated cycles per
+    second of some fibers running in lockstep with wait_for_clock(),
+    compared to a central boost::fibers::barrier.
+
+    Run with "logging" as argument to measure the packet rate of a
+    router thread logging each packet with fiber_log, with the logging
+    compiled out, buffered or synchronous.
+
+    --help prints a summary of the options of the sweeps.
+
+    The NUMA topology used by the numa scheduler can be replaced by
+    setting for example FIBER_POOL_NUMA_TOPOLOGY="0;0" to pretend there
+    are 2 nodes sharing CPU 0.
 */
 
+#include <algorithm>
 #include <atomic>
+#include <bit>
 #include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <sys/resource.h>
+#include <unistd.h>
 
+#include "benchmark_harness.hpp"
+#include "coro_channel.hpp"
+#include "coro_pool.hpp"
+#include "fiber_log.hpp"
 #include "fiber_pool.hpp"
+#include "ring_channel.hpp"
 
 // Use precise time measurement
 using clk = std::chrono::high_resolution_clock;
 
-/// A parametric benchmark
-void benchmark(int thread_number,
-               int fiber_number,
-               int iterations,
-               fiber_pool::sched scheduler,
-               bool suspend) {
-  std::cout << "threads: " << thread_number
-            << " fibers: "<< fiber_number
-            << " iterations: " << iterations
-            << " scheduler: " << static_cast<int>(scheduler)
-            << " suspend: " << static_cast<int>(suspend) << std::endl;
+/// A summary of the command line described above
+constexpr const char * usage =
+  R"(usage: benchmark [yield|placement] [--name value]...
+       benchmark spawn [--name value]...
+       benchmark channel|clock|logging|priority|cancel|sleep|coroutine
+       benchmark elastic|steal|idle|stack|first_yield|phase|submission
+
+yield and placement options, each value being a comma-separated list:
+  --threads 1,2,4 --fibers 10,100 --iterations 1e4
+  --sched round_robin,shared_work,lockfree_shared_work,work_stealing,numa
+  --idle busy,sleep,adaptive --placement none,compact,scatter,cpu_list
+  --cpus 0,2,4-7
+
+spawn options:
+  --threads 1,2,4 --sched work_stealing --workload flat,tree,spawn_join
+  --join pool,future,channel --stack default,pooled --tasks 10000
+  --depth 4 --fan-out 8 --rounds 10000 --idle adaptive
+
+Common options:
+  --warmup runs (1) and --repetitions (5) of each point
+  --json file.json and --csv file.csv to write the results
+  --compare baseline.csv with a --threshold percent (5)
+
+See the comment at the top of benchmark.cpp for the details.
+)";
 
-  fiber_pool fp { thread_number, scheduler, suspend };
+/** A parametric benchmark
+
+    \return the duration in seconds
+*/
+double benchmark(int thread_number,
+                 int fiber_number,
+                 int iterations,
+                 fiber_pool::sched scheduler,
+                 fiber_pool::options opt) {
+  if (auto topology = std::getenv("FIBER_POOL_NUMA_TOPOLOGY"))
+    opt.topology = numa_topology::parse(topology);
+  fiber_pool fp { thread_number, scheduler, opt };
 
 #ifdef TRISYCL_FIBER_POOL_DEBUG
   /// Count globally how many times we enter the benchmark loop
@@ -69,10 +211,6 @@ void benchmark(int thread_number,
   // Get the duration in seconds as a double
   std::chrono::duration<double> duration = clk::now() - starting_point;
 
-  std::cout << " time: " << duration.count()
-            << " s, yield() frequency: "
-            << iterations*fiber_number/duration.count() << " Hz"
-            << std::endl;
 #ifdef TRISYCL_FIBER_POOL_DEBUG
   std::cout << " S: " << s << " F: " << f << " C: " << c << std::endl;
   assert(s == fiber_number
@@ -81,29 +219,1390 @@ void benchmark(int thread_number,
   assert(c == fiber_number*iterations
          && "we should have the right number of global interations");
 #endif
+  return duration.count();
+}
+
+
+/// The names of the enumerations for the command line and the reports
+template <typename Enum>
+const std::vector<std::pair<std::string, Enum>> enum_names;
+
+template <>
+const std::vector<std::pair<std::string, fiber_pool::sched>> enum_names<
+  fiber_pool::sched> {
+  { "round_robin", fiber_pool::sched::round_robin },
+  { "shared_work", fiber_pool::sched::shared_work },
+  { "lockfree_shared_work", fiber_pool::sched::lockfree_shared_work },
+  { "work_stealing", fiber_pool::sched::work_stealing },
+  { "numa", fiber_pool::sched::numa },
+  { "priority", fiber_pool::sched::priority }
+};
+
+template <>
+const std::vector<std::pair<std::string, fiber_pool::idle_mode>> enum_names<
+  fiber_pool::idle_mode> {
+  { "busy", fiber_pool::idle_mode::busy },
+  { "sleep", fiber_pool::idle_mode::sleep },
+  { "adaptive", fiber_pool::idle_mode::adaptive }
+};
+
+template <>
+const std::vector<std::pair<std::string, fiber_pool::placement>> enum_names<
+  fiber_pool::placement> {
+  { "none", fiber_pool::placement::none },
+  { "compact", fiber_pool::placement::compact },
+  { "scatter", fiber_pool::placement::scatter },
+  { "cpu_list", fiber_pool::placement::cpu_list }
+};
+
+
+/// The workloads of the spawn/join benchmark family
+enum class spawn_workload { flat, tree, spawn_join };
+
+/// How the spawned fibers are joined
+enum class spawn_join {
+  /// By waiting for the pool to be idle, only for the flat workload
+  pool,
+  /// Through the future returned by submit<R>()
+  future,
+  /// Through a channel receiving the results
+  channel
+};
+
+template <>
+const std::vector<std::pair<std::string, spawn_workload>> enum_names<
+  spawn_workload> {
+  { "flat", spawn_workload::flat },
+  { "tree", spawn_workload::tree },
+  { "spawn_join", spawn_workload::spawn_join }
+};
+
+template <>
+const std::vector<std::pair<std::string, spawn_join>> enum_names<
+  spawn_join> {
+  { "pool", spawn_join::pool },
+  { "future", spawn_join::future },
+  { "channel", spawn_join::channel }
+};
+
+
+template <typename Enum>
+std::string name_of(Enum e) {
+  for (auto &[name, value] : enum_names<Enum>)
+    if (value == e)
+      return name;
+  return std::to_string(static_cast<int>(e));
+}
+
+
+/// \throw std::invalid_argument for an unknown name
+template <typename Enum>
+std::vector<Enum> parse_enums(const std::vector<std::string> &names) {
+  std::vector<Enum> values;
+  for (auto &n : names) {
+    auto e = std::find_if(enum_names<Enum>.begin(), enum_names<Enum>.end(),
+                          [&] (auto &p) { return p.first == n; });
+    if (e == enum_names<Enum>.end())
+      throw std::invalid_argument { "unknown name: " + n };
+    values.push_back(e->second);
+  }
+  return values;
+}
+
+
+/// What to do with the results of a sweep
+struct report_options {
+  /// Where to write the results, nowhere if empty
+  std::string json;
+  std::string csv;
+  /// The measurements to compare to, if any
+  std::optional<std::vector<benchmark_harness::measurement>> baseline;
+  /// The worsening in percent flagged as a regression
+  double threshold;
+};
+
+
+/** Read the options about the results and reject the unknown ones,
+    once a sweep has read its own options and before running it, so
+    that a bad command line does not waste a whole sweep
+
+    \throw std::invalid_argument on an unknown option or a --compare
+    baseline which cannot be read
+*/
+report_options read_report_options(const benchmark_harness::command_line &cl) {
+  report_options o { .json = cl.get<std::string>("json", ""),
+                     .csv = cl.get<std::string>("csv", ""),
+                     .baseline = {},
+                     .threshold = cl.get<double>("threshold", 5) };
+  auto file = cl.get<std::string>("compare", "");
+  cl.check();
+  if (!file.empty()) {
+    std::ifstream f { file };
+    if (!f)
+      throw std::invalid_argument { "cannot open --compare " + file };
+    try {
+      o.baseline = benchmark_harness::report::read_csv(f);
+    } catch (std::exception &e) {
+      throw std::invalid_argument { file + ": " + e.what() };
+    }
+  }
+  return o;
+}
+
+
+/** Write the results as asked on the command line and compare them to
+    a baseline
+
+    \return the process exit status, non-zero on some regressions
+*/
+int write_report(const report_options &o,
+                 const benchmark_harness::report &report) {
+  namespace bh = benchmark_harness;
+  if (!o.json.empty()) {
+    std::ofstream f { o.json };
+    report.write_json(f);
+  }
+  if (!o.csv.empty()) {
+    std::ofstream f { o.csv };
+    report.write_csv(f);
+  }
+  if (o.baseline) {
+    auto regressions = bh::compare(report.measurements(), *o.baseline,
+                                   o.threshold, std::cout);
+    std::cout << regressions << " regression(s)" << std::endl;
+    return regressions != 0;
+  }
+  return 0;
+}
+
+
+/** Run the yield() benchmark over the sweep selected on the command
+    line, write the results and compare them to a baseline
+
+    \param[in] placements gives the default placements, to compare them
+    instead of the schedulers
+
+    \return the process exit status, non-zero on some regressions
+*/
+int yield_sweep(const benchmark_harness::command_line &cl,
+                std::vector<std::string> placements) {
+  namespace bh = benchmark_harness;
+  if (cl.help()) {
+    std::cout << usage;
+    return 0;
+  }
+  auto max_threads = static_cast<int>(2*std::thread::hardware_concurrency());
+  std::vector<int> default_threads;
+  for (int t = 1; t <= max_threads; ++t)
+    default_threads.push_back(t);
+  auto threads = cl.list<int>("threads", default_threads);
+  auto fibers = cl.list<int>("fibers",
+                             { 1, 3, 10, 30, 100, 300, 1000, 3000 });
+  auto iterations = cl.list<double>("iterations", { 0., 1., 1e4, 1e5, 1e6 });
+  // Focus on the extreme schedulers when comparing the placements
+  auto schedulers = parse_enums<fiber_pool::sched>
+    (cl.list<std::string>("sched", placements.size() > 1
+                          ? std::vector<std::string> { "round_robin",
+                                                       "work_stealing" }
+                          : std::vector<std::string> {
+                              "round_robin", "shared_work",
+                              "lockfree_shared_work", "work_stealing",
+                              "numa" }));
+  auto idles = parse_enums<fiber_pool::idle_mode>
+    (cl.list<std::string>("idle", { "busy", "sleep", "adaptive" }));
+  auto places = parse_enums<fiber_pool::placement>
+    (cl.list<std::string>("placement", placements));
+  auto cpus = numa_topology::parse_cpu_list(cl.get<std::string>("cpus", ""));
+  auto warmup = cl.get<std::size_t>("warmup", 1);
+  auto repetitions = cl.get<std::size_t>("repetitions", 5);
+  auto results = read_report_options(cl);
+
+  bh::report report;
+  for (auto thread_number : threads)
+    for (auto fiber_number : fibers)
+      for (auto iteration : iterations)
+        for (auto scheduler : schedulers)
+          for (auto idle : idles)
+            for (auto place : places) {
+              // The idle mode has no effect on the round-robin scheduler
+              if (scheduler == fiber_pool::sched::round_robin
+                  && idle != idles.front())
+                continue;
+              fiber_pool::options opt { .idle = idle,
+                                        .place = place,
+                                        .cpus = cpus };
+              std::vector<std::pair<std::string, std::string>> parameters {
+                { "threads", std::to_string(thread_number) },
+                { "fibers", std::to_string(fiber_number) },
+                { "iterations", (std::ostringstream {} << iteration).str() },
+                { "sched", name_of(scheduler) },
+                { "idle", name_of(idle) },
+                { "placement", name_of(place) }
+              };
+              for (auto &[name, value] : parameters)
+                std::cout << name << ": " << value << ' ';
+              std::cout << std::endl;
+              auto times = bh::repeat(warmup, repetitions, [&] {
+                return benchmark(thread_number, fiber_number, iteration,
+                                 scheduler, opt);
+              });
+              auto yields = iteration*fiber_number;
+              std::vector<double> frequencies;
+              for (auto t : times)
+                frequencies.push_back(yields/t);
+              bh::measurement time { "yield", parameters, "time_s", false,
+                                     bh::summarize(times) };
+              bh::measurement frequency { "yield", parameters,
+                                          "yield_frequency_Hz", true,
+                                          bh::summarize(frequencies) };
+              std::cout << " time: " << time.stats.median
+                        << " s, yield() frequency: "
+                        << frequency.stats.median << " Hz [p10 "
+                        << frequency.stats.p10 << ", p90 "
+                        << frequency.stats.p90 << "] over "
+                        << repetitions << " runs" << std::endl;
+              report.add(std::move(time));
+              if (yields != 0)
+                report.add(std::move(frequency));
+            }
+
+  return write_report(results, report);
+}
+
+
+/// A fiber doing nothing, to only measure its creation and its join
+void trivial_fiber() {}
+
+
+/** Spawn some fibers doing nothing and join them all
+
+    \return the number of fibers
+*/
+std::uint64_t spawn_flat(fiber_pool &fp, int task_number, spawn_join join) {
+  if (join == spawn_join::pool) {
+    fp.submit_n(task_number, [] (std::size_t) { return trivial_fiber; });
+    fp.wait_idle();
+  }
+  else if (join == spawn_join::future) {
+    std::vector<boost::fibers::future<void>> children;
+    children.reserve(task_number);
+    for (int i = 0; i != task_number; ++i)
+      children.push_back(fp.submit<void>(trivial_fiber));
+    for (auto &c : children)
+      c.get();
+  }
+  else {
+    // Shared since a child may still be in push() after the last pop()
+    auto results = std::make_shared<ring_channel<int>>(1024);
+    for (int i = 0; i != task_number; ++i)
+      fp.submit([results] { results->push(1); });
+    for (int i = 0, v; i != task_number; ++i)
+      results->pop(v);
+  }
+  return task_number;
+}
+
+
+/** Spawn a tree of fibers, each node spawning its children and joining
+    them, as the skynet benchmark
+
+    \return the number of fibers in the tree
+*/
+std::uint64_t spawn_tree(fiber_pool &fp, int depth, int fan_out,
+                         spawn_join join) {
+  std::uint64_t nodes = 1;
+  if (depth == 0)
+    return nodes;
+  auto child = [&fp, depth, fan_out, join] {
+    return spawn_tree(fp, depth - 1, fan_out, join);
+  };
+  if (join == spawn_join::channel) {
+    auto results = std::make_shared<ring_channel<std::uint64_t>>
+      (std::bit_ceil(static_cast<std::size_t>(std::max(fan_out, 2))));
+    for (int i = 0; i != fan_out; ++i)
+      fp.submit([results, child] { results->push(child()); });
+    for (int i = 0; i != fan_out; ++i) {
+      std::uint64_t n;
+      results->pop(n);
+      nodes += n;
+    }
+  }
+  else {
+    std::vector<boost::fibers::future<std::uint64_t>> children;
+    for (int i = 0; i != fan_out; ++i)
+      children.push_back(fp.submit<std::uint64_t>(child));
+    for (auto &c : children)
+      nodes += c.get();
+  }
+  return nodes;
+}
+
+
+/** Spawn a fiber and wait for its end from another fiber, one at a time
+
+    \return the mean latency of a spawn and join in nanoseconds
+*/
+double spawn_then_join(fiber_pool &fp, int rounds, spawn_join join) {
+  return fp.submit<double>([&fp, rounds, join] {
+    auto results = std::make_shared<ring_channel<int>>(2);
+    auto starting_point = clk::now();
+    for (int r = 0; r != rounds; ++r)
+      if (join == spawn_join::channel) {
+        int v;
+        fp.submit([results] { results->push(1); });
+        results->pop(v);
+      }
+      else
+        fp.submit<void>(trivial_fiber).get();
+    std::chrono::duration<double, std::nano> duration =
+      clk::now() - starting_point;
+    return duration.count()/rounds;
+  }).get();
+}
+
+
+/** Run the spawn/join benchmark family over the sweep selected on the
+    command line, write the results and compare them to a baseline
+
+    \return the process exit status, non-zero on some regressions
+*/
+int spawn_sweep(const benchmark_harness::command_line &cl) {
+  namespace bh = benchmark_harness;
+  if (cl.help()) {
+    std::cout << usage;
+    return 0;
+  }
+  auto max_threads = static_cast<int>(2*std::thread::hardware_concurrency());
+  std::vector<int> default_threads;
+  for (int t = 1; t <= max_threads; ++t)
+    default_threads.push_back(t);
+  auto threads = cl.list<int>("threads", default_threads);
+  std::vector<std::string> all_schedulers;
+  for (auto &[name, value] : enum_names<fiber_pool::sched>)
+    all_schedulers.push_back(name);
+  auto schedulers = parse_enums<fiber_pool::sched>
+    (cl.list<std::string>("sched", all_schedulers));
+  auto workloads = parse_enums<spawn_workload>
+    (cl.list<std::string>("workload", { "flat", "tree", "spawn_join" }));
+  auto joins = parse_enums<spawn_join>
+    (cl.list<std::string>("join", { "pool", "future", "channel" }));
+  auto stacks = cl.list<std::string>("stack", { "default", "pooled" });
+  auto task_number = cl.get<int>("tasks", 10'000);
+  auto depth = cl.get<int>("depth", 4);
+  auto fan_out = cl.get<int>("fan-out", 8);
+  auto rounds = cl.get<int>("rounds", 10'000);
+  auto idle = parse_enums<fiber_pool::idle_mode>
+    ({ cl.get<std::string>("idle", "adaptive") }).front();
+  auto warmup = cl.get<std::size_t>("warmup", 1);
+  auto repetitions = cl.get<std::size_t>("repetitions", 5);
+  auto results = read_report_options(cl);
+
+  bh::report report;
+  for (auto workload : workloads)
+    for (auto thread_number : threads)
+      for (auto scheduler : schedulers)
+        for (auto join : joins)
+          for (auto &stack : stacks) {
+            // Only the flat spawn can be joined by the pool itself
+            if (join == spawn_join::pool && workload != spawn_workload::flat)
+              continue;
+            std::vector<std::pair<std::string, std::string>> parameters {
+              { "workload", name_of(workload) },
+              { "threads", std::to_string(thread_number) },
+              { "sched", name_of(scheduler) },
+              { "join", name_of(join) },
+              { "stack", stack }
+            };
+            if (workload == spawn_workload::flat)
+              parameters.emplace_back("tasks", std::to_string(task_number));
+            else if (workload == spawn_workload::tree) {
+              parameters.emplace_back("depth", std::to_string(depth));
+              parameters.emplace_back("fan-out", std::to_string(fan_out));
+            }
+            else
+              parameters.emplace_back("rounds", std::to_string(rounds));
+            for (auto &[name, value] : parameters)
+              std::cout << name << ": " << value << ' ';
+            std::cout << std::endl;
+            fiber_pool::options opt { .idle = idle,
+                                      .stack = { .pooled = stack
+                                                 == "pooled" } };
+            // The pool creation and destruction are not measured
+            auto values = bh::repeat(warmup, repetitions, [&] {
+              fiber_pool fp { thread_number, scheduler, opt };
+              if (workload == spawn_workload::spawn_join)
+                return spawn_then_join(fp, rounds, join);
+              auto starting_point = clk::now();
+              auto fibers = workload == spawn_workload::flat
+                ? spawn_flat(fp, task_number, join)
+                : fp.submit<std::uint64_t>([&] {
+                    return spawn_tree(fp, depth, fan_out, join);
+                  }).get();
+              std::chrono::duration<double> duration =
+                clk::now() - starting_point;
+              return fibers/duration.count();
+            });
+            bool latency = workload == spawn_workload::spawn_join;
+            bh::measurement m { "spawn", parameters,
+                                latency ? "latency_ns" : "fiber_rate_Hz",
+                                !latency, bh::summarize(values) };
+            std::cout << (latency ? " spawn and join latency: "
+                                  : " spawn rate: ")
+                      << m.stats.median << (latency ? " ns" : " fiber/s")
+                      << " [p10 " << m.stats.p10 << ", p90 " << m.stats.p90
+                      << "] over " << repetitions << " runs" << std::endl;
+            report.add(std::move(m));
+          }
+  return write_report(results, report);
+}
+
+
+/** Measure the rate at which some trivial tasks are submitted
+
+    \param[in] bulk uses submit_n() instead of submit() for each task
+*/
+void submission_benchmark(int thread_number,
+                          int task_number,
+                          fiber_pool::sched scheduler,
+                          bool bulk) {
+  std::cout << "threads: " << thread_number
+            << " tasks: " << task_number
+            << " scheduler: " << static_cast<int>(scheduler)
+            << " bulk: " << static_cast<int>(bulk) << std::endl;
+
+  fiber_pool fp { thread_number, scheduler, false };
+  std::atomic<int> done = 0;
+  auto task = [&] { done.fetch_add(1, std::memory_order_relaxed); };
+
+  auto starting_point = clk::now();
+  if (bulk)
+    fp.submit_n(task_number, [&] (std::size_t) { return task; });
+  else
+    for (int i = task_number; i != 0; --i)
+      fp.submit(task);
+  std::chrono::duration<double> submitted = clk::now() - starting_point;
+  fp.join();
+  std::chrono::duration<double> duration = clk::now() - starting_point;
+
+  std::cout << " submission time: " << submitted.count()
+            << " s, submission rate: " << task_number/submitted.count()
+            << " task/s, completion rate: " << task_number/duration.count()
+            << " task/s" << std::endl;
+}
+
+
+/** Measure the mean time of some short phases of work
+
+    \param[in] persistent keeps the same pool for all the phases with
+    wait_idle() instead of creating and joining a pool for each one
+*/
+void phase_benchmark(int thread_number,
+                     int task_number,
+                     int phases,
+                     fiber_pool::sched scheduler,
+                     bool persistent) {
+  std::cout << "threads: " << thread_number
+            << " tasks: " << task_number
+            << " phases: " << phases
+            << " scheduler: " << static_cast<int>(scheduler)
+            << " persistent: " << static_cast<int>(persistent) << std::endl;
+
+  std::atomic<int> done = 0;
+  auto task = [&] { done.fetch_add(1, std::memory_order_relaxed); };
+  // The recycled stacks are kept from one phase to the next only by a
+  // persistent pool
+  fiber_pool::options opt { .idle = fiber_pool::idle_mode::sleep,
+                            .stack = { .pooled = true } };
+  auto starting_point = clk::now();
+  if (persistent) {
+    fiber_pool fp { thread_number, scheduler, opt };
+    for (int p = 0; p != phases; ++p) {
+      fp.submit_n(task_number, [&] (std::size_t) { return task; });
+      fp.wait_idle();
+    }
+  }
+  else
+    for (int p = 0; p != phases; ++p) {
+      fiber_pool fp { thread_number, scheduler, opt };
+      fp.submit_n(task_number, [&] (std::size_t) { return task; });
+      fp.join();
+    }
+  std::chrono::duration<double, std::micro> duration =
+    clk::now() - starting_point;
+
+  if (done != task_number*phases)
+    std::cerr << " wrong task count " << done << std::endl;
+  std::cout << " time: " << duration.count()/1e6
+            << " s, phase turnaround: " << duration.count()/phases
+            << " us" << std::endl;
+}
+
+
+/// Measure the time until every fiber has reached its first yield()
+void first_yield_benchmark(int thread_number,
+                           int fiber_number,
+                           fiber_pool::sched scheduler,
+                           fiber_pool::distribution dispatch) {
+  std::cout << "threads: " << thread_number
+            << " fibers: " << fiber_number
+            << " scheduler: " << static_cast<int>(scheduler)
+            << " distribution: " << static_cast<int>(dispatch) << std::endl;
+
+  fiber_pool fp { thread_number, scheduler, { .dispatch = dispatch } };
+  std::atomic<int> started = 0;
+  /// Set by the last fiber to start
+  std::atomic<clk::time_point> all_started;
+  auto starting_point = clk::now();
+  auto bench = [&] {
+    if (started.fetch_add(1, std::memory_order_relaxed) + 1 == fiber_number)
+      all_started = clk::now();
+    for (auto counter = 100; counter != 0; --counter)
+      boost::this_fiber::yield();
+  };
+  for (int i = fiber_number; i != 0; --i)
+    fp.submit(bench);
+  fp.join();
+  std::chrono::duration<double> duration =
+    all_started.load() - starting_point;
+
+  std::cout << " time to first yield: " << duration.count() << " s"
+            << std::endl;
+}
+
+
+/// The current resident set size of the process in bytes
+std::size_t resident_set_size() {
+  std::ifstream statm { "/proc/self/statm" };
+  std::size_t pages = 0;
+  // The second field is the resident page count
+  statm >> pages >> pages;
+  return pages*sysconf(_SC_PAGESIZE);
+}
+
+
+/** Measure the fiber creation rate and the memory used when a lot of
+    fibers are alive at the same time
+
+    The fibers are created in \p waves, the fibers of a wave being
+    all alive at the same time, to exercise the stack reuse.
+*/
+void stack_benchmark(int thread_number,
+                     int fiber_number,
+                     int waves,
+                     fiber_pool::sched scheduler,
+                     const stack_policy &stack) {
+  std::cout << "threads: " << thread_number
+            << " fibers: " << fiber_number
+            << " waves: " << waves
+            << " scheduler: " << static_cast<int>(scheduler)
+            << " stack size: " << stack.stack_size()
+            << " pooled: " << stack.pooled
+            << " guard page: " << stack.guard_page << std::endl;
+
+  auto rss_before = resident_set_size();
+  std::atomic<std::size_t> rss_peak = 0;
+  auto starting_point = clk::now();
+  {
+    fiber_pool fp { thread_number, scheduler, { .stack = stack } };
+    boost::fibers::barrier all_alive { static_cast<unsigned>(fiber_number) };
+    for (int w = 0; w != waves; ++w) {
+      std::atomic<int> alive = 0;
+      std::atomic<int> finished = 0;
+      fp.submit_n(fiber_number, [&] (std::size_t) {
+        return [&] {
+          // Touch a bit of stack as a real fiber would do
+          volatile char scratch[1024];
+          scratch[0] = 0;
+          scratch[sizeof scratch - 1] = scratch[0];
+          if (alive.fetch_add(1) + 1 == fiber_number) {
+            auto rss = resident_set_size();
+            if (rss > rss_peak)
+              rss_peak = rss;
+          }
+          all_alive.wait();
+          ++finished;
+        };
+      });
+      // Wait for the wave to finish before starting the next one
+      while (finished != fiber_number)
+        std::this_thread::yield();
+    }
+    fp.join();
+  }
+  std::chrono::duration<double> duration = clk::now() - starting_point;
+
+  std::cout << " creation rate: " << fiber_number*waves/duration.count()
+            << " fiber/s, RSS with all the fibers alive: "
+            << (static_cast<long>(rss_peak)
+                - static_cast<long>(rss_before))/1024
+            << " KiB" << std::endl;
+}
+
+
+/// The CPU time used by the process so far, in seconds
+double cpu_time() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  auto seconds = [] (const timeval &t) { return t.tv_sec + t.tv_usec*1e-6; };
+  return seconds(usage.ru_utime) + seconds(usage.ru_stime);
 }
 
 
-int main() {
-  for (std::size_t thread_number = 1;
-       thread_number <= 2*std::thread::hardware_concurrency();
-       ++thread_number)
-    for (auto fiber_number : { 1, 3, 10, 30, 100, 300, 1000, 3000 })
-      for (auto iterations : { 0., 1., 1e4, 1e5, 1e6 })
+/// The CPU time used by the calling thread so far, in seconds
+double thread_cpu_time() {
+  rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  auto seconds = [] (const timeval &t) { return t.tv_sec + t.tv_usec*1e-6; };
+  return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+}
+
+
+/** Measure the latency to start some work on an idle pool and the CPU
+    time burnt while idle
+
+    The pool is left without work for \p idle_time between each
+    submission.
+*/
+void idle_benchmark(int thread_number,
+                    int rounds,
+                    std::chrono::microseconds idle_time,
+                    fiber_pool::sched scheduler,
+                    fiber_pool::idle_mode idle) {
+  std::cout << "threads: " << thread_number
+            << " rounds: " << rounds
+            << " idle time: " << idle_time.count() << " us"
+            << " scheduler: " << static_cast<int>(scheduler)
+            << " idle: " << static_cast<int>(idle) << std::endl;
+
+  fiber_pool fp { thread_number, scheduler, { .idle = idle } };
+  std::vector<double> latencies;
+  auto cpu_start = cpu_time();
+  auto starting_point = clk::now();
+  for (int r = 0; r != rounds; ++r) {
+    std::this_thread::sleep_for(idle_time);
+    auto submitted = clk::now();
+    auto started = fp.submit<clk::time_point>([] { return clk::now(); });
+    std::chrono::duration<double, std::micro> latency =
+      started.get() - submitted;
+    latencies.push_back(latency.count());
+  }
+  std::chrono::duration<double> duration = clk::now() - starting_point;
+  auto cpu = cpu_time() - cpu_start;
+  fp.join();
+  std::sort(latencies.begin(), latencies.end());
+
+  std::cout << " median wake-up latency: " << latencies[latencies.size()/2]
+            << " us, 99th percentile: " << latencies[latencies.size()*99/100]
+            << " us, CPU time: " << cpu << " s for " << duration.count()
+            << " s elapsed (" << 100*cpu/duration.count() << " %)"
+            << std::endl;
+}
+
+
+/** Measure the shutdown time of a pool cancelled in the middle of
+    some long loops of yield()
+
+    Each fiber would yield 1e6 times if not cancelled, and \p queued
+    more fibers are still waiting in the inboxes or in the run queues
+    when the pool is cancelled.
+*/
+void cancel_benchmark(int thread_number,
+                      int fiber_number,
+                      int queued,
+                      fiber_pool::sched scheduler) {
+  std::cout << "threads: " << thread_number
+            << " fibers: " << fiber_number
+            << " queued: " << queued
+            << " scheduler: " << static_cast<int>(scheduler) << std::endl;
+
+  fiber_pool fp { thread_number, scheduler, false };
+  std::atomic<int> started = 0;
+  auto loop = [&] {
+    ++started;
+    for (int i = 0; i != 1'000'000 && !fp.stop_requested(); ++i)
+      boost::this_fiber::yield();
+  };
+  fp.submit_n(fiber_number, [&] (std::size_t) { return loop; });
+  while (started < fiber_number)
+    std::this_thread::yield();
+  fp.submit_n(queued, [&] (std::size_t) { return loop; });
+  // Let the pool run for a while
+  std::this_thread::sleep_for(std::chrono::milliseconds { 10 });
+  auto starting_point = clk::now();
+  fp.cancel();
+  fp.join();
+  std::chrono::duration<double, std::micro> duration =
+    clk::now() - starting_point;
+
+  std::cout << " shutdown time after cancel: " << duration.count()
+            << " us, fibers started: " << started << " out of "
+            << fiber_number + queued << std::endl;
+}
+
+
+/** Measure many fibers sleeping concurrently at a fine granularity
+
+    Each fiber sleeps \p rounds times for a random duration up to \p
+    max_sleep, either with boost::this_fiber::sleep_for() on the
+    ordered sleep queue of its scheduler or with fiber_pool::sleep_for()
+    on the timing wheel of its worker. The workers sleep when idle, so
+    the CPU time is mostly spent managing the timers and switching
+    between the fibers.
+*/
+void sleep_benchmark(int thread_number,
+                     int fiber_number,
+                     int rounds,
+                     std::chrono::microseconds max_sleep,
+                     fiber_pool::sched scheduler,
+                     bool wheel) {
+  std::cout << "threads: " << thread_number
+            << " fibers: " << fiber_number
+            << " rounds: " << rounds
+            << " max sleep: " << max_sleep.count() << " us"
+            << " scheduler: " << static_cast<int>(scheduler)
+            << " timers: " << (wheel ? "timing_wheel" : "boost")
+            << std::endl;
+
+  fiber_pool fp { thread_number, scheduler, true };
+  std::atomic<std::int64_t> lateness = 0;
+  auto cpu_start = cpu_time();
+  auto starting_point = clk::now();
+  fp.submit_n(fiber_number, [&] (std::size_t i) {
+    return [&, i] {
+      std::minstd_rand random { static_cast<std::uint32_t>(i + 1) };
+      std::int64_t late = 0;
+      for (int r = 0; r != rounds; ++r) {
+        std::chrono::microseconds sleep { random() % max_sleep.count() };
+        auto start = clk::now();
+        if (wheel)
+          fp.sleep_for(sleep);
+        else
+          boost::this_fiber::sleep_for(sleep);
+        late += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  clk::now() - start - sleep).count();
+      }
+      lateness += late;
+    };
+  });
+  fp.join();
+  std::chrono::duration<double> duration = clk::now() - starting_point;
+  auto cpu = cpu_time() - cpu_start;
+  double sleeps = double(fiber_number)*rounds;
+
+  std::cout << " time: " << duration.count() << " s, CPU time: " << cpu
+            << " s, " << sleeps/cpu << " sleeps per CPU second, mean "
+            << "lateness: " << lateness/sleeps/1000 << " us" << std::endl;
+}
+
+
+/** Compare the stackful fibers of fiber_pool with the stackless
+    coroutines of coro_pool on the same work
+
+    The yield throughput is measured with \p task_number tasks yielding
+    \p iterations times each, and the memory per task with all the
+    tasks waiting on a channel at the same time.
+*/
+void coroutine_benchmark(int thread_number,
+                         int task_number,
+                         int iterations,
+                         bool work_stealing) {
+  std::cout << "threads: " << thread_number
+            << " tasks: " << task_number
+            << " iterations: " << iterations
+            << " work stealing: " << work_stealing << std::endl;
+
+  auto fiber_sched = work_stealing ? fiber_pool::sched::work_stealing
+                                   : fiber_pool::sched::round_robin;
+  auto coro_sched = work_stealing ? coro_pool::sched::work_stealing
+                                  : coro_pool::sched::round_robin;
+  auto yields = static_cast<double>(task_number)*iterations;
+
+  // Measure the memory used while all the tasks wait on a channel
+  // first, before the heap keeps some memory freed by the other runs
+  std::atomic<int> alive = 0;
+  auto wait_for_all = [&] (std::size_t rss_before) {
+    while (alive != task_number)
+      std::this_thread::yield();
+    return (static_cast<double>(resident_set_size())
+            - static_cast<double>(rss_before))/task_number;
+  };
+  double coro_memory = 0;
+  {
+    auto rss_before = resident_set_size();
+    coro_pool cp { thread_number, coro_sched, false };
+    coro_channel<int> c { 1 };
+    cp.submit_n(task_number, [&] (std::size_t) {
+      return [&] () -> coro_pool::task {
+        int v;
+        ++alive;
+        co_await c.pop(v);
+      };
+    });
+    coro_memory = wait_for_all(rss_before);
+    c.close();
+    cp.join();
+  }
+
+  alive = 0;
+  double fiber_memory = 0;
+  {
+    auto rss_before = resident_set_size();
+    fiber_pool fp { thread_number, fiber_sched, false };
+    ring_channel<int> c { 2 };
+    fp.submit_n(task_number, [&] (std::size_t) {
+      return [&] {
+        int v;
+        ++alive;
+        c.pop(v);
+      };
+    });
+    fiber_memory = wait_for_all(rss_before);
+    c.close();
+    fp.join();
+  }
+
+  auto fiber_time = benchmark(thread_number, task_number, iterations,
+                              fiber_sched, {});
+  auto starting_point = clk::now();
+  {
+    coro_pool cp { thread_number, coro_sched, false };
+    cp.submit_n(task_number, [&] (std::size_t) {
+      return [&] () -> coro_pool::task {
+        for (auto counter = iterations; counter != 0; --counter)
+          co_await coro_pool::yield();
+      };
+    });
+    cp.join();
+  }
+  std::chrono::duration<double> coro_time = clk::now() - starting_point;
+
+  std::cout << " fiber: " << yields/fiber_time << " yield/s, "
+            << fiber_memory << " B/task" << std::endl
+            << " coroutine: " << yields/coro_time.count() << " yield/s, "
+            << coro_memory << " B/task" << std::endl;
+}
+
+
+/** Measure some bursts of yielding fibers separated by idle periods
+
+    \param[in] auto_scale retires the idle workers between the bursts
+    instead of keeping them all busy-waiting
+*/
+void elastic_benchmark(int thread_number,
+                       int fiber_number,
+                       int bursts,
+                       std::chrono::milliseconds idle_time,
+                       bool auto_scale) {
+  std::cout << "threads: " << thread_number
+            << " fibers: " << fiber_number
+            << " bursts: " << bursts
+            << " idle time: " << idle_time.count() << " ms"
+            << " auto-scale: " << static_cast<int>(auto_scale) << std::endl;
+
+  fiber_pool fp { thread_number, fiber_pool::sched::work_stealing,
+                  { .idle = fiber_pool::idle_mode::busy,
+                    .stack = { .pooled = true },
+                    .auto_scale = auto_scale } };
+  std::chrono::duration<double> burst_time { 0 };
+  double idle_cpu = 0;
+  std::size_t idle_workers = 0;
+  for (int b = 0; b != bursts; ++b) {
+    auto cpu_start = cpu_time();
+    std::this_thread::sleep_for(idle_time);
+    idle_cpu += cpu_time() - cpu_start;
+    idle_workers += fp.workers();
+    auto starting_point = clk::now();
+    fp.submit_n(fiber_number, [] (std::size_t) {
+      return [] {
+        for (int i = 0; i != 100; ++i)
+          boost::this_fiber::yield();
+      };
+    });
+    fp.wait_idle();
+    burst_time += clk::now() - starting_point;
+  }
+  fp.join();
+
+  std::cout << " time per burst: " << burst_time.count()/bursts*1e6
+            << " us, CPU time while idle: "
+            << 100*idle_cpu/(bursts*idle_time.count()*1e-3)
+            << " %, active workers while idle: "
+            << static_cast<double>(idle_workers)/bursts << std::endl;
+}
+
+
+/** Measure how long an urgent fiber waits to start while the pool is
+    saturated by some background fibers yielding all the time
+
+    \param[in] priority is the priority of the urgent fibers, the
+    background ones having the default priority 0
+*/
+void priority_benchmark(int thread_number,
+                        int background_fibers,
+                        int probes,
+                        fiber_pool::sched scheduler,
+                        int priority) {
+  std::cout << "threads: " << thread_number
+            << " background fibers: " << background_fibers
+            << " scheduler: " << static_cast<int>(scheduler)
+            << " priority: " << priority << std::endl;
+
+  fiber_pool fp { thread_number, scheduler, false };
+  std::atomic<bool> stop = false;
+  fp.submit_n(background_fibers, [&] (std::size_t) {
+    return [&] {
+      while (!stop.load(std::memory_order_relaxed))
+        boost::this_fiber::yield();
+    };
+  });
+  // Let the background fibers fill the run queues
+  std::this_thread::sleep_for(std::chrono::milliseconds { 10 });
+  std::vector<double> latencies(probes);
+  std::atomic<int> done = 0;
+  for (int p = 0; p != probes; ++p) {
+    fp.submit(priority, [&, p, submitted = clk::now()] {
+      std::chrono::duration<double, std::micro> latency =
+        clk::now() - submitted;
+      latencies[p] = latency.count();
+      done.fetch_add(1, std::memory_order_release);
+    });
+    std::this_thread::sleep_for(std::chrono::microseconds { 200 });
+  }
+  while (done.load(std::memory_order_acquire) != probes)
+    std::this_thread::sleep_for(std::chrono::microseconds { 100 });
+  stop = true;
+  fp.join();
+  std::sort(latencies.begin(), latencies.end());
+
+  std::cout << " median start latency: " << latencies[latencies.size()/2]
+            << " us, 99th percentile: " << latencies[latencies.size()*99/100]
+            << " us" << std::endl;
+}
+
+
+/** Measure the yield() throughput when all the fibers are created by
+    the first worker and have to be stolen by the others
+*/
+void steal_benchmark(int thread_number,
+                     int fiber_number,
+                     int iterations,
+                     fiber_pool::victim_selection victims,
+                     bool steal_half) {
+  std::cout << "threads: " << thread_number
+            << " fibers: "<< fiber_number
+            << " iterations: " << iterations
+            << " victims: " << static_cast<int>(victims)
+            << " steal_half: " << static_cast<int>(steal_half) << std::endl;
+
+  fiber_pool fp { thread_number, fiber_pool::sched::work_stealing,
+                  { .dispatch = fiber_pool::distribution::first_worker,
+                    .victims = victims,
+                    .steal_half = steal_half } };
+  auto starting_point = clk::now();
+  fp.submit_n(fiber_number, [&] (std::size_t) {
+    return [=] {
+      for (auto counter = iterations; counter != 0; --counter)
+        boost::this_fiber::yield();
+    };
+  });
+  fp.join();
+  std::chrono::duration<double> duration = clk::now() - starting_point;
+
+  fiber_pool::worker_stats total;
+  for (auto &w : fp.stats())
+    total += w;
+  std::cout << " time: " << duration.count()
+            << " s, yield() frequency: "
+            << static_cast<double>(iterations)*fiber_number/duration.count()
+            << " Hz, steals: " << total.steals
+            << ", failed steals: " << total.failed_steals
+            << ", parks: " << total.parks << std::endl;
+}
+
+
+/** Measure the rate of the cycles of some fibers running in lockstep
+
+    \param[in] central uses a single boost::fibers::barrier instead of
+    the combining tree of fiber_pool::wait_for_clock()
+*/
+void clock_benchmark(int thread_number,
+                     int fiber_number,
+                     int cycles,
+                     bool central) {
+  std::cout << "threads: " << thread_number
+            << " fibers: "<< fiber_number
+            << " cycles: " << cycles
+            << " barrier: " << (central ? "central" : "combining_tree")
+            << std::endl;
+
+  fiber_pool fp { thread_number, fiber_pool::sched::work_stealing,
+                  { .idle = fiber_pool::idle_mode::adaptive } };
+  boost::fibers::barrier b { static_cast<std::size_t>(fiber_number) };
+  auto starting_point = clk::now();
+  if (central)
+    fp.submit_n(fiber_number, [&] (std::size_t) {
+      return [&] {
+        for (auto c = cycles; c != 0; --c)
+          b.wait();
+      };
+    });
+  else
+    fp.submit_clocked(fiber_number, [&] (std::size_t) {
+      return [&] {
+        for (auto c = cycles; c != 0; --c)
+          fp.wait_for_clock();
+      };
+    });
+  fp.join();
+  std::chrono::duration<double> duration = clk::now() - starting_point;
+
+  if (!central && fp.cycle() != static_cast<std::uint64_t>(cycles))
+    std::cerr << " wrong cycle count " << fp.cycle() << std::endl;
+  std::cout << " time: " << duration.count()
+            << " s, cycle rate: " << cycles/duration.count()
+            << " cycles/s" << std::endl;
+}
+
+
+/** Measure the rate of the packets going through a channel
+
+    \param[in] cross_thread makes the producer run in another thread
+    instead of in another fiber of the consumer thread
+
+    \param[in] burst is the number of packets moved by each push_n()
+    and pop_n(), or 1 to use push() and value_pop()
+*/
+template <typename Channel>
+void channel_benchmark(const char * name,
+                       std::size_t capacity,
+                       int packets,
+                       bool cross_thread,
+                       std::size_t burst = 1) {
+  std::cout << "channel: " << name
+            << " capacity: " << capacity
+            << " cross_thread: " << cross_thread
+            << " burst: " << burst << std::endl;
+
+  Channel channel { capacity };
+  auto produce = [&] {
+    if constexpr (requires (std::span<int> s) { channel.push_n(s); })
+      if (burst > 1) {
+        std::vector<int> b(burst);
+        for (int p = 0; p < packets;) {
+          auto n = std::min<std::size_t>(burst, packets - p);
+          for (std::size_t i = 0; i != n; ++i)
+            b[i] = p++;
+          channel.push_n(std::span { b }.first(n));
+        }
+        return;
+      }
+    for (int p = 0; p != packets; ++p)
+      channel.push(p);
+  };
+  auto starting_point = clk::now();
+  std::thread producer_thread;
+  boost::fibers::fiber producer_fiber;
+  if (cross_thread)
+    producer_thread = std::thread { produce };
+  else
+    producer_fiber = boost::fibers::fiber { produce };
+  std::int64_t sum = 0;
+  if constexpr (requires (std::span<int> s) { channel.pop_n(s); })
+    if (burst > 1) {
+      std::vector<int> b(burst);
+      for (int p = 0; p < packets;) {
+        auto n = channel.pop_n(b);
+        for (std::size_t i = 0; i != n; ++i)
+          sum += b[i];
+        p += n;
+      }
+    }
+  if (burst == 1)
+    for (int p = 0; p != packets; ++p)
+      sum += channel.value_pop();
+  if (cross_thread)
+    producer_thread.join();
+  else
+    producer_fiber.join();
+  std::chrono::duration<double> duration = clk::now() - starting_point;
+
+  if (sum != std::int64_t { packets }*(packets - 1)/2)
+    std::cerr << " wrong packet checksum " << sum << std::endl;
+  std::cout << " time: " << duration.count()
+            << " s, packet rate: " << packets/duration.count()
+            << " packets/s" << std::endl;
+}
+
+
+/** Measure the rate of the packets going through a router running in
+    its own thread, each stage logging each packet at level \p L
+
+    \param[in] m is the logging mode, unused when \p L is compiled out
+*/
+template <fiber_log::level L>
+void logging_benchmark(const char * name,
+                       int packets,
+                       fiber_log::mode m) {
+  std::cout << "logging: " << name << std::endl;
+
+  // Measure the logging cost and not the terminal
+  std::ofstream null { "/dev/null" };
+  fiber_log::start(null, m, 1 << 16);
+  // The cost of a call alone, with few enough calls to fit in a ring,
+  // in CPU time so that the background formatter is not counted
+  auto calls = 50'000;
+  auto call_start = thread_cpu_time();
+  for (int i = 0; i != calls; ++i)
+    fiber_log::log<L>("call {} of {}", i, calls);
+  auto call_time = thread_cpu_time() - call_start;
+  spsc_ring_channel<int> ingress { 64 };
+  spsc_ring_channel<int> egress { 64 };
+  auto starting_point = clk::now();
+  std::thread router { [&] {
+    for (int p = 0; p != packets; ++p) {
+      auto v = ingress.value_pop();
+      fiber_log::log<L>("router {} routing packet {}", (void *)&ingress, v);
+      egress.push(v);
+    }
+  } };
+  boost::fibers::fiber producer { [&] {
+    for (int p = 0; p != packets; ++p) {
+      fiber_log::log<L>("writing {} to router {}", p, (void *)&ingress);
+      ingress.push(p);
+    }
+  } };
+  std::int64_t sum = 0;
+  for (int p = 0; p != packets; ++p) {
+    auto v = egress.value_pop();
+    fiber_log::log<L>("read {} from router {}", v, (void *)&egress);
+    sum += v;
+  }
+  producer.join();
+  router.join();
+  std::chrono::duration<double> duration = clk::now() - starting_point;
+  auto dropped = fiber_log::dropped();
+  fiber_log::stop();
+
+  if (sum != std::int64_t { packets }*(packets - 1)/2)
+    std::cerr << " wrong packet checksum " << sum << std::endl;
+  std::cout << " time: " << duration.count()
+            << " s, packet rate: " << packets/duration.count()
+            << " packets/s, records dropped: " << dropped
+            << ", CPU time per call: " << call_time*1e9/calls << " ns"
+            << std::endl;
+}
+
+
+int main(int argc, char *argv[]) try {
+  if (argc > 1 && std::string_view { argv[1] } == "channel") {
+    for (auto cross_thread : { false, true })
+      for (std::size_t capacity : { 4, 64, 1024 }) {
+        channel_benchmark<boost::fibers::buffered_channel<int>>
+          ("buffered_channel", capacity, 1'000'000, cross_thread);
+        channel_benchmark<ring_channel<int>>
+          ("ring_channel", capacity, 1'000'000, cross_thread);
+        channel_benchmark<spsc_ring_channel<int>>
+          ("spsc_ring_channel", capacity, 1'000'000, cross_thread);
+        for (std::size_t burst : { 16, 256 })
+          if (burst <= capacity) {
+            channel_benchmark<ring_channel<int>>
+              ("ring_channel", capacity, 1'000'000, cross_thread, burst);
+            channel_benchmark<spsc_ring_channel<int>>
+              ("spsc_ring_channel", capacity, 1'000'000, cross_thread,
+               burst);
+          }
+      }
+    return 0;
+  }
+
+  if (argc > 1 && std::string_view { argv[1] } == "clock") {
+    for (std::size_t thread_number = 1;
+         thread_number <= 2*std::thread::hardware_concurrency();
+         ++thread_number)
+      for (auto fiber_number : { 10, 100, 1000, 10'000 })
+        for (auto central : { false, true })
+          clock_benchmark(thread_number, fiber_number, 1000, central);
+    return 0;
+  }
+
+  if (argc > 1 && std::string_view { argv[1] } == "logging") {
+    // The trace level is below the default compiled level
+    logging_benchmark<fiber_log::level::trace>
+      ("off", 1'000'000, fiber_log::mode::buffered);
+    logging_benchmark<fiber_log::level::info>
+      ("buffered", 1'000'000, fiber_log::mode::buffered);
+    logging_benchmark<fiber_log::level::info>
+      ("synchronous", 1'000'000, fiber_log::mode::synchronous);
+    return 0;
+  }
+
+  if (argc > 1 && std::string_view { argv[1] } == "priority") {
+    for (std::size_t thread_number = 1;
+         thread_number <= 2*std::thread::hardware_concurrency();
+         ++thread_number)
+      for (auto background_fibers : { 100, 1000 }) {
+        priority_benchmark(thread_number, background_fibers, 200,
+                           fiber_pool::sched::work_stealing, 0);
+        for (auto priority : { 0, 7 })
+          priority_benchmark(thread_number, background_fibers, 200,
+                             fiber_pool::sched::priority, priority);
+      }
+    return 0;
+  }
+
+  if (argc > 1 && std::string_view { argv[1] } == "spawn")
+    return spawn_sweep({ argc, argv, 2 });
+
+  if (argc > 1 && std::string_view { argv[1] } == "cancel") {
+    for (std::size_t thread_number = 1;
+         thread_number <= 2*std::thread::hardware_concurrency();
+         ++thread_number)
+      for (auto fiber_number : { 10, 1000 })
         for (auto scheduler : { fiber_pool::sched::round_robin,
                                 fiber_pool::sched::shared_work,
-                                fiber_pool::sched::work_stealing }) {
-          benchmark(thread_number,
-                    fiber_number,
-                    iterations,
-                    scheduler,
-                    false);
-          if (scheduler != fiber_pool::sched::round_robin)
-            // The same but with the thread suspension when no work
-            benchmark(thread_number,
-                      fiber_number,
-                      iterations,
-                      scheduler,
-                      true);
-        }
+                                fiber_pool::sched::work_stealing })
+          cancel_benchmark(thread_number, fiber_number, 10'000, scheduler);
+    return 0;
+  }
+
+  if (argc > 1 && std::string_view { argv[1] } == "sleep") {
+    for (std::size_t thread_number = 1;
+         thread_number <= 2*std::thread::hardware_concurrency();
+         ++thread_number)
+      for (auto fiber_number : { 1000, 10'000 })
+        // From mostly sleeping fibers to workers saturated by the wake-ups
+        for (auto max_sleep : { 100'000, 1000 })
+          for (auto scheduler : { fiber_pool::sched::shared_work,
+                                  fiber_pool::sched::work_stealing })
+            for (auto wheel : { false, true })
+              sleep_benchmark(thread_number, fiber_number, 10,
+                              std::chrono::microseconds { max_sleep },
+                              scheduler, wheel);
+    return 0;
+  }
+
+  if (argc > 1 && std::string_view { argv[1] } == "coroutine") {
+    for (std::size_t thread_number = 1;
+         thread_number <= 2*std::thread::hardware_concurrency();
+         thread_number *= 2)
+      for (auto task_number : { 100, 10'000 })
+        for (auto work_stealing : { false, true })
+          coroutine_benchmark(thread_number, task_number, 1000,
+                              work_stealing);
+    return 0;
+  }
+
+  if (argc > 1 && std::string_view { argv[1] } == "elastic") {
+    for (std::size_t thread_number = 1;
+         thread_number <= 2*std::thread::hardware_concurrency();
+         thread_number *= 2)
+      for (auto fiber_number : { 100, 10'000 })
+        for (auto auto_scale : { false, true })
+          elastic_benchmark(thread_number, fiber_number, 20,
+                            std::chrono::milliseconds { 50 }, auto_scale);
+    return 0;
+  }
+
+  if (argc > 1 && std::string_view { argv[1] } == "placement") {
+    benchmark_harness::command_line cl { argc, argv, 2 };
+    std::vector<std::string> placements { "none", "compact", "scatter" };
+    if (cl.has("cpus"))
+      placements.push_back("cpu_list");
+    return yield_sweep(cl, placements);
+  }
+
+  if (argc > 1 && std::string_view { argv[1] } == "steal") {
+    for (std::size_t thread_number = 2;
+         thread_number <= 2*std::thread::hardware_concurrency();
+         ++thread_number)
+      for (auto fiber_number : { 100, 1000, 10'000 })
+        for (auto victims : { fiber_pool::victim_selection::random,
+                              fiber_pool::victim_selection::neighbours })
+          for (auto steal_half : { false, true })
+            steal_benchmark(thread_number, fiber_number, 1000, victims,
+                            steal_half);
+    return 0;
+  }
+
+  if (argc > 1 && std::string_view { argv[1] } == "idle") {
+    for (std::size_t thread_number = 1;
+         thread_number <= 2*std::thread::hardware_concurrency();
+         ++thread_number)
+      for (auto scheduler : { fiber_pool::sched::shared_work,
+                              fiber_pool::sched::work_stealing })
+        for (auto idle : { fiber_pool::idle_mode::busy,
+                           fiber_pool::idle_mode::sleep,
+                           fiber_pool::idle_mode::adaptive })
+          idle_benchmark(thread_number, 200, std::chrono::microseconds { 1000 },
+                         scheduler, idle);
+    return 0;
+  }
+
+  if (argc > 1 && std::string_view { argv[1] } == "stack") {
+    for (std::size_t thread_number = 1;
+         thread_number <= 2*std::thread::hardware_concurrency();
+         ++thread_number)
+      for (auto fiber_number : { 1000, 10'000 })
+        for (auto stack : { stack_policy {},
+                            stack_policy { .size = 16*1024 },
+                            stack_policy { .size = 16*1024, .pooled = true },
+                            stack_policy { .size = 16*1024,
+                                           .guard_page = true },
+                            stack_policy { .size = 16*1024, .pooled = true,
+                                           .guard_page = true } })
+          stack_benchmark(thread_number, fiber_number, 10,
+                          fiber_pool::sched::work_stealing, stack);
+    return 0;
+  }
+
+  if (argc > 1 && std::string_view { argv[1] } == "first_yield") {
+    for (std::size_t thread_number = 1;
+         thread_number <= 2*std::thread::hardware_concurrency();
+         ++thread_number)
+      for (auto fiber_number : { 100, 1000, 10'000 })
+        for (auto scheduler : { fiber_pool::sched::round_robin,
+                                fiber_pool::sched::work_stealing })
+          for (auto dispatch : { fiber_pool::distribution::first_worker,
+                                 fiber_pool::distribution::round_robin,
+                                 fiber_pool::distribution::least_loaded })
+            first_yield_benchmark(thread_number, fiber_number, scheduler,
+                                  dispatch);
+    return 0;
+  }
+
+  if (argc > 1 && std::string_view { argv[1] } == "phase") {
+    for (std::size_t thread_number = 1;
+         thread_number <= 2*std::thread::hardware_concurrency();
+         ++thread_number)
+      for (auto task_number : { 1, 100, 1000 })
+        for (auto scheduler : { fiber_pool::sched::round_robin,
+                                fiber_pool::sched::work_stealing })
+          for (auto persistent : { false, true })
+            phase_benchmark(thread_number, task_number, 1000, scheduler,
+                            persistent);
+    return 0;
+  }
+
+  if (argc > 1 && std::string_view { argv[1] } == "submission") {
+    for (std::size_t thread_number = 1;
+         thread_number <= 2*std::thread::hardware_concurrency();
+         ++thread_number)
+      for (auto task_number : { 1000, 10'000, 100'000 })
+        for (auto scheduler : { fiber_pool::sched::round_robin,
+                                fiber_pool::sched::shared_work,
+                                fiber_pool::sched::work_stealing })
+          for (auto bulk : { false, true })
+            submission_benchmark(thread_number, task_number, scheduler, bulk);
+    return 0;
+  }
+
+  // The default yield() benchmark, with optional "--name value" options
+  return yield_sweep({ argc, argv,
+                       argc > 1 && std::string_view { argv[1] } == "yield"
+                       ? 2 : 1 },
+                     { "none" });
+}
+catch (std::invalid_argument &e) {
+  std::cerr << "benchmark: " << e.what() << "\n\n" << usage;
+  return 1;
 }
@@ -0,0 +1,390 @@
+/** \file
+
+    A small harness to run the fiber pool benchmarks in a reproducible
+    and machine-readable way
+
+    Each point of a sweep is run a few times after some warm-up runs
+    and summarized by its median and percentiles. The results can be
+    written as JSON or CSV, and a CSV file saved from a previous run
+    can be used as a baseline to flag the regressions.
+*/
+
+#ifndef FIBER_POOL_BENCHMARK_HARNESS_HPP
+#define FIBER_POOL_BENCHMARK_HARNESS_HPP
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <initializer_list>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace benchmark_harness {
+
+/// The summary of the repeated runs of a benchmark point
+struct summary {
+  std::size_t runs = 0;
+  double median = 0;
+  /// 10th percentile
+  double p10 = 0;
+  /// 90th percentile
+  double p90 = 0;
+  double min = 0;
+  double max = 0;
+};
+
+
+/** Summarize some samples, with the percentiles interpolated linearly
+    between the closest ranks
+*/
+inline summary summarize(std::vector<double> samples) {
+  summary s;
+  s.runs = samples.size();
+  if (samples.empty())
+    return s;
+  std::sort(samples.begin(), samples.end());
+  auto percentile = [&] (double p) {
+    auto rank = p*(samples.size() - 1);
+    auto below = static_cast<std::size_t>(rank);
+    auto above = std::min(below + 1, samples.size() - 1);
+    return samples[below] + (rank - below)*(samples[above] - samples[below]);
+  };
+  s.median = percentile(0.5);
+  s.p10 = percentile(0.1);
+  s.p90 = percentile(0.9);
+  s.min = samples.front();
+  s.max = samples.back();
+  return s;
+}
+
+
+/// The result of one benchmark point
+struct measurement {
+  /// The benchmark name
+  std::string benchmark;
+
+  /// The parameter names and values, in a stable order
+  std::vector<std::pair<std::string, std::string>> parameters;
+
+  /// The measured quantity, with its unit
+  std::string metric;
+
+  /// To know in which direction a change is a regression
+  bool higher_is_better = true;
+
+  summary stats;
+
+
+  /// A key identifying the point across different runs
+  std::string key() const {
+    auto k = benchmark;
+    for (auto &[name, value] : parameters)
+      k += ' ' + name + '=' + value;
+    return k + ' ' + metric;
+  }
+};
+
+
+/// Collect the measurements and write them in various formats
+class report {
+  std::vector<measurement> measurements_;
+
+  static std::string json_string(std::string_view s) {
+    std::string quoted = "\"";
+    for (auto c : s)
+      if (c == '"' || c == '\\')
+        (quoted += '\\') += c;
+      else
+        quoted += c;
+    return quoted + '"';
+  }
+
+  /// The CSV columns preceding the parameters
+  static constexpr const char * header =
+    "benchmark,metric,higher_is_better,runs,median,p10,p90,min,max";
+
+public:
+
+  void add(measurement m) {
+    measurements_.push_back(std::move(m));
+  }
+
+
+  const std::vector<measurement> & measurements() const noexcept {
+    return measurements_;
+  }
+
+
+  /// Write a JSON array of the measurements
+  void write_json(std::ostream &o) const {
+    o << std::setprecision(9) << "[\n";
+    for (std::size_t i = 0; i < measurements_.size(); ++i) {
+      auto &m = measurements_[i];
+      o << "  { \"benchmark\": " << json_string(m.benchmark)
+        << ", \"parameters\": {";
+      for (std::size_t p = 0; p < m.parameters.size(); ++p)
+        o << (p ? ", " : " ") << json_string(m.parameters[p].first) << ": "
+          << json_string(m.parameters[p].second);
+      o << " }, \"metric\": " << json_string(m.metric)
+        << ", \"higher_is_better\": "
+        << (m.higher_is_better ? "true" : "false")
+        << ", \"runs\": " << m.stats.runs
+        << ", \"median\": " << m.stats.median
+        << ", \"p10\": " << m.stats.p10
+        << ", \"p90\": " << m.stats.p90
+        << ", \"min\": " << m.stats.min
+        << ", \"max\": " << m.stats.max << " }"
+        << (i + 1 < measurements_.size() ? ",\n" : "\n");
+    }
+    o << "]\n";
+  }
+
+
+  /** Write a CSV table of the measurements, one line each
+
+      The parameters are written in a last column as a list of
+      name=value separated by spaces, so that several benchmarks with
+      different parameters can share the same file.
+  */
+  void write_csv(std::ostream &o) const {
+    o << std::setprecision(9) << header << ",parameters\n";
+    for (auto &m : measurements_) {
+      o << m.benchmark << ',' << m.metric << ',' << m.higher_is_better
+        << ',' << m.stats.runs << ',' << m.stats.median
+        << ',' << m.stats.p10 << ',' << m.stats.p90
+        << ',' << m.stats.min << ',' << m.stats.max << ',';
+      for (std::size_t p = 0; p < m.parameters.size(); ++p)
+        o << (p ? " " : "") << m.parameters[p].first << '='
+          << m.parameters[p].second;
+      o << '\n';
+    }
+  }
+
+
+  /** Read back a CSV table written by write_csv()
+
+      \throw std::runtime_error on a file not written by write_csv()
+  */
+  static std::vector<measurement> read_csv(std::istream &i) {
+    std::vector<measurement> ms;
+    std::string line;
+    if (!std::getline(i, line) || line.rfind(header, 0) != 0)
+      throw std::runtime_error { "not a fiber pool benchmark CSV file" };
+    while (std::getline(i, line)) {
+      if (line.empty())
+        continue;
+      std::vector<std::string> fields;
+      std::istringstream l { line };
+      for (std::string f; std::getline(l, f, ',');)
+        fields.push_back(f);
+      if (fields.size() == 9)
+        fields.emplace_back();
+      if (fields.size() != 10)
+        throw std::runtime_error { "bad benchmark CSV line: " + line };
+      measurement m;
+      m.benchmark = fields[0];
+      m.metric = fields[1];
+      m.higher_is_better = fields[2] == "1";
+      m.stats.runs = std::stoul(fields[3]);
+      m.stats.median = std::stod(fields[4]);
+      m.stats.p10 = std::stod(fields[5]);
+      m.stats.p90 = std::stod(fields[6]);
+      m.stats.min = std::stod(fields[7]);
+      m.stats.max = std::stod(fields[8]);
+      std::istringstream p { fields[9] };
+      for (std::string nv; p >> nv;)
+        if (auto equal = nv.find('='); equal != nv.npos)
+          m.parameters.emplace_back(nv.substr(0, equal),
+                                    nv.substr(equal + 1));
+      ms.push_back(std::move(m));
+    }
+    return ms;
+  }
+};
+
+
+/** Compare some measurements against a baseline
+
+    A point regresses when its median is worse than the baseline median
+    by more than \p threshold percent. The points missing from one side
+    are ignored.
+
+    \return the number of regressions
+*/
+inline std::size_t compare(const std::vector<measurement> &current,
+                           const std::vector<measurement> &baseline,
+                           double threshold,
+                           std::ostream &o) {
+  std::map<std::string, const measurement *> reference;
+  for (auto &m : baseline)
+    reference[m.key()] = &m;
+  std::size_t regressions = 0;
+  for (auto &m : current) {
+    auto r = reference.find(m.key());
+    if (r == reference.end() || r->second->stats.median == 0)
+      continue;
+    auto change = 100*(m.stats.median - r->second->stats.median)
+      / std::abs(r->second->stats.median);
+    auto worse = m.higher_is_better ? -change : change;
+    bool regressed = worse > threshold;
+    regressions += regressed;
+    o << (regressed ? "REGRESSION " : "ok         ") << m.key()
+      << ": " << r->second->stats.median << " -> " << m.stats.median
+      << " (" << std::showpos << std::fixed << std::setprecision(1)
+      << change << std::noshowpos << std::defaultfloat
+      << std::setprecision(6) << " %)\n";
+  }
+  return regressions;
+}
+
+
+/** Run a benchmark point several times after some warm-up runs
+
+    \param[in] run executes the benchmark once and returns the metric
+
+    \return the metric of each repetition, excluding the warm-up runs
+*/
+inline std::vector<double> repeat(std::size_t warmup,
+                                  std::size_t repetitions,
+                                  const std::function<double()> &run) {
+  for (std::size_t i = 0; i < warmup; ++i)
+    run();
+  std::vector<double> samples;
+  for (std::size_t i = 0; i < repetitions; ++i)
+    samples.push_back(run());
+  return samples;
+}
+
+
+/** A command line made of "--name value" options
+
+    \throw std::invalid_argument on a malformed command line
+*/
+class command_line {
+  std::map<std::string, std::string, std::less<>> options_;
+
+  /// The option names asked for, to catch the mistyped ones
+  mutable std::set<std::string, std::less<>> queried_;
+
+  bool help_ = false;
+
+  template <typename T>
+  static T parse(const std::string &s) {
+    if constexpr (std::is_same_v<T, std::string>)
+      return s;
+    else if constexpr (std::is_floating_point_v<T>) {
+      std::size_t end = 0;
+      double v = 0;
+      try {
+        v = std::stod(s, &end);
+      } catch (std::exception &) {
+        // Reported below with the bad value rather than as "stod"
+      }
+      if (end == 0 || end != s.size())
+        throw std::invalid_argument { "bad number: " + s };
+      return v;
+    }
+    else {
+      T v;
+      auto [end, error] = std::from_chars(s.data(), s.data() + s.size(), v);
+      if (error != std::errc {} || end != s.data() + s.size())
+        throw std::invalid_argument { "bad integer: " + s };
+      return v;
+    }
+  }
+
+
+  /// Look an option up, remembering it is known
+  auto find(std::string_view name) const {
+    queried_.emplace(name);
+    return options_.find(name);
+  }
+
+public:
+
+  /** Parse the options from argv[first] on, with --help or -h alone
+      asking for the usage
+
+      \throw std::invalid_argument if an argument is not an --option
+      followed by its value
+  */
+  command_line(int argc, char * argv[], int first) {
+    for (int i = first; i < argc; i += 2) {
+      std::string_view name { argv[i] };
+      if (name == "--help" || name == "-h") {
+        help_ = true;
+        --i;
+        continue;
+      }
+      if (name.substr(0, 2) != "--" || i + 1 == argc)
+        throw std::invalid_argument { "expecting --option value, got "
+                                      + std::string { name } };
+      options_.emplace(name.substr(2), argv[i + 1]);
+    }
+  }
+
+
+  /// Whether the usage is asked for
+  bool help() const noexcept {
+    return help_;
+  }
+
+
+  /** Check that all the options given have been asked for, once the
+      program has read them
+
+      \param[in] later are the names of the options only read later
+
+      \throw std::invalid_argument on the first unknown option, which
+      is probably mistyped
+  */
+  void check(std::initializer_list<std::string_view> later = {}) const {
+    for (auto &[name, value] : options_)
+      if (!queried_.contains(name)
+          && std::find(later.begin(), later.end(), name) == later.end())
+        throw std::invalid_argument { "unknown option --" + name };
+  }
+
+
+  bool has(std::string_view name) const {
+    return find(name) != options_.end();
+  }
+
+
+  /// The value of an option or a default value
+  template <typename T>
+  T get(std::string_view name, T default_value) const {
+    auto o = find(name);
+    return o == options_.end() ? default_value : parse<T>(o->second);
+  }
+
+
+  /// A comma-separated list of values or a default list
+  template <typename T>
+  std::vector<T> list(std::string_view name,
+                      std::vector<T> default_values) const {
+    auto o = find(name);
+    if (o == options_.end())
+      return default_values;
+    std::vector<T> values;
+    std::istringstream s { o->second };
+    for (std::string v; std::getline(s, v, ',');)
+      values.push_back(parse<T>(v));
+    return values;
+  }
+};
+
+}
+
+#endif // FIBER_POOL_BENCHMARK_HARNESS_HPP
@@ -0,0 +1,239 @@
+/** \file
+
+    A lock-free bounded multiple-producer multiple-consumer queue
+
+    This is the classic array-based queue from Dmitry Vyukov
+    https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+
+    Each cell has a sequence number telling whether it is ready to be
+    written or to be read for a given lap around the ring, so producers
+    and consumers only fight over their own index with a CAS and never
+    over a lock.
+
+    A burst of elements is claimed with a single CAS on the index.
+
+    When there is only one producer or only one consumer, its index is
+    owned by a single thread and is just stored instead of being claimed
+    with a CAS.
+*/
+
+#ifndef FIBER_POOL_BOUNDED_MPMC_QUEUE_HPP
+#define FIBER_POOL_BOUNDED_MPMC_QUEUE_HPP
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+
+/// Size used to keep apart the data written by different threads
+inline constexpr std::size_t cache_line_size = 64;
+
+template <typename T,
+          bool single_producer = false,
+          bool single_consumer = false>
+class bounded_mpmc_queue {
+  static_assert(std::is_nothrow_move_constructible_v<T>
+                && std::is_nothrow_move_assignable_v<T>,
+                "the queue relies on non-throwing moves");
+
+  struct cell {
+    std::atomic<std::size_t> sequence;
+    T data;
+  };
+
+  /// Capacity - 1, to wrap around the ring with a mask
+  const std::size_t mask_;
+
+  std::unique_ptr<cell[]> buffer_;
+
+  /// Next position to write, on its own cache line
+  alignas(cache_line_size) std::atomic<std::size_t> enqueue_pos_ { 0 };
+
+  /// Next position to read, on its own cache line
+  alignas(cache_line_size) std::atomic<std::size_t> dequeue_pos_ { 0 };
+
+public:
+
+  /** Create a queue
+
+      \param[in] capacity is the maximum number of elements, which has
+      to be a power of 2
+  */
+  explicit bounded_mpmc_queue(std::size_t capacity)
+    : mask_ { capacity - 1 }
+    , buffer_ { new cell[capacity] } {
+    if (capacity < 2 || !std::has_single_bit(capacity))
+      throw std::invalid_argument { "capacity must be a power of 2" };
+    for (std::size_t i = 0; i != capacity; ++i)
+      buffer_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  bounded_mpmc_queue(const bounded_mpmc_queue &) = delete;
+  bounded_mpmc_queue & operator=(const bounded_mpmc_queue &) = delete;
+
+
+  std::size_t capacity() const noexcept {
+    return mask_ + 1;
+  }
+
+
+  /// Try to add an element, return false if the queue is full
+  template <typename U>
+  bool try_push(U && value) noexcept {
+    auto pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      auto &c = buffer_[pos & mask_];
+      auto seq = c.sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq)
+                - static_cast<std::ptrdiff_t>(pos);
+      if (diff == 0) {
+        // The cell is free for this lap, try to claim it
+        if constexpr (single_producer)
+          enqueue_pos_.store(pos + 1, std::memory_order_relaxed);
+        if (single_producer
+            || enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                                  std::memory_order_relaxed)) {
+          c.data = std::forward<U>(value);
+          c.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if (diff < 0)
+        // The cell still holds the element of the previous lap
+        return false;
+      else
+        // Another producer was faster, try again further
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+
+
+  /// Try to remove an element, return false if the queue is empty
+  bool try_pop(T &value) noexcept {
+    auto pos = dequeue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      auto &c = buffer_[pos & mask_];
+      auto seq = c.sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq)
+                - static_cast<std::ptrdiff_t>(pos + 1);
+      if (diff == 0) {
+        if constexpr (single_consumer)
+          dequeue_pos_.store(pos + 1, std::memory_order_relaxed);
+        if (single_consumer
+            || dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                                  std::memory_order_relaxed)) {
+          value = std::move(c.data);
+          // Make the cell available for the next lap
+          c.sequence.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      }
+      else if (diff < 0)
+        // Nothing written here yet
+        return false;
+      else
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+
+
+  /** Try to add some elements at once, moving them from \p values
+
+      \return the number of elements added, from the front of \p values
+  */
+  std::size_t try_push_n(std::span<T> values) noexcept {
+    if (values.empty())
+      return 0;
+    auto pos = enqueue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      auto free_for_lap = [&] (std::size_t i) {
+        return buffer_[(pos + i) & mask_].sequence
+          .load(std::memory_order_acquire) == pos + i;
+      };
+      if (!free_for_lap(0)) {
+        auto seq = buffer_[pos & mask_].sequence
+          .load(std::memory_order_acquire);
+        if (static_cast<std::ptrdiff_t>(seq - pos) < 0)
+          return 0;
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+        continue;
+      }
+      std::size_t n = 1;
+      while (n != values.size() && free_for_lap(n))
+        ++n;
+      if constexpr (single_producer)
+        enqueue_pos_.store(pos + n, std::memory_order_relaxed);
+      else if (!enqueue_pos_.compare_exchange_weak(pos, pos + n,
+                                                   std::memory_order_relaxed))
+        continue;
+      for (std::size_t i = 0; i != n; ++i) {
+        auto &c = buffer_[(pos + i) & mask_];
+        c.data = std::move(values[i]);
+        c.sequence.store(pos + i + 1, std::memory_order_release);
+      }
+      return n;
+    }
+  }
+
+
+  /** Try to remove as many elements as available, up to the size of
+      \p out
+
+      \return the number of elements moved to the front of \p out
+  */
+  std::size_t try_pop_n(std::span<T> out) noexcept {
+    if (out.empty())
+      return 0;
+    auto pos = dequeue_pos_.load(std::memory_order_relaxed);
+    for (;;) {
+      auto written_for_lap = [&] (std::size_t i) {
+        return buffer_[(pos + i) & mask_].sequence
+          .load(std::memory_order_acquire) == pos + i + 1;
+      };
+      if (!written_for_lap(0)) {
+        auto seq = buffer_[pos & mask_].sequence
+          .load(std::memory_order_acquire);
+        if (static_cast<std::ptrdiff_t>(seq - (pos + 1)) < 0)
+          return 0;
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+        continue;
+      }
+      std::size_t n = 1;
+      while (n != out.size() && written_for_lap(n))
+        ++n;
+      if constexpr (single_consumer)
+        dequeue_pos_.store(pos + n, std::memory_order_relaxed);
+      else if (!dequeue_pos_.compare_exchange_weak(pos, pos + n,
+                                                   std::memory_order_relaxed))
+        continue;
+      for (std::size_t i = 0; i != n; ++i) {
+        auto &c = buffer_[(pos + i) & mask_];
+        out[i] = std::move(c.data);
+        c.sequence.store(pos + i + mask_ + 1, std::memory_order_release);
+      }
+      return n;
+    }
+  }
+
+
+  /** Approximate number of elements
+
+      Only a hint since the queue can change at any time, but it never
+      takes a lock or writes anything.
+  */
+  std::size_t size_approx() const noexcept {
+    auto tail = enqueue_pos_.load(std::memory_order_relaxed);
+    auto head = dequeue_pos_.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+  }
+
+
+  bool empty_approx() const noexcept {
+    return size_approx() == 0;
+  }
+};
+
+#endif // FIBER_POOL_BOUNDED_MPMC_QUEUE_HPP
@@ -0,0 +1,169 @@
+//          Copyright Oliver Kowalke 2013 / Ronan Keryell 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// This file is adapted from
+// https://github.com/boostorg/fiber/blob/develop/include/boost/fiber/detail/context_spinlock_queue.hpp
+//
+// It provides the run queue of the work stealing scheduler.
+//
+// The main change to the original queue is to allow a thief to take
+// up to half of the queue in one operation, to reduce the number of
+// steal round trips when a worker holds a lot of fresh fibers.
+
+#ifndef BOOST_FIBERS_ALGO_CONTEXT_STEAL_QUEUE_H
+#define BOOST_FIBERS_ALGO_CONTEXT_STEAL_QUEUE_H
+
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+
+#include <boost/config.hpp>
+#include <boost/fiber/context.hpp>
+#include <boost/fiber/detail/spinlock.hpp>
+#include <boost/fiber/type.hpp>
+
+#ifdef BOOST_HAS_ABI_HEADERS
+#  include BOOST_ABI_PREFIX
+#endif
+
+namespace boost::fibers::algo {
+
+class context_steal_queue {
+
+  using slot_type = context *;
+
+  mutable boost::fibers::detail::spinlock splk_ {};
+
+  /// Where to push the next context
+  std::size_t pidx_ { 0 };
+
+  /// Where to pop the next context
+  std::size_t cidx_ { 0 };
+
+  std::size_t capacity_;
+
+  slot_type * slots_;
+
+  void resize_() {
+    slot_type * old_slots = slots_;
+    slots_ = new slot_type[2*capacity_];
+    std::size_t offset = capacity_ - cidx_;
+    std::memcpy(slots_, old_slots + cidx_, offset*sizeof(slot_type));
+    if (0 < cidx_)
+      std::memcpy(slots_ + offset, old_slots, pidx_*sizeof(slot_type));
+    cidx_ = 0;
+    pidx_ = capacity_ - 1;
+    capacity_ *= 2;
+    delete [] old_slots;
+  }
+
+  bool is_full_() const noexcept {
+    return cidx_ == ((pidx_ + 1) % capacity_);
+  }
+
+  bool is_empty_() const noexcept {
+    return cidx_ == pidx_;
+  }
+
+  std::size_t size_() const noexcept {
+    return (pidx_ + capacity_ - cidx_) % capacity_;
+  }
+
+ public:
+
+  context_steal_queue(std::size_t capacity = 4096)
+    : capacity_ { capacity } {
+    slots_ = new slot_type[capacity_];
+  }
+
+  ~context_steal_queue() {
+    delete [] slots_;
+  }
+
+  context_steal_queue(context_steal_queue const&) = delete;
+  context_steal_queue & operator=(context_steal_queue const&) = delete;
+
+
+  bool empty() const noexcept {
+    boost::fibers::detail::spinlock_lock lk { splk_ };
+    return is_empty_();
+  }
+
+
+  std::size_t size() const noexcept {
+    boost::fibers::detail::spinlock_lock lk { splk_ };
+    return size_();
+  }
+
+
+  void push(context * c) {
+    boost::fibers::detail::spinlock_lock lk { splk_ };
+    if (is_full_())
+      resize_();
+    slots_[pidx_] = c;
+    pidx_ = (pidx_ + 1) % capacity_;
+  }
+
+
+  context * pop() {
+    boost::fibers::detail::spinlock_lock lk { splk_ };
+    context * c = nullptr;
+    if (!is_empty_()) {
+      c = slots_[cidx_];
+      cidx_ = (cidx_ + 1) % capacity_;
+    }
+    return c;
+  }
+
+
+  context * steal() {
+    boost::fibers::detail::spinlock_lock lk { splk_ };
+    context * c = nullptr;
+    if (!is_empty_()) {
+      c = slots_[cidx_];
+      if (c->is_context(type::pinned_context))
+        return nullptr;
+      cidx_ = (cidx_ + 1) % capacity_;
+    }
+    return c;
+  }
+
+
+  /** Steal up to half of the queue, rounded up, in one operation
+
+      The contexts are taken from the oldest ones, stopping before a
+      pinned one which cannot migrate.
+
+      \param[out] out receives the stolen contexts
+
+      \param[in] max is the maximum number of contexts to steal
+
+      \return the number of stolen contexts
+  */
+  std::size_t steal_half(context ** out, std::size_t max) {
+    boost::fibers::detail::spinlock_lock lk { splk_ };
+    auto n = (size_() + 1)/2;
+    if (n > max)
+      n = max;
+    std::size_t stolen = 0;
+    while (stolen != n) {
+      auto c = slots_[cidx_];
+      if (c->is_context(type::pinned_context))
+        break;
+      out[stolen++] = c;
+      cidx_ = (cidx_ + 1) % capacity_;
+    }
+    return stolen;
+  }
+};
+
+}
+
+#ifdef BOOST_HAS_ABI_HEADERS
+#  include BOOST_ABI_SUFFIX
+#endif
+
+#endif // BOOST_FIBERS_ALGO_CONTEXT_STEAL_QUEUE_H
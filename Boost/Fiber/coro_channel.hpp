@@ -0,0 +1,242 @@
+/** \file
+
+    A bounded channel between the tasks of a coro_pool, possibly running
+    on different workers, with the push/pop interface of
+    boost::fibers::buffered_channel turned into awaitables:
+    co_await c.push(v) and co_await c.pop(v)
+
+    A task pushing into a full channel or popping from an empty one is
+    suspended without blocking its thread. The values are handed over
+    directly to a waiting task, which is then resumed on the worker of
+    the task waking it up, see coro_pool.hpp.
+*/
+
+#ifndef FIBER_POOL_CORO_CHANNEL_HPP
+#define FIBER_POOL_CORO_CHANNEL_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <boost/fiber/channel_op_status.hpp>
+#include <boost/fiber/detail/spinlock.hpp>
+
+#include "coro_pool.hpp"
+
+template <typename T>
+class coro_channel {
+
+  using status = boost::fibers::channel_op_status;
+
+public:
+
+  class push_awaiter;
+  class pop_awaiter;
+
+private:
+
+  /// A FIFO of waiting awaiters, linked through their next member
+  template <typename Awaiter>
+  struct waiting {
+    Awaiter * head = nullptr;
+    Awaiter * tail = nullptr;
+
+
+    void push(Awaiter * a) noexcept {
+      a->next = nullptr;
+      (tail ? tail->next : head) = a;
+      tail = a;
+    }
+
+
+    Awaiter * pop() noexcept {
+      auto a = head;
+      if (a && !(head = a->next))
+        tail = nullptr;
+      return a;
+    }
+  };
+
+  boost::fibers::detail::spinlock splk_;
+
+  /// The values, only accessed with the lock
+  std::vector<T> ring_;
+  std::size_t head_ = 0;
+  std::size_t size_ = 0;
+
+  bool closed_ = false;
+
+  /// The tasks waiting on a full channel
+  waiting<push_awaiter> pushers_;
+
+  /// The tasks waiting on an empty channel
+  waiting<pop_awaiter> poppers_;
+
+public:
+
+  class push_awaiter {
+    friend coro_channel;
+
+    coro_channel &c_;
+    T value_;
+    status result_ = status::success;
+    coro_pool::waiter waiter_;
+    push_awaiter * next = nullptr;
+
+  public:
+
+    template <typename U>
+    push_awaiter(coro_channel &c, U && value)
+      : c_ { c }
+      , value_ { std::forward<U>(value) } {}
+
+    bool await_ready() const noexcept { return false; }
+
+
+    /// \return false when the value is pushed without waiting
+    bool await_suspend(std::coroutine_handle<> h) {
+      pop_awaiter * woken = nullptr;
+      {
+        boost::fibers::detail::spinlock_lock lk { c_.splk_ };
+        if (c_.closed_) {
+          result_ = status::closed;
+          return false;
+        }
+        if ((woken = c_.poppers_.pop())) {
+          // The channel is empty, so give the value directly
+          woken->value_ = std::move(value_);
+          woken->result_ = status::success;
+        }
+        else if (c_.size_ != c_.ring_.size()) {
+          c_.ring_[(c_.head_ + c_.size_++) % c_.ring_.size()] =
+            std::move(value_);
+          return false;
+        }
+        else {
+          waiter_ = coro_pool::waiter { h };
+          c_.pushers_.push(this);
+          return true;
+        }
+      }
+      woken->waiter_.resume();
+      return false;
+    }
+
+
+    status await_resume() const noexcept { return result_; }
+  };
+
+
+  class pop_awaiter {
+    friend coro_channel;
+
+    coro_channel &c_;
+    T &value_;
+    status result_ = status::success;
+    coro_pool::waiter waiter_;
+    pop_awaiter * next = nullptr;
+
+  public:
+
+    pop_awaiter(coro_channel &c, T &value)
+      : c_ { c }
+      , value_ { value } {}
+
+    bool await_ready() const noexcept { return false; }
+
+
+    /// \return false when a value is popped without waiting
+    bool await_suspend(std::coroutine_handle<> h) {
+      push_awaiter * woken = nullptr;
+      {
+        boost::fibers::detail::spinlock_lock lk { c_.splk_ };
+        if (c_.size_ != 0) {
+          value_ = std::move(c_.ring_[c_.head_]);
+          c_.head_ = (c_.head_ + 1) % c_.ring_.size();
+          --c_.size_;
+          if (!(woken = c_.pushers_.pop()))
+            return false;
+          // Take the value of the first waiting producer in the freed slot
+          c_.ring_[(c_.head_ + c_.size_++) % c_.ring_.size()] =
+            std::move(woken->value_);
+          woken->result_ = status::success;
+        }
+        else if (c_.closed_) {
+          result_ = status::closed;
+          return false;
+        }
+        else {
+          waiter_ = coro_pool::waiter { h };
+          c_.poppers_.push(this);
+          return true;
+        }
+      }
+      woken->waiter_.resume();
+      return false;
+    }
+
+
+    status await_resume() const noexcept { return result_; }
+  };
+
+
+  /** Create a channel
+
+      \param[in] capacity is the number of values the channel can hold,
+      at least 1
+
+      \throw std::invalid_argument for a capacity of 0
+  */
+  explicit coro_channel(std::size_t capacity)
+    : ring_ ( capacity ) {
+    if (capacity == 0)
+      throw std::invalid_argument { "coro_channel needs a capacity" };
+  }
+
+  coro_channel(const coro_channel &) = delete;
+  coro_channel & operator=(const coro_channel &) = delete;
+
+
+  bool is_closed() noexcept {
+    boost::fibers::detail::spinlock_lock lk { splk_ };
+    return closed_;
+  }
+
+
+  /// Refuse any new value and wake up all the waiting tasks
+  void close() {
+    waiting<push_awaiter> pushers;
+    waiting<pop_awaiter> poppers;
+    {
+      boost::fibers::detail::spinlock_lock lk { splk_ };
+      closed_ = true;
+      std::swap(pushers, pushers_);
+      std::swap(poppers, poppers_);
+    }
+    while (auto a = pushers.pop()) {
+      a->result_ = status::closed;
+      a->waiter_.resume();
+    }
+    while (auto a = poppers.pop()) {
+      a->result_ = status::closed;
+      a->waiter_.resume();
+    }
+  }
+
+
+  /// Push a value, waiting while the channel is full
+  template <typename U>
+  push_awaiter push(U && value) {
+    return { *this, std::forward<U>(value) };
+  }
+
+
+  /// Pop a value, waiting while the channel is empty and not closed
+  pop_awaiter pop(T &value) {
+    return { *this, value };
+  }
+};
+
+#endif // FIBER_POOL_CORO_CHANNEL_HPP
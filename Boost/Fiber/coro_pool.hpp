@@ -0,0 +1,549 @@
+/** \file
+
+    A pool of C++20 stackless coroutines on a std::thread pool, with
+    the same submit/join interface as fiber_pool
+
+    A task is a coroutine returning coro_pool::task which can suspend
+    itself with co_await coro_pool::yield() or wait on a coro_channel
+    without blocking its thread. Its frame only holds what lives across
+    its suspension points instead of a whole fiber stack, and a switch
+    is just a function return and a call instead of a register save and
+    restore.
+
+    A task can co_await another task, which runs to completion before
+    the awaiting one resumes, so the code can still be split into
+    functions.
+
+    The queue a suspended task goes back to follows the scheduler
+    model: its own worker with round_robin, a queue shared by all the
+    workers with shared_work, and the queue of the worker resuming it
+    with work_stealing, the workers without work stealing from the
+    other ones.
+*/
+
+#ifndef FIBER_POOL_CORO_POOL_HPP
+#define FIBER_POOL_CORO_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <boost/fiber/detail/spinlock.hpp>
+
+#include "xorshift.hpp"
+
+class coro_pool {
+
+public:
+
+  /// To select how the suspended tasks are spread over the workers
+  enum class sched {
+    /// Each task stays on the worker it was given to
+    round_robin,
+    /// All the workers run the tasks from a single queue
+    shared_work,
+    /// A worker without work steals some from the other workers
+    work_stealing
+  };
+
+  class task;
+
+  /** Where a task waiting for an event has to be resumed
+
+      It is filled by the awaitables of the task before suspending it,
+      see coro_channel.hpp.
+  */
+  class waiter {
+    std::coroutine_handle<> handle;
+    coro_pool * pool = nullptr;
+    std::size_t worker = 0;
+
+  public:
+
+    waiter() = default;
+
+    /// Record the current task, which has to run on a coro_pool
+    explicit waiter(std::coroutine_handle<> h) noexcept
+      : handle { h }
+      , pool { current_pool }
+      , worker { current_worker } {}
+
+
+    /// Make the task ready to run again
+    void resume() const {
+      // Resume on the current worker of the same pool when allowed, so
+      // that a consumer follows its producer
+      pool->schedule(handle,
+                     pool->s != sched::round_robin && current_pool == pool
+                     ? current_worker : worker);
+    }
+  };
+
+private:
+
+  /// The runnable tasks of a worker, or of the pool with shared_work
+  struct alignas(64) run_queue {
+    boost::fibers::detail::spinlock splk;
+    std::deque<std::coroutine_handle<>> ready;
+    /// Pick the victims, see xorshift.hpp
+    xorshift32 random;
+
+
+    void push(std::coroutine_handle<> h) {
+      boost::fibers::detail::spinlock_lock lk { splk };
+      ready.push_back(h);
+    }
+
+
+    std::coroutine_handle<> pop() noexcept {
+      boost::fibers::detail::spinlock_lock lk { splk };
+      if (ready.empty())
+        return {};
+      auto h = ready.front();
+      ready.pop_front();
+      return h;
+    }
+
+
+    bool empty() noexcept {
+      boost::fibers::detail::spinlock_lock lk { splk };
+      return ready.empty();
+    }
+  };
+
+  /// The pool and the worker the current thread works for, if any
+  static inline thread_local coro_pool * current_pool = nullptr;
+  static inline thread_local std::size_t current_worker = 0;
+
+  /// The model of scheduler
+  const sched s;
+
+  /// Make a thread without work sleep instead of busy-waiting
+  const bool suspend;
+
+  /// One queue per worker, or a single one with shared_work
+  std::vector<run_queue> queues;
+
+  std::vector<std::thread> working_threads;
+
+  /// The next worker to give a submitted task to
+  std::atomic<std::size_t> next_worker = 0;
+
+  /// Refuse any new task
+  std::atomic<bool> closed = false;
+
+  /// Stop the workers once all the tasks are done
+  std::atomic<bool> stopping = false;
+
+  /// To avoid joining several times
+  bool joinable = true;
+
+  /// Number of submitted tasks not finished yet
+  std::atomic<std::size_t> unfinished = 0;
+
+  /// To wait for the end of all the tasks from outside the pool
+  std::mutex completion_mtx;
+  std::condition_variable completion_cv;
+
+  /// Number of workers sleeping or about to sleep
+  std::atomic<std::size_t> sleepers = 0;
+
+  /// Changed when some work is made available to a sleeping worker
+  std::atomic<std::uint64_t> work_epoch = 0;
+
+  /// To make the workers without work sleep
+  std::mutex sleep_mtx;
+  std::condition_variable sleep_cv;
+
+  /// The first exception thrown by a task, if any
+  std::exception_ptr first_exception;
+
+  std::mutex exception_mtx;
+
+  /// Rounds spent spinning before sleeping, when suspending
+  static constexpr unsigned spin_rounds = 64;
+
+public:
+
+  /** The coroutine type of the tasks
+
+      It starts only when submitted or awaited and it is destroyed at
+      its end by the pool for a submitted task, by the awaiting task
+      otherwise.
+  */
+  class task {
+
+  public:
+
+    struct promise_type;
+
+    using handle = std::coroutine_handle<promise_type>;
+
+    struct promise_type {
+      /// The task awaiting this one, if any
+      std::coroutine_handle<> continuation;
+
+      /// The pool running this task when submitted
+      coro_pool * pool = nullptr;
+
+      std::exception_ptr exception;
+
+      struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+
+        std::coroutine_handle<> await_suspend(handle h) noexcept {
+          auto &p = h.promise();
+          if (p.continuation)
+            // Go on with the awaiting task without growing the stack
+            return p.continuation;
+          // Nobody else owns the frame of a submitted task
+          auto pool = p.pool;
+          auto e = std::move(p.exception);
+          h.destroy();
+          pool->task_done(std::move(e));
+          return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+      };
+
+      task get_return_object() noexcept {
+        return task { handle::from_promise(*this) };
+      }
+
+      std::suspend_always initial_suspend() noexcept { return {}; }
+
+      final_awaiter final_suspend() noexcept { return {}; }
+
+      void return_void() noexcept {}
+
+      void unhandled_exception() noexcept {
+        exception = std::current_exception();
+      }
+    };
+
+    task(task &&other) noexcept : h { std::exchange(other.h, {}) } {}
+
+    task & operator=(task &&other) noexcept {
+      if (this != &other) {
+        if (h)
+          h.destroy();
+        h = std::exchange(other.h, {});
+      }
+      return *this;
+    }
+
+    ~task() {
+      if (h)
+        h.destroy();
+    }
+
+
+    /// Awaiting a task runs it up to its end
+    bool await_ready() const noexcept { return false; }
+
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting)
+      noexcept {
+      h.promise().continuation = awaiting;
+      return h;
+    }
+
+
+    /// Rethrow the exception of the awaited task, if any
+    void await_resume() {
+      if (auto e = std::move(h.promise().exception))
+        std::rethrow_exception(e);
+    }
+
+  private:
+
+    friend class coro_pool;
+
+    handle h;
+
+    explicit task(handle h) noexcept : h { h } {}
+  };
+
+
+  /// The awaitable returned by yield()
+  struct yield_awaiter {
+    bool await_ready() const noexcept { return false; }
+
+
+    /// Queue the task behind the other ready ones, if any
+    bool await_suspend(std::coroutine_handle<> h) {
+      return current_pool->reschedule(h);
+    }
+
+
+    void await_resume() const noexcept {}
+  };
+
+
+  /** Let the other tasks of the worker run
+
+      To be used as co_await coro_pool::yield() from a task.
+  */
+  static yield_awaiter yield() noexcept {
+    return {};
+  }
+
+
+  /** Create a coro_pool
+
+      \param[in] suspend makes a thread without work go to sleep
+      instead of busy-waiting
+  */
+  coro_pool(int thread_number,
+            sched scheduler,
+            bool suspend)
+    : s { scheduler }
+    , suspend { suspend }
+    , queues ( scheduler == sched::shared_work ? 1 : thread_number ) {
+    for (std::size_t i = 0; i != queues.size(); ++i)
+      queues[i].random = xorshift32 { static_cast<std::uint32_t>(i) };
+    for (int i = 0; i != thread_number; ++i)
+      working_threads.emplace_back([this, i] { run(i); });
+  }
+
+
+  /** Submit a task
+
+      An exception thrown by the task is rethrown by join().
+  */
+  void submit(task t) {
+    if (closed.load(std::memory_order_acquire))
+      // Forget about it, as fiber_pool does with a closed inbox
+      return;
+    auto h = std::exchange(t.h, {});
+    h.promise().pool = this;
+    unfinished.fetch_add(1, std::memory_order_relaxed);
+    schedule(h, next_worker.fetch_add(1, std::memory_order_relaxed)
+             % working_threads.size());
+  }
+
+
+  /** Submit some work
+
+      The callable is either a coroutine returning a task or a plain
+      function, which runs without any suspension point. It is kept
+      alive until the end of the work, so a lambda coroutine can use its
+      captures safely.
+  */
+  template <typename Callable>
+  void submit(Callable && work) {
+    submit(launch(std::forward<Callable>(work)));
+  }
+
+
+  /** Submit n works in one operation
+
+      \param[in] factory is called with 0, 1... n - 1 to produce the
+      callables or the tasks to run
+  */
+  template <typename Factory>
+  void submit_n(std::size_t n, Factory && factory) {
+    for (std::size_t i = 0; i != n; ++i)
+      submit(factory(i));
+  }
+
+
+  /// Close the submission
+  void close() {
+    closed.store(true, std::memory_order_release);
+  }
+
+
+  /** Wait for all the tasks to finish and stop the workers
+
+      It must not be called from a task of the pool.
+
+      \throw the first exception thrown by a task, if any
+  */
+  void join() {
+    // Can be done only once
+    if (!joinable)
+      return;
+    joinable = false;
+    close();
+    {
+      std::unique_lock lk { completion_mtx };
+      completion_cv.wait(lk, [&] {
+        return unfinished.load(std::memory_order_acquire) == 0;
+      });
+    }
+    stopping.store(true, std::memory_order_release);
+    wake_all();
+    for (auto &t : working_threads)
+      t.join();
+    if (first_exception)
+      std::rethrow_exception(first_exception);
+  }
+
+
+  /// Wait for some remaining work to be done
+  ~coro_pool() {
+    // Join first if not done already
+    join();
+  }
+
+private:
+
+  /// Wrap some work into a task owning it
+  template <typename Callable>
+  static task launch(Callable work) {
+    if constexpr (std::is_same_v<std::invoke_result_t<Callable &>, task>)
+      co_await std::invoke(work);
+    else
+      std::invoke(work);
+  }
+
+
+  /// Submitting a task directly does not need any wrapper
+  static task launch(task t) {
+    return t;
+  }
+
+
+  /// Account for a finished task and wake up join() on the last one
+  void task_done(std::exception_ptr e) {
+    if (e) {
+      std::unique_lock lk { exception_mtx };
+      if (!first_exception)
+        first_exception = std::move(e);
+    }
+    if (unfinished.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      std::unique_lock lk { completion_mtx };
+      completion_cv.notify_all();
+    }
+  }
+
+
+  run_queue & queue_of(std::size_t worker) noexcept {
+    return queues[s == sched::shared_work ? 0 : worker];
+  }
+
+
+  /// Make a task ready to run on a worker
+  void schedule(std::coroutine_handle<> h, std::size_t worker) {
+    queue_of(worker).push(h);
+    if (suspend) {
+      // Order the push before reading sleepers, against the order of a
+      // worker going to sleep
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (sleepers.load(std::memory_order_relaxed)) {
+        work_epoch.fetch_add(1, std::memory_order_relaxed);
+        std::unique_lock lk { sleep_mtx };
+        lk.unlock();
+        // With round_robin, only the target worker can run the task and
+        // a single notification may wake up another one instead
+        if (s == sched::round_robin)
+          sleep_cv.notify_all();
+        else
+          sleep_cv.notify_one();
+      }
+    }
+  }
+
+
+  /** Queue the current task of this worker again
+
+      \return false when there is nothing else to run, so the task just
+      goes on
+  */
+  bool reschedule(std::coroutine_handle<> h) {
+    if (queue_of(current_worker).empty())
+      return false;
+    schedule(h, current_worker);
+    return true;
+  }
+
+
+  void wake_all() {
+    work_epoch.fetch_add(1, std::memory_order_relaxed);
+    std::unique_lock lk { sleep_mtx };
+    lk.unlock();
+    sleep_cv.notify_all();
+  }
+
+
+  /// Try to steal a task from the other workers, starting at random
+  std::coroutine_handle<> steal(std::size_t worker) noexcept {
+    auto size = queues.size();
+    auto start = queues[worker].random() % size;
+    for (std::size_t k = 0; k != size; ++k)
+      if (auto victim = (start + k) % size; victim != worker)
+        if (auto h = queues[victim].pop())
+          return h;
+    return {};
+  }
+
+
+  /// The next task for a worker to run, if any
+  std::coroutine_handle<> next(std::size_t worker) noexcept {
+    if (auto h = queue_of(worker).pop())
+      return h;
+    if (s == sched::work_stealing && queues.size() > 1)
+      return steal(worker);
+    return {};
+  }
+
+
+  /// Sleep until some work may be available
+  void sleep(std::size_t worker) {
+    sleepers.fetch_add(1, std::memory_order_seq_cst);
+    auto epoch = work_epoch.load(std::memory_order_relaxed);
+    // Look again after announcing the sleep, since a task queued before
+    // may have missed it
+    if (auto h = next(worker)) {
+      sleepers.fetch_sub(1, std::memory_order_relaxed);
+      h.resume();
+      return;
+    }
+    std::unique_lock lk { sleep_mtx };
+    sleep_cv.wait(lk, [&] {
+      return work_epoch.load(std::memory_order_relaxed) != epoch
+        || stopping.load(std::memory_order_acquire);
+    });
+    sleepers.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+
+  /// The thread worker job
+  void run(std::size_t worker) {
+    current_pool = this;
+    current_worker = worker;
+    unsigned idle_rounds = 0;
+    for (;;) {
+      if (auto h = next(worker)) {
+        idle_rounds = 0;
+        h.resume();
+        continue;
+      }
+      if (stopping.load(std::memory_order_acquire))
+        break;
+      if (suspend && idle_rounds == spin_rounds)
+        sleep(worker);
+      else {
+        idle_rounds += idle_rounds < spin_rounds;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+      }
+    }
+    current_pool = nullptr;
+  }
+};
+
+#endif // FIBER_POOL_CORO_POOL_HPP
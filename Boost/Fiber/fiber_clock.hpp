@@ -0,0 +1,224 @@
+/** \file
+
+    A clock making some fibers run in lockstep, like the processes of a
+    synchronous circuit, with a fiber barrier scaling to thousands of
+    fibers over many threads
+
+    The barrier is a combining tree: the participants are spread over
+    some leaf nodes of fan_in participants each and only the last one
+    arriving at a node goes on to the parent node. The last one arriving
+    at the root advances the cycle. The release goes down the same
+    tree, each last arriver waking up the fibers waiting on the node it
+    has completed, so that neither the arrival nor the release
+    serializes on a single lock or counter.
+
+    A waiting fiber is parked on its node the same way as in
+    ring_channel.hpp, so another fiber of its thread can run meanwhile.
+
+    A participant leaving the clock never waits, even when it completes
+    a node: the node then goes on to its parent without any fiber and is
+    released along with the parent at the end of the cycle.
+*/
+
+#ifndef FIBER_POOL_FIBER_CLOCK_HPP
+#define FIBER_POOL_FIBER_CLOCK_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <boost/fiber/context.hpp>
+#include <boost/fiber/detail/spinlock.hpp>
+
+class fiber_clock {
+
+  using context = boost::fibers::context;
+
+  struct alignas(64) node {
+    /// The number of participants expected in the high half and the
+    /// number of them arrived in the current cycle in the low half
+    std::atomic<std::uint64_t> state { 0 };
+
+    /// The number of cycles released, only changed with the lock
+    std::atomic<std::uint64_t> generation { 0 };
+
+    boost::fibers::detail::spinlock splk;
+
+    /// The fibers waiting for the release of this node
+    context::wait_queue_t waiters;
+
+    /// The completed child nodes without any fiber to release them,
+    /// linked through next_deferred
+    node * deferred = nullptr;
+
+    /// Only changed with the lock of the parent node
+    node * next_deferred = nullptr;
+  };
+
+  static constexpr std::uint64_t one_expected = std::uint64_t { 1 } << 32;
+
+  /// The levels of the tree, from the leaves to the root
+  std::vector<std::vector<node>> levels;
+
+  const std::size_t fan_in;
+
+  const std::size_t participant_number;
+
+  std::atomic<std::uint64_t> cycle_ { 0 };
+
+  /// Park the calling fiber until a node releases \p generation
+  void wait(node &n, std::uint64_t generation) {
+    auto active_ctx = context::active();
+    boost::fibers::detail::spinlock_lock lk { n.splk };
+    while (n.generation.load(std::memory_order_relaxed) == generation) {
+      active_ctx->wait_link(n.waiters);
+      active_ctx->twstatus.store(0, std::memory_order_release);
+      active_ctx->suspend(lk);
+      lk.lock();
+    }
+  }
+
+
+  /// Start the next generation of a node and wake up its waiters and
+  /// its deferred children
+  void release(node &n) {
+    auto active_ctx = context::active();
+    node * deferred;
+    {
+      boost::fibers::detail::spinlock_lock lk { n.splk };
+      n.generation.fetch_add(1, std::memory_order_release);
+      while (!n.waiters.empty()) {
+        auto ctx = &n.waiters.front();
+        n.waiters.pop_front();
+        active_ctx->schedule(ctx);
+      }
+      deferred = std::exchange(n.deferred, nullptr);
+    }
+    while (deferred) {
+      // A released child can be deferred again for the next cycle
+      auto next = deferred->next_deferred;
+      release(*deferred);
+      deferred = next;
+    }
+  }
+
+
+  /** Arrive at a node for the current cycle
+
+      \param[in] leave removes the participant, a fiber or a child node,
+      from the node for all the next cycles
+
+      \param[in] waiting makes the arriving fiber wait for the release
+      of the cycle
+
+      \param[in] child is the completed child node arriving without any
+      fiber, to be released with this node
+  */
+  void arrive(std::size_t level, std::size_t index, bool leave,
+              bool waiting, node * child = nullptr) {
+    auto &n = levels[level][index];
+    auto generation = n.generation.load(std::memory_order_acquire);
+    if (child) {
+      // Before arriving, since this node cannot be released without
+      // this arrival
+      boost::fibers::detail::spinlock_lock lk { n.splk };
+      child->next_deferred = std::exchange(n.deferred, child);
+    }
+    auto change = leave ? -one_expected : 1;
+    auto state = n.state.fetch_add(change, std::memory_order_acq_rel)
+      + change;
+    auto expected = state >> 32;
+    if ((state & (one_expected - 1)) != expected) {
+      if (waiting)
+        wait(n, generation);
+      return;
+    }
+    // The last one arriving resets the node before anybody can arrive
+    // for the next cycle, since they are all waiting for the release
+    n.state.store(expected << 32, std::memory_order_relaxed);
+    if (level + 1 == levels.size()) {
+      // Not a new cycle when all the participants have left
+      if (expected != 0)
+        cycle_.fetch_add(1, std::memory_order_acq_rel);
+    }
+    else if (!waiting && expected != 0) {
+      // Nobody can wait for the end of the cycle here, so let the
+      // parent release this node
+      arrive(level + 1, index/fan_in, false, false, &n);
+      return;
+    }
+    else
+      // A node without any participant left leaves its parent too
+      arrive(level + 1, index/fan_in, expected == 0, waiting);
+    release(n);
+  }
+
+public:
+
+  /** Create a clock
+
+      \param[in] participants is the number of fibers calling
+      wait_for_clock() at each cycle, numbered from 0
+
+      \param[in] fan_in is the number of children of a tree node
+
+      \throw std::invalid_argument if fan_in is less than 2
+  */
+  explicit fiber_clock(std::size_t participants, std::size_t fan_in = 4)
+    : fan_in { fan_in }
+    , participant_number { participants } {
+    if (fan_in < 2)
+      throw std::invalid_argument { "fiber_clock: fan_in less than 2" };
+    // Each level has ceil(size/fan_in) nodes up to a single root
+    for (auto size = participants; size != 0;) {
+      auto nodes = (size + fan_in - 1)/fan_in;
+      auto &l = levels.emplace_back(nodes);
+      for (std::size_t i = 0; i != nodes; ++i) {
+        auto children = std::min(fan_in, size - i*fan_in);
+        l[i].state.store(children*one_expected, std::memory_order_relaxed);
+      }
+      size = nodes == 1 ? 0 : nodes;
+    }
+  }
+
+  fiber_clock(const fiber_clock &) = delete;
+  fiber_clock & operator=(const fiber_clock &) = delete;
+
+
+  std::size_t participants() const noexcept {
+    return participant_number;
+  }
+
+
+  /// The number of cycles completed so far
+  std::uint64_t cycle() const noexcept {
+    return cycle_.load(std::memory_order_acquire);
+  }
+
+
+  /** Wait for all the participants to finish the current cycle
+
+      \return the number of the new cycle
+  */
+  std::uint64_t wait_for_clock(std::size_t participant) {
+    arrive(0, participant/fan_in, false, true);
+    return cycle();
+  }
+
+
+  /** Leave the clock, finishing the current cycle for this participant
+      without waiting and not taking part in the next ones
+
+      It never waits, so several participants can be dropped in a row
+      by the same fiber.
+  */
+  void drop(std::size_t participant) {
+    arrive(0, participant/fan_in, true, false);
+  }
+};
+
+#endif // FIBER_POOL_FIBER_CLOCK_HPP
@@ -0,0 +1,175 @@
+/** \file
+
+    A multiple-producer single-consumer inbox where a fiber can wait
+    for some work without blocking its thread
+
+    Producers push without any lock with a CAS on a linked list and the
+    consumer takes the whole list at once, so there is no ABA problem.
+    The closing marks the same word as the list, so a push either lands
+    before it and is seen by the consumer or fails.
+    The producers take the lock of the consumer only when it is really
+    sleeping on the inbox. The consumer is parked directly on the inbox
+    as in ring_channel.hpp, which is much faster to wake up from another
+    thread than a fiber mutex and condition variable.
+*/
+
+#ifndef FIBER_POOL_FIBER_INBOX_HPP
+#define FIBER_POOL_FIBER_INBOX_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <boost/fiber/context.hpp>
+#include <boost/fiber/detail/spinlock.hpp>
+
+template <typename T>
+class fiber_inbox {
+
+  struct node {
+    T value;
+    node * next;
+  };
+
+  /// The address of the last pushed element, the list being in LIFO
+  /// order, with closed_bit set once the inbox is closed
+  std::atomic<std::uintptr_t> head_ { 0 };
+
+  static constexpr std::uintptr_t closed_bit = 1;
+
+  /// Set by the consumer just before sleeping
+  std::atomic<bool> waiting_ { false };
+
+  /// A load measure for the producers to choose among several inboxes
+  std::atomic<std::ptrdiff_t> load_ { 0 };
+
+  /// Protect consumer_
+  boost::fibers::detail::spinlock splk_;
+
+  /// The consumer fiber when it is sleeping
+  boost::fibers::context * consumer_ = nullptr;
+
+  static node * list(std::uintptr_t head) noexcept {
+    return reinterpret_cast<node *>(head & ~closed_bit);
+  }
+
+
+  /// Take the whole list, keeping the closed mark
+  std::uintptr_t take(std::memory_order order) noexcept {
+    return head_.fetch_and(closed_bit, order);
+  }
+
+
+  void wake_up() {
+    // Taking the lock avoids notifying between the last check of the
+    // consumer and its actual sleep
+    boost::fibers::detail::spinlock_lock lk { splk_ };
+    if (auto ctx = std::exchange(consumer_, nullptr)) {
+      lk.unlock();
+      boost::fibers::context::active()->schedule(ctx);
+    }
+  }
+
+public:
+
+  using value_type = T;
+
+  fiber_inbox() = default;
+
+  fiber_inbox(const fiber_inbox &) = delete;
+  fiber_inbox & operator=(const fiber_inbox &) = delete;
+
+
+  ~fiber_inbox() {
+    for (auto n = list(head_.load(std::memory_order_acquire)); n;)
+      delete std::exchange(n, n->next);
+  }
+
+
+  /** Add an element without taking any lock unless the consumer is
+      sleeping
+
+      \param[in] weight is added to the load of the inbox
+
+      \return false if the inbox is closed and the value is dropped
+  */
+  bool push(T value, std::ptrdiff_t weight = 1) {
+    auto head = head_.load(std::memory_order_relaxed);
+    auto n = new node { std::move(value), nullptr };
+    do {
+      if (head & closed_bit) {
+        delete n;
+        return false;
+      }
+      n->next = list(head);
+    } while (!head_.compare_exchange_weak(head,
+                                          reinterpret_cast<std::uintptr_t>(n),
+                                          std::memory_order_seq_cst,
+                                          std::memory_order_relaxed));
+    load_.fetch_add(weight, std::memory_order_relaxed);
+    if (waiting_.load(std::memory_order_seq_cst))
+      wake_up();
+    return true;
+  }
+
+
+  /** Wait for some elements and move all of them at the end of \p out
+      in FIFO order
+
+      \return false when the inbox is closed and empty
+  */
+  bool pop_all(std::vector<T> &out) {
+    auto n = list(take(std::memory_order_acquire));
+    if (!n) {
+      auto active_ctx = boost::fibers::context::active();
+      for (;;) {
+        boost::fibers::detail::spinlock_lock lk { splk_ };
+        waiting_.store(true, std::memory_order_seq_cst);
+        // Check again now that a producer is guaranteed to see the
+        // consumer waiting
+        auto head = take(std::memory_order_seq_cst);
+        n = list(head);
+        // Nothing can be pushed any more once closed
+        if (n || head & closed_bit)
+          break;
+        consumer_ = active_ctx;
+        active_ctx->twstatus.store(0, std::memory_order_release);
+        active_ctx->suspend(lk);
+      }
+      waiting_.store(false, std::memory_order_relaxed);
+      if (!n)
+        return false;
+    }
+    // Reverse the LIFO list to restore the submission order
+    node * fifo = nullptr;
+    while (n)
+      fifo = std::exchange(n, std::exchange(n->next, fifo));
+    while (fifo) {
+      out.push_back(std::move(fifo->value));
+      delete std::exchange(fifo, fifo->next);
+    }
+    return true;
+  }
+
+
+  /// Stop accepting new elements and wake up the consumer
+  void close() {
+    head_.fetch_or(closed_bit, std::memory_order_seq_cst);
+    wake_up();
+  }
+
+
+  /// Decrease the load, for example when some work is finished
+  void unload(std::ptrdiff_t weight = 1) noexcept {
+    load_.fetch_sub(weight, std::memory_order_relaxed);
+  }
+
+
+  std::ptrdiff_t load() const noexcept {
+    return load_.load(std::memory_order_relaxed);
+  }
+};
+
+#endif // FIBER_POOL_FIBER_INBOX_HPP
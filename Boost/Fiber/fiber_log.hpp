@@ -0,0 +1,359 @@
+/** \file
+
+    A logging facility cheap enough for the fiber hot paths
+
+    The level of a call is filtered at compile time against
+    TRISYCL_FIBER_LOG_LEVEL, the numeric value of a fiber_log::level
+    (info by default), so a call below it is an empty inline function.
+
+    In buffered mode, an enabled call only copies a fixed-size binary
+    record made of a time-stamp, the fiber and thread ids, the format
+    string address and the raw arguments into a ring buffer of the
+    calling thread, without any lock. A background thread drains the
+    rings and does the formatting. When a ring is full the record is
+    dropped and counted instead of blocking the caller.
+
+    In synchronous mode, the message is formatted and written under a
+    lock right away, as a classic logger does.
+
+    The format uses "{}" as placeholders. The arguments have to be
+    trivially copyable and a const char * argument has to live until
+    the record is printed, like a string literal.
+*/
+
+#ifndef FIBER_POOL_FIBER_LOG_HPP
+#define FIBER_POOL_FIBER_LOG_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include <boost/fiber/operations.hpp>
+
+class fiber_log {
+
+public:
+
+  enum class level : std::uint8_t { trace, debug, info, warn, error, off };
+
+  /// The calls below this level are compiled out
+#ifdef TRISYCL_FIBER_LOG_LEVEL
+  static constexpr level compiled_level =
+    static_cast<level>(TRISYCL_FIBER_LOG_LEVEL);
+#else
+  static constexpr level compiled_level = level::info;
+#endif
+
+  /// How the records reach the output
+  enum class mode {
+    /// Through per-thread rings formatted by a background thread
+    buffered,
+    /// Formatted by the caller under a lock
+    synchronous
+  };
+
+  /// Maximum size of the arguments of a call
+  static constexpr std::size_t argument_size = 48;
+
+
+  static constexpr bool enabled(level l) noexcept {
+    return l >= compiled_level && l != level::off;
+  }
+
+private:
+
+  using printer = void (*)(std::ostream &, const char *, const std::byte *);
+
+  struct record_type {
+    std::int64_t ns;
+    boost::fibers::fiber::id fiber;
+    std::thread::id thread;
+    /// The format string address identifies the call site
+    const char * format;
+    /// Decode the arguments according to the call site types
+    printer print;
+    level severity;
+    std::byte arguments[argument_size];
+  };
+
+  /// The records of a thread, written only by this thread and read
+  /// only by the background thread
+  struct ring {
+    std::vector<record_type> records;
+    alignas(64) std::atomic<std::uint64_t> written = 0;
+    alignas(64) std::atomic<std::uint64_t> read = 0;
+    std::atomic<std::uint64_t> dropped = 0;
+
+    explicit ring(std::size_t capacity) : records ( capacity ) {}
+  };
+
+  /// The ring of the current thread, created on its first record
+  static inline thread_local ring * current = nullptr;
+
+  /// Protect rings, the output and the background thread
+  static inline std::mutex lock;
+
+  /// All the rings ever created, kept until the end of the program
+  static inline std::vector<std::unique_ptr<ring>> rings;
+
+  static inline std::size_t ring_capacity = 1 << 12;
+
+  /// Where to write, nullptr when logging is not started
+  static inline std::atomic<std::ostream *> sink = nullptr;
+
+  static inline mode current_mode = mode::buffered;
+
+  static inline std::thread formatter;
+
+  static inline std::atomic<bool> stopping = false;
+
+  static inline std::chrono::steady_clock::time_point start_time;
+
+  static const char * name(level l) noexcept {
+    switch (l) {
+    case level::trace: return "trace";
+    case level::debug: return "debug";
+    case level::info: return "info";
+    case level::warn: return "warn";
+    case level::error: return "error";
+    case level::off: return "off";
+    }
+    return "?";
+  }
+
+
+  static void substitute(std::ostream &o, std::string_view format) {
+    o << format;
+  }
+
+
+  /// Replace each "{}" of the format by the next argument
+  template <typename Arg, typename... Args>
+  static void substitute(std::ostream &o,
+                         std::string_view format,
+                         const Arg &arg,
+                         const Args &... args) {
+    auto placeholder = format.find("{}");
+    if (placeholder == format.npos) {
+      o << format;
+      return;
+    }
+    o << format.substr(0, placeholder) << arg;
+    substitute(o, format.substr(placeholder + 2), args...);
+  }
+
+
+  /// Decode the arguments of a record and print its message
+  template <typename... Args>
+  static void print(std::ostream &o,
+                    const char * format,
+                    const std::byte * arguments) {
+    std::size_t offset = 0;
+    [[maybe_unused]] auto next = [&] <typename Arg>
+      (std::type_identity<Arg>) {
+      Arg a;
+      std::memcpy(&a, arguments + offset, sizeof(Arg));
+      offset += sizeof(Arg);
+      return a;
+    };
+    // The braced initialization decodes the arguments in order
+    std::tuple<Args...> args { next(std::type_identity<Args> {})... };
+    std::apply([&] (const auto &... a) { substitute(o, format, a...); },
+               args);
+  }
+
+
+  static void write(std::ostream &o, const record_type &r) {
+    o << '[' << (r.ns - std::chrono::duration_cast<std::chrono::nanoseconds>
+                 (start_time.time_since_epoch()).count())/1000
+      << " us] [" << name(r.severity) << "] Fiber " << r.fiber
+      << " on thread " << r.thread << ": ";
+    r.print(o, r.format, r.arguments);
+    o << '\n';
+  }
+
+
+  /// Encode a call into a record
+  template <level L, typename... Args>
+  static void fill(record_type &r,
+                   std::int64_t ns,
+                   const char * format,
+                   const Args &... args) noexcept {
+    r.ns = ns;
+    r.fiber = boost::this_fiber::get_id();
+    r.thread = std::this_thread::get_id();
+    r.format = format;
+    r.print = &print<Args...>;
+    r.severity = L;
+    std::size_t offset = 0;
+    ((std::memcpy(r.arguments + offset, &args, sizeof(Args)),
+      offset += sizeof(Args)), ...);
+  }
+
+
+  static ring & register_thread() {
+    std::scoped_lock lk { lock };
+    rings.push_back(std::make_unique<ring>(ring_capacity));
+    return *(current = rings.back().get());
+  }
+
+
+  /** Format all the records written so far, in time order
+
+      \return the number of records formatted
+  */
+  static std::size_t drain(std::ostream &o) {
+    std::vector<record_type> batch;
+    std::scoped_lock lk { lock };
+    for (auto &r : rings) {
+      auto size = r->records.size();
+      auto read = r->read.load(std::memory_order_relaxed);
+      auto written = r->written.load(std::memory_order_acquire);
+      for (; read != written; ++read)
+        batch.push_back(r->records[read & (size - 1)]);
+      r->read.store(read, std::memory_order_release);
+    }
+    std::stable_sort(batch.begin(), batch.end(),
+                     [] (auto &a, auto &b) { return a.ns < b.ns; });
+    for (auto &r : batch)
+      write(o, r);
+    return batch.size();
+  }
+
+public:
+
+  /** Start logging
+
+      \param[in] capacity is the number of records of each thread ring
+      created from now on, a power of 2
+
+      \throw std::invalid_argument if the capacity is not a power of 2
+  */
+  static void start(std::ostream &o,
+                    mode m = mode::buffered,
+                    std::size_t capacity = 1 << 12) {
+    if (!std::has_single_bit(capacity))
+      throw std::invalid_argument { "capacity must be a power of 2" };
+    stop();
+    std::scoped_lock lk { lock };
+    ring_capacity = capacity;
+    current_mode = m;
+    start_time = std::chrono::steady_clock::now();
+    stopping = false;
+    for (auto &r : rings)
+      r->dropped.store(0, std::memory_order_relaxed);
+    if (m == mode::buffered)
+      formatter = std::thread { [&o] {
+        while (!stopping.load(std::memory_order_acquire))
+          if (drain(o) == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds { 1 });
+      } };
+    sink.store(&o, std::memory_order_release);
+  }
+
+
+  /// Stop logging, after formatting all the pending records
+  static void stop() {
+    auto o = sink.exchange(nullptr, std::memory_order_acq_rel);
+    if (!o)
+      return;
+    stopping = true;
+    if (formatter.joinable())
+      formatter.join();
+    // Print the records written since the last drain
+    drain(*o);
+    if (auto d = dropped())
+      *o << "fiber_log: " << d << " records dropped\n";
+    o->flush();
+  }
+
+
+  /// Number of records dropped on full rings since the start
+  static std::uint64_t dropped() {
+    std::scoped_lock lk { lock };
+    std::uint64_t d = 0;
+    for (auto &r : rings)
+      d += r->dropped.load(std::memory_order_relaxed);
+    return d;
+  }
+
+
+  /// Log a message if the level is compiled in and logging is started
+  template <level L, typename... Args>
+  static void log([[maybe_unused]] const char * format,
+                  [[maybe_unused]] const Args &... args) {
+    if constexpr (enabled(L)) {
+      static_assert((std::is_trivially_copyable_v<Args> && ...),
+                    "fiber_log arguments have to be trivially copyable");
+      static_assert((sizeof(Args) + ... + 0) <= argument_size,
+                    "too many fiber_log arguments");
+      auto o = sink.load(std::memory_order_acquire);
+      if (!o)
+        return;
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+      if (current_mode == mode::synchronous) {
+        record_type r;
+        fill<L>(r, ns, format, args...);
+        std::scoped_lock lk { lock };
+        write(*o, r);
+        return;
+      }
+      auto &r = current ? *current : register_thread();
+      auto written = r.written.load(std::memory_order_relaxed);
+      if (written - r.read.load(std::memory_order_acquire)
+          == r.records.size()) {
+        r.dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      fill<L>(r.records[written & (r.records.size() - 1)], ns, format,
+              args...);
+      r.written.store(written + 1, std::memory_order_release);
+    }
+  }
+
+
+  template <typename... Args>
+  static void trace(const char * format, const Args &... args) {
+    log<level::trace>(format, args...);
+  }
+
+
+  template <typename... Args>
+  static void debug(const char * format, const Args &... args) {
+    log<level::debug>(format, args...);
+  }
+
+
+  template <typename... Args>
+  static void info(const char * format, const Args &... args) {
+    log<level::info>(format, args...);
+  }
+
+
+  template <typename... Args>
+  static void warn(const char * format, const Args &... args) {
+    log<level::warn>(format, args...);
+  }
+
+
+  template <typename... Args>
+  static void error(const char * format, const Args &... args) {
+    log<level::error>(format, args...);
+  }
+};
+
+#endif // FIBER_POOL_FIBER_LOG_HPP
@@ -4,16 +4,65 @@
 
     The use case is for circuit emulation when there are a lot of
     fibers launched at the beginning and they have to run concurrently.
+
+    The pool can be reused for several phases of work by waiting for
+    the end of each one with wait_idle() instead of join().
+
+    The fibers submitted with submit_clocked() can also run in lockstep
+    like the processes of a synchronous circuit, each one calling
+    wait_for_clock() at the end of each cycle.
+
+    With the work-stealing schedulers, the number of active workers can
+    change at runtime with set_workers() or follow the load
+    automatically, up to the number of threads of the pool.
+
+    The work can be cancelled cooperatively with cancel(): the tasks
+    not started yet are dropped and the running ones are expected to
+    poll stop_requested(), for example at their yield points.
+
+    The fibers sleeping with sleep_for() or sleep_until() wait on a
+    timing wheel of their worker with the pooled schedulers, so that
+    thousands of them can sleep at a fine granularity, and cancel()
+    wakes them up early.
 */
 
+#ifndef FIBER_POOL_FIBER_POOL_HPP
+#define FIBER_POOL_FIBER_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 #include <boost/fiber/all.hpp>
 #include <boost/thread/barrier.hpp>
 #include <range/v3/all.hpp>
 
+#include "fiber_clock.hpp"
+#include "fiber_inbox.hpp"
+#include "fiber_stack.hpp"
+#include "fiber_trace.hpp"
+#include "numa_topology.hpp"
+#include "pooled_priority_stealing.hpp"
 #include "pooled_shared_work.hpp"
 #include "pooled_work_stealing.hpp"
+#include "small_task.hpp"
+#include "timing_wheel.hpp"
 
 class fiber_pool {
 
@@ -23,8 +72,106 @@ public:
   enum class sched {
     round_robin,
     shared_work,
-    work_stealing
-    // \todo Add numa
+    /// Like shared_work but with a mostly lock-free global queue
+    lockfree_shared_work,
+    work_stealing,
+    /// Work stealing inside a NUMA node first, with the workers bound
+    /// to the CPUs of their node
+    numa,
+    /// Work stealing running the most urgent fibers first, see
+    /// submit(int, Callable)
+    priority
+  };
+
+  /// To select how the submitted work is spread over the workers,
+  /// each worker creating the fibers of its own work
+  enum class distribution {
+    /// Everything goes to worker 0, as with the original design
+    first_worker,
+    /// Cycle over the workers
+    round_robin,
+    /// Pick the worker with the fewest unfinished tasks
+    least_loaded
+  };
+
+  /// How a worker thread without work waits
+  using idle_mode = boost::fibers::algo::idle_mode;
+
+  /// How a work-stealing worker chooses its victims
+  using victim_selection = boost::fibers::algo::victim_selection;
+
+  /// The activity counters of a worker
+  using worker_stats = boost::fibers::algo::worker_stats;
+
+  /// To select where the worker threads run
+  enum class placement {
+    /// Let the OS migrate the workers freely
+    none,
+    /// Pin consecutive workers to neighbour CPUs, filling the SMT
+    /// siblings of a core and then a NUMA node before the next ones
+    compact,
+    /// Pin consecutive workers as far as possible from each other,
+    /// cycling over the NUMA nodes and over the physical cores
+    scatter,
+    /// Pin worker i to the i-th CPU of an explicit list, modulo its size
+    cpu_list
+  };
+
+  /// Some tuning of the pool beyond the scheduler choice
+  struct options {
+    /// How a thread without work waits. It has no effect on the
+    /// round-robin scheduler
+    idle_mode idle = idle_mode::busy;
+
+    /// How the submitted work is given to the workers. Bulk submissions
+    /// are split evenly over all the workers except for first_worker
+    distribution dispatch = distribution::round_robin;
+
+    /// The machine description used by sched::numa and by the
+    /// compact and scatter placements, read from sysfs when left empty
+    numa_topology topology {};
+
+    /// Where the worker threads run. Each worker is pinned to a single
+    /// CPU, except with none where sched::numa pins a worker to all the
+    /// CPUs of its node
+    placement place = placement::none;
+
+    /// The CPUs used by placement::cpu_list
+    std::vector<int> cpus {};
+
+    /// Refuse any new work once a task has thrown an exception
+    bool fail_fast = false;
+
+    /// How the fiber stacks are allocated
+    stack_policy stack {};
+
+    /// The victim order of sched::work_stealing. sched::numa always
+    /// tries the local node first
+    victim_selection victims = victim_selection::random;
+
+    /// With the work-stealing schedulers, steal half of the victim
+    /// queue at once instead of a single fiber
+    bool steal_half = false;
+
+    /// The number of scheduling events kept for each worker, a power of
+    /// 2, when compiled with TRISYCL_FIBER_POOL_TRACE
+    std::size_t trace_capacity = 1 << 16;
+
+    /// Where join() writes the Chrome trace-event JSON timeline when
+    /// compiled with TRISYCL_FIBER_POOL_TRACE, nowhere if empty
+    std::string trace_file = "fiber_pool_trace.json";
+
+    /// With the work-stealing schedulers, adjust the number of active
+    /// workers to the load: all the workers are brought back as soon as
+    /// more fibers wait in the run queues than there are active
+    /// workers, and the idle ones are retired, releasing their cores
+    bool auto_scale = false;
+
+    /// The fewest active workers kept by auto_scale
+    std::size_t min_workers = 1;
+
+    /// How often auto_scale looks at the load
+    std::chrono::milliseconds scale_period { 10 };
   };
 
 private:
@@ -32,9 +179,37 @@ private:
   /// The thread running the Boost.Fiber schedulers to do the work
   std::vector<std::future<void>> working_threads;
 
-  /// The queue to submit work
-  boost::fibers::unbuffered_channel
-  <boost::fibers::packaged_task<void(void)>> submission;
+  /// A unit of work to run on its own fiber
+  struct task {
+    small_task work;
+    /// The fiber priority, only used by sched::priority
+    int priority = 0;
+  };
+
+  /// Some tasks given together to a worker, a single task being kept
+  /// in the inbox node itself without any vector
+  struct batch {
+    /// The task when tasks is empty
+    task single;
+    std::vector<task> tasks;
+
+    std::size_t size() const noexcept {
+      return tasks.empty() ? 1 : tasks.size();
+    }
+  };
+
+  /// A worker inbox receives the work by batches to amortize the
+  /// synchronization
+  using inbox = fiber_inbox<batch>;
+
+  /// The work submitted to each worker
+  std::vector<std::unique_ptr<inbox>> inboxes;
+
+  /// How the work is spread over the inboxes
+  distribution dispatch;
+
+  /// The next inbox to use in round-robin distribution
+  std::atomic<std::size_t> next_inbox = 0;
 
   //static auto constexpr starting_mode = boost::fibers::launch::post;
   static auto constexpr starting_mode = boost::fibers::launch::dispatch;
@@ -48,6 +223,33 @@ private:
   /// To avoid joining several times
   bool joinable = true;
 
+  /// Number of submitted tasks not finished yet, whatever the number of
+  /// tasks going through the pool
+  std::atomic<std::size_t> unfinished = 0;
+
+  /// Protect completion_waiters
+  boost::fibers::detail::spinlock completion_splk;
+
+  /// The fibers waiting for all the submitted tasks to be finished,
+  /// parked directly since they are usually woken up from another
+  /// thread
+  boost::fibers::context::wait_queue_t completion_waiters;
+
+  /// The first exception thrown by a task without result, if any
+  std::exception_ptr first_exception;
+
+  /// Set once first_exception is written
+  std::atomic<bool> failed = false;
+
+  /// Protect first_exception, which wait_idle() can reset
+  mutable std::mutex exception_mtx;
+
+  /// Refuse new work after the first exception
+  bool fail_fast;
+
+  /// Requested by cancel()
+  std::stop_source cancellation;
+
   /// The model of scheduler
   sched s;
 
@@ -57,23 +259,162 @@ private:
   // Pool context for the work-sharing scheduler
   boost::fibers::algo::pooled_shared_work::ctx pc_shared;
 
+  // Pool context for the lock-free work-sharing scheduler
+  boost::fibers::algo::pooled_lockfree_shared_work::ctx pc_lockfree;
+
+  // Pool context for the priority scheduler
+  boost::fibers::algo::pooled_priority_stealing::ctx pc_priority;
+
+  /// The CPUs each worker is bound to, empty when not bound
+  std::vector<std::vector<int>> worker_cpus;
+
+  /// How the fiber stacks are allocated
+  stack_policy stack;
+
+  /// The stack cache of each worker when the stacks are pooled
+  std::vector<std::unique_ptr<stack_cache>> stack_caches;
+
+  /// The scheduling timeline, only recorded with TRISYCL_FIBER_POOL_TRACE
+  fiber_trace trace;
+
+  /// Where to write the timeline at join()
+  std::string trace_file;
+
+  /** The clock of the last group of fibers given to submit_clocked()
+
+      Atomic since cycle() can read it while another thread submits a
+      new group.
+  */
+  std::atomic<std::shared_ptr<fiber_clock>> clock;
+
+  /// The clock of the group of a clocked fiber and its participant
+  /// number in it
+  struct clock_seat {
+    std::shared_ptr<fiber_clock> clock;
+    std::size_t participant;
+  };
+
+  /// The seat of the running clocked fiber
+  boost::fibers::fiber_specific_ptr<clock_seat> clock_participant;
+
+  /// Make a clocked work leave the clock of its group when it is
+  /// destroyed, even when it is cancelled before starting
+  struct clock_leaver {
+    std::shared_ptr<fiber_clock> clock;
+    std::size_t participant;
+
+    clock_leaver(std::shared_ptr<fiber_clock> c, std::size_t p) noexcept
+      : clock { std::move(c) }
+      , participant { p } {}
+
+    clock_leaver(clock_leaver &&other) noexcept = default;
+
+    ~clock_leaver() {
+      if (clock)
+        clock->drop(participant);
+    }
+  };
+
+  /// Serialize the changes of the number of active workers
+  std::mutex scaling_mtx;
+
+  /// The fewest active workers kept by the auto-scaling
+  std::size_t min_workers;
+
+  /// The period of the auto-scaling
+  std::chrono::milliseconds scale_period;
+
+  /// To stop the auto-scaling thread early
+  std::mutex scaler_mtx;
+  std::condition_variable scaler_cv;
+  bool scaler_stop = false;
+
+  /// Adjust the number of active workers when auto_scale is requested
+  std::thread scaler;
+
 public:
 
-  /// Create a fiber_pool
+  /** Create a fiber_pool
+
+      \param[in] suspend makes a thread without work go to sleep
+      instead of busy-waiting
+  */
   fiber_pool(int thread_number,
              sched scheduler,
              bool suspend)
-    : starting_block { static_cast<unsigned int>(thread_number) + 1 }
+    : fiber_pool { thread_number, scheduler,
+                   options { .idle = suspend ? idle_mode::sleep
+                                             : idle_mode::busy } }
+  {}
+
+
+  /// Create a fiber_pool with some detailed options
+  fiber_pool(int thread_number,
+             sched scheduler,
+             const options &opt)
+    : dispatch { opt.dispatch }
+    , starting_block { static_cast<unsigned int>(thread_number) + 1 }
     , finish_line { static_cast<unsigned int>(thread_number) }
+    , fail_fast { opt.fail_fast }
     , s { scheduler }
+    , stack { opt.stack }
+    , trace { static_cast<std::size_t>(thread_number), opt.trace_capacity }
+    , trace_file { opt.trace_file }
+    , min_workers { std::clamp<std::size_t>
+                    (opt.min_workers, 1,
+                     static_cast<std::size_t>(thread_number)) }
+    , scale_period { opt.scale_period }
   {
+    for (int i = 0; i < thread_number; ++i) {
+      inboxes.push_back(std::make_unique<inbox>());
+      if (stack.pooled)
+        stack_caches.push_back(std::make_unique<stack_cache>(stack));
+    }
     if (scheduler == sched::shared_work)
       // This scheduler needs a shared context
-      pc_shared = boost::fibers::algo::pooled_shared_work::create_pool_ctx(suspend);
-    else if (scheduler == sched::work_stealing)
+      pc_shared = boost::fibers::algo::pooled_shared_work::create_pool_ctx
+        (opt.idle, thread_number);
+    else if (scheduler == sched::lockfree_shared_work)
       // This scheduler needs a shared context
+      pc_lockfree =
+        boost::fibers::algo::pooled_lockfree_shared_work::create_pool_ctx
+        (opt.idle, thread_number);
+    else if (scheduler == sched::priority)
+      // This scheduler needs a shared context
+      pc_priority =
+        boost::fibers::algo::pooled_priority_stealing::create_pool_ctx
+        (thread_number, opt.idle);
+    auto topology = opt.topology;
+    if (topology.empty() && (scheduler == sched::numa
+                             || opt.place == placement::compact
+                             || opt.place == placement::scatter))
+      topology = numa_topology::from_sysfs();
+    worker_cpus = place_workers(thread_number, opt, topology);
+    if (scheduler == sched::work_stealing)
+      // This scheduler needs a shared context
+      pc_stealing = boost::fibers::algo::pooled_work_stealing::create_pool_ctx
+        (thread_number, opt.idle, {}, opt.victims, opt.steal_half);
+    else if (scheduler == sched::numa) {
+      std::vector<std::uint32_t> nodes;
+      if (worker_cpus.empty()) {
+        nodes = topology.worker_nodes(thread_number);
+        // Bind each worker to all the CPUs of its node and let the OS
+        // balance inside the node
+        for (auto n : nodes)
+          worker_cpus.push_back(topology.nodes[n]);
+      }
+      else
+        // Steal according to the node of the CPU each worker is pinned to
+        for (auto &cpus : worker_cpus)
+          nodes.push_back(topology.node_of_cpu(cpus.front()));
+      // Cross the node boundaries by increasing distance
+      std::vector<std::vector<std::uint32_t>> node_order;
+      for (std::uint32_t n = 0; n < topology.nodes.size(); ++n)
+        node_order.push_back(topology.nodes_by_distance(n));
       pc_stealing = boost::fibers::algo::pooled_work_stealing::create_pool_ctx
-        (thread_number, suspend);
+        (thread_number, opt.idle, std::move(nodes),
+         opt.victims, opt.steal_half, std::move(node_order));
+    }
     // Start the working threads
     working_threads = ranges::iota_view { 0, thread_number }
                     | ranges::views::transform([&] (int i) {
@@ -82,22 +423,307 @@ public:
                     | ranges::to<std::vector>;
     // Wait for all thread workers to be ready
     starting_block.count_down_and_wait();
+    if (opt.auto_scale && pc_stealing)
+      scaler = std::thread { [this] { scale(); } };
   }
 
 
-  /// Submit some work
+  /** Submit some work
+
+      An exception thrown by the work is rethrown by join(). In
+      fail-fast mode, it is also rethrown by any later submission
+      instead of accepting more work.
+  */
   template <typename Callable>
   void submit(Callable && work) {
-    submission.push(boost::fibers::packaged_task<void(void)> {
-        [f = std::move(work)] { f(); }
-          });
+    deliver(make_task(std::forward<Callable>(work)));
+  }
+
+
+  /** Submit some work with a priority
+
+      With sched::priority, the fibers with the highest priority run
+      first, from 0 which is the default priority to
+      boost::fibers::algo::pooled_priority_stealing::levels - 1. The
+      priority is ignored by the other schedulers.
+  */
+  template <typename Callable>
+  void submit(int priority, Callable && work) {
+    auto t = make_task(std::forward<Callable>(work));
+    if (s == sched::priority)
+      t.priority = priority;
+    deliver(std::move(t));
+  }
+
+
+  /** Submit some work returning a value of type R
+
+      The work is stored in the inbox node of its worker, without any
+      other allocation if its captures are small enough, apart from the
+      shared state of the future returning its result or its exception.
+  */
+  template <typename R, typename Callable>
+  boost::fibers::future<R> submit(Callable && work) {
+    boost::fibers::promise<R> result;
+    auto f = result.get_future();
+    deliver(make_task([w = std::forward<Callable>(work),
+                       r = std::move(result)] () mutable {
+      try {
+        if constexpr (std::is_void_v<R>) {
+          w();
+          r.set_value();
+        }
+        else
+          r.set_value(w());
+      } catch (...) {
+        r.set_exception(std::current_exception());
+      }
+    }));
+    return f;
+  }
+
+
+  /** Submit a whole range of callables in one operation
+
+      Each element of the range is run on its own fiber.
+  */
+  template <typename Range>
+  void submit_bulk(Range && works) {
+    std::vector<task> tasks;
+    if constexpr (requires { std::size(works); })
+      tasks.reserve(std::size(works));
+    for (auto &&work : works)
+      tasks.push_back(make_task(std::forward<decltype(work)>(work)));
+    deliver(std::move(tasks));
+  }
+
+
+  /** Submit n works in one operation
+
+      \param[in] factory is called with 0, 1... n - 1 to produce the
+      callables to run, each one on its own fiber
+  */
+  template <typename Factory>
+  void submit_n(std::size_t n, Factory && factory) {
+    std::vector<task> tasks;
+    tasks.reserve(n);
+    for (std::size_t i = 0; i != n; ++i)
+      tasks.push_back(make_task(factory(i)));
+    deliver(std::move(tasks));
+  }
+
+
+  /** Submit n works running in lockstep
+
+      Each work calls wait_for_clock() at the end of each cycle and a
+      cycle ends once all of them have called it. A work which returns,
+      throws or is cancelled before starting leaves the clock, so the
+      other ones are not blocked.
+
+      Each call makes a new group with its own clock, so it can be
+      called again while the works of the previous groups still run.
+      cycle() follows the last group.
+
+      \param[in] factory is called with 0, 1... n - 1 to produce the
+      callables to run, each one on its own fiber
+
+      \param[in] fan_in is the number of children of each node of the
+      combining tree used as a barrier, see fiber_clock.hpp
+  */
+  template <typename Factory>
+  void submit_clocked(std::size_t n,
+                      Factory && factory,
+                      std::size_t fan_in = 4) {
+    auto group_clock = std::make_shared<fiber_clock>(n, fan_in);
+    clock.store(group_clock);
+    submit_n(n, [&] (std::size_t i) {
+      return [this, i, w = factory(i),
+              leave = clock_leaver { group_clock, i }] () mutable {
+        // Leave the clock when returning or throwing
+        auto l = std::move(leave);
+        clock_participant.reset(new clock_seat { l.clock, i });
+        w();
+      };
+    });
+  }
+
+
+  /** Wait for all the clocked works to finish the current cycle
+
+      \return the number of the new cycle
+
+      \throw std::logic_error if not called from a work given to
+      submit_clocked()
+  */
+  std::uint64_t wait_for_clock() {
+    auto seat = clock_participant.get();
+    if (!seat)
+      throw std::logic_error { "fiber_pool: wait_for_clock() called "
+                               "outside of a clocked fiber" };
+    return seat->clock->wait_for_clock(seat->participant);
+  }
+
+
+  /// The number of cycles completed by the last group of clocked works
+  /// so far
+  std::uint64_t cycle() const noexcept {
+    auto c = clock.load();
+    return c ? c->cycle() : 0;
+  }
+
+
+  /// The first exception thrown by a task without result, if any
+  std::exception_ptr failure() const noexcept {
+    if (!failed.load(std::memory_order_acquire))
+      return nullptr;
+    std::unique_lock lk { exception_mtx };
+    return first_exception;
+  }
+
+
+  /** The activity of each worker so far, which can be read at any
+      time, including after join()
+
+      It is empty with the round-robin scheduler which does not count
+      anything. With the work-sharing schedulers, the order of the
+      workers is the order in which they started.
+  */
+  std::vector<worker_stats> stats() const {
+    std::vector<worker_stats> result;
+    auto collect = [&] (auto &pc) {
+      if (pc)
+        for (auto &counters : pc->stats_)
+          result.push_back(counters.snapshot());
+    };
+    collect(pc_stealing);
+    collect(pc_shared);
+    collect(pc_lockfree);
+    collect(pc_priority);
+    return result;
+  }
+
+
+  /// The number of workers taking new work and stealing
+  std::size_t workers() const noexcept {
+    return pc_stealing ? pc_stealing->active_.load(std::memory_order_acquire)
+                       : inboxes.size();
+  }
+
+
+  /** Change the number of active workers
+
+      The other workers are kept in reserve: they get no new work, give
+      away their fibers as soon as they yield or block and then park,
+      releasing their cores. Bringing them back is cheap since they are
+      not destroyed. This can be done at any time before join(), even
+      with auto_scale which then goes on from the new number.
+
+      \param[in] n is the number of active workers, between 1 and the
+      number of threads of the pool
+
+      \throw std::logic_error if the scheduler is neither
+      sched::work_stealing nor sched::numa or after join()
+
+      \throw std::invalid_argument if \p n is out of range
+  */
+  void set_workers(std::size_t n) {
+    if (!pc_stealing || !joinable)
+      throw std::logic_error { "fiber_pool: the number of workers can only "
+                               "change with a running work-stealing pool" };
+    if (n < 1 || n > inboxes.size())
+      throw std::invalid_argument { "fiber_pool: wrong number of workers" };
+    std::unique_lock lk { scaling_mtx };
+    boost::fibers::algo::pooled_work_stealing::set_active
+      (pc_stealing, static_cast<std::uint32_t>(n));
+  }
+
+
+  /** Wait for all the work submitted so far to be finished, keeping
+      the workers and their schedulers alive to run some more work
+
+      This allows running several phases of work on the same pool
+      without paying for the thread creation each time. It must not be
+      called from a fiber of the pool.
+
+      \throw the first exception thrown by a task without result since
+      the previous wait_idle(), which is then forgotten
+  */
+  void wait_idle() {
+    wait_for_completion();
+    if (failed.load(std::memory_order_acquire)) {
+      std::exception_ptr e;
+      {
+        std::unique_lock lk { exception_mtx };
+        e = std::exchange(first_exception, nullptr);
+        failed.store(false, std::memory_order_release);
+      }
+      if (e)
+        std::rethrow_exception(e);
+    }
+  }
+
+
+  /** The token of the pool cancellation, for example to register a
+      std::stop_callback or to give it to some code independent of the
+      pool
+  */
+  std::stop_token get_stop_token() const noexcept {
+    return cancellation.get_token();
+  }
+
+
+  /** Whether cancel() has been called
+
+      This is a single atomic load, cheap enough for a fiber to check it
+      at each of its yield points and return early.
+  */
+  bool stop_requested() const noexcept {
+    return cancellation.stop_requested();
+  }
+
+
+  /** Make the calling fiber sleep until \p time_point
+
+      With the pooled schedulers, the fiber waits on the timing wheel of
+      its worker, see timing_wheel.hpp, and otherwise with
+      boost::this_fiber::sleep_until().
+
+      \return false if woken up early by cancel() or if the pool was
+      already cancelled
+  */
+  bool sleep_until(std::chrono::steady_clock::time_point const& time_point) {
+    return boost::fibers::algo::timing_wheel::sleep_until(time_point,
+                                                           get_stop_token());
+  }
+
+
+  /// Make the calling fiber sleep for \p duration, see sleep_until()
+  template <typename Rep, typename Period>
+  bool sleep_for(std::chrono::duration<Rep, Period> const& duration) {
+    return boost::fibers::algo::timing_wheel::sleep_for(duration,
+                                                         get_stop_token());
+  }
+
+
+  /** Cancel all the work cooperatively
+
+      The submission is closed and the tasks not started yet are dropped
+      without running, so their futures report a broken promise. The
+      running tasks go on until they check stop_requested() and the ones
+      in sleep_for() on a pooled scheduler are woken up early. join()
+      still has to be called to wait for them.
+  */
+  void cancel() {
+    cancellation.request_stop();
+    close();
   }
 
 
   /// Close the submission
   void close() {
     // Can be done many times, so no protection required here
-    submission.close();
+    for (auto &in : inboxes)
+      in->close();
   }
 
 
@@ -105,17 +731,50 @@ public:
   void join() {
     // Can be done only once
     if (joinable) {
+      if (scaler.joinable()) {
+        {
+          std::unique_lock lk { scaler_mtx };
+          scaler_stop = true;
+        }
+        scaler_cv.notify_one();
+        scaler.join();
+      }
+      joinable = false;
       // Close the submission if not done already
       close();
+      std::exception_ptr e;
       for (auto &t : working_threads)
         // A Boost.Fiber scheduler will block its thread if they still
         // have some work to do
-        t.get();
-      joinable = false;
+        try {
+          t.get();
+        } catch (...) {
+          // Only report the first exception but still join everything
+          if (!e)
+            e = std::current_exception();
+        }
+      if (fiber_trace::enabled && !trace_file.empty()) {
+        std::ofstream f { trace_file };
+        write_trace(f);
+      }
+      if (e)
+        std::rethrow_exception(e);
+      if (auto f = failure())
+        std::rethrow_exception(f);
     }
   }
 
 
+  /** Write the scheduling timeline in Chrome trace-event JSON format
+
+      It is empty unless compiled with TRISYCL_FIBER_POOL_TRACE and it
+      has to be called after join().
+  */
+  void write_trace(std::ostream &o) const {
+    trace.write_json(o);
+  }
+
+
   /// Wait for some remaining work to be done
   ~fiber_pool() {
     // Join first if not done already
@@ -124,44 +783,290 @@ public:
 
 private:
 
+  /// Wrap some work into a task recording its exception if any
+  template <typename Callable>
+  task make_task(Callable && work) {
+    return { [this, w = std::forward<Callable>(work)] () mutable {
+      try {
+        w();
+      } catch (...) {
+        record_exception();
+      }
+    } };
+  }
+
+
+  /// Keep the current exception if it is the first one
+  void record_exception() {
+    std::unique_lock lk { exception_mtx };
+    if (!failed.load(std::memory_order_relaxed)) {
+      first_exception = std::current_exception();
+      failed.store(true, std::memory_order_release);
+    }
+  }
+
+
+  /// Account for a finished task and wake up the waiters on the last one
+  void task_done() {
+    if (unfinished.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      auto active_ctx = boost::fibers::context::active();
+      boost::fibers::detail::spinlock_lock lk { completion_splk };
+      while (!completion_waiters.empty()) {
+        auto ctx = &completion_waiters.front();
+        completion_waiters.pop_front();
+        active_ctx->schedule(ctx);
+      }
+    }
+  }
+
+
+  /// Wait for all the submitted tasks to be finished
+  void wait_for_completion() {
+    auto active_ctx = boost::fibers::context::active();
+    for (;;) {
+      boost::fibers::detail::spinlock_lock lk { completion_splk };
+      if (unfinished.load(std::memory_order_acquire) == 0)
+        return;
+      active_ctx->wait_link(completion_waiters);
+      active_ctx->twstatus.store(0, std::memory_order_release);
+      active_ctx->suspend(lk);
+    }
+  }
+
+
+  /// Pick the inbox of the worker to give some work to
+  std::size_t pick_worker() {
+    if (dispatch == distribution::first_worker)
+      return 0;
+    if (dispatch == distribution::least_loaded) {
+      std::size_t best = 0;
+      auto best_load = std::numeric_limits<std::ptrdiff_t>::max();
+      for (std::size_t i = 0, n = workers(); i != n; ++i)
+        if (auto l = inboxes[i]->load(); l < best_load) {
+          best = i;
+          best_load = l;
+        }
+      return best;
+    }
+    return next_inbox.fetch_add(1, std::memory_order_relaxed) % workers();
+  }
+
+
+  /// In fail-fast mode, rethrow the first exception instead of
+  /// accepting more work
+  void check_failure() {
+    if (fail_fast)
+      if (auto f = failure())
+        std::rethrow_exception(f);
+  }
+
+
+  /// Give a single task to a worker
+  void deliver(task t) {
+    check_failure();
+    // The number of workers may have changed meanwhile
+    auto &in = *inboxes[pick_worker() % workers()];
+    // Count the task before it can finish
+    unfinished.fetch_add(1, std::memory_order_relaxed);
+    push(in, batch { .single = std::move(t), .tasks = {} });
+  }
+
+
+  /// Give a batch of tasks to the workers
+  void deliver(std::vector<task> tasks) {
+    check_failure();
+    auto n = tasks.size();
+    if (n == 0)
+      return;
+    auto workers = this->workers();
+    // The number of workers may have changed meanwhile
+    auto first = pick_worker() % workers;
+    // Count the tasks before any of them can finish
+    unfinished.fetch_add(n, std::memory_order_relaxed);
+    if (n == 1 || dispatch == distribution::first_worker) {
+      push(*inboxes[first], batch { .single = {}, .tasks = std::move(tasks) });
+      return;
+    }
+    // Split a bigger batch evenly so that all the workers create some
+    // fibers in parallel
+    auto begin = tasks.begin();
+    for (std::size_t w = 0; w != workers && begin != tasks.end(); ++w) {
+      auto size = n/workers + (w < n%workers);
+      if (size == 0)
+        break;
+      std::vector<task> chunk { std::make_move_iterator(begin),
+                                std::make_move_iterator(begin + size) };
+      begin += size;
+      push(*inboxes[(first + w) % workers],
+           batch { .single = {}, .tasks = std::move(chunk) });
+    }
+  }
+
+
+  /// Push a batch to an inbox, forgetting about it if it is closed
+  void push(inbox &in, batch b) {
+    auto n = b.size();
+    if (!in.push(std::move(b), n))
+      for (; n != 0; --n)
+        task_done();
+  }
+
+
+  /** Follow the load with the number of active workers until join()
+
+      At each period, all the workers are brought back when more fibers
+      wait in the run queues than there are active workers, and the
+      active workers are reduced to the number of them which have been
+      busy when they were idle more than half of the time.
+  */
+  void scale() {
+    auto previous = stats();
+    auto last = std::chrono::steady_clock::now();
+    std::unique_lock lk { scaler_mtx };
+    while (!scaler_cv.wait_for(lk, scale_period,
+                               [&] { return scaler_stop; })) {
+      auto current = stats();
+      auto now = std::chrono::steady_clock::now();
+      auto active = workers();
+      std::chrono::duration<double> idle { 0 };
+      for (std::size_t w = 0; w != active; ++w)
+        idle += current[w].idle_time - previous[w].idle_time;
+      std::chrono::duration<double> period = now - last;
+      // Equivalent number of workers busy during the period
+      auto busy = active - idle/period;
+      previous = std::move(current);
+      last = now;
+      auto n = active;
+      if (boost::fibers::algo::pooled_work_stealing::ready_fibers
+          (pc_stealing) > active)
+        n = inboxes.size();
+      else if (busy < active/2.)
+        n = std::max(min_workers, static_cast<std::size_t>
+                     (std::ceil(std::max(0., busy))));
+      if (n != active)
+        set_workers(n);
+    }
+  }
+
+
+  /** Compute the CPUs each worker is pinned to according to the
+      placement, empty when the workers are not pinned
+
+      \throw std::invalid_argument for a cpu_list placement without CPU
+  */
+  static std::vector<std::vector<int>>
+  place_workers(int thread_number,
+                const options &opt,
+                const numa_topology &topology) {
+    std::vector<int> order;
+    if (opt.place == placement::compact)
+      order = topology.compact_order();
+    else if (opt.place == placement::scatter)
+      order = topology.scatter_order();
+    else if (opt.place == placement::cpu_list) {
+      if (opt.cpus.empty())
+        throw std::invalid_argument { "fiber_pool: empty CPU list" };
+      order = opt.cpus;
+    }
+    std::vector<std::vector<int>> cpus;
+    if (!order.empty())
+      for (int i = 0; i < thread_number; ++i)
+        cpus.push_back({ order[i % order.size()] });
+    return cpus;
+  }
+
+
   /// The thread worker job
   void run(int i) {
+    trace.attach(i);
+    if (!worker_cpus.empty())
+      // Best effort, since a hand-written topology may not match the
+      // real machine
+      bind_current_thread(worker_cpus[i]);
     if (s == sched::shared_work)
       boost::fibers::use_scheduling_algorithm
         <boost::fibers::algo::pooled_shared_work>(pc_shared);
+    else if (s == sched::lockfree_shared_work)
+      boost::fibers::use_scheduling_algorithm
+        <boost::fibers::algo::pooled_lockfree_shared_work>(pc_lockfree);
     else if (s == sched::work_stealing)
       boost::fibers::use_scheduling_algorithm
         <boost::fibers::algo::pooled_work_stealing>(pc_stealing);
+    else if (s == sched::numa)
+      // Use the worker number as the scheduler id so that it matches
+      // the node the thread is bound to
+      boost::fibers::use_scheduling_algorithm
+        <boost::fibers::algo::pooled_work_stealing>(pc_stealing, i);
+    else if (s == sched::priority)
+      boost::fibers::use_scheduling_algorithm
+        <boost::fibers::algo::pooled_priority_stealing>(pc_priority);
     // Otherwise a round-robin scheduler is used and the fibers will
-    // use only 1 thread since there is no thread migration in that
-    // case
+    // stay on the thread which has created them since there is no
+    // thread migration in that case
+
+    // cancel() wakes up all the fibers sleeping on the timing wheel of
+    // this worker with a single callback instead of one per sleep
+    if (auto wheel = boost::fibers::algo::timing_wheel::current())
+      wheel->watch(get_stop_token());
 
     // Wait for all thread workers to be ready
     starting_block.count_down_and_wait();
 
-    // Only the first thread receives and starts the work
-    if (i == 0) {
-      // Keep track of each fiber execution to forward exception if any
-      std::vector<boost::fibers::future<void>> futures;
-      for (;;) {
-        decltype(submission)::value_type work;
-        if (submission.pop(work)
-            == boost::fibers::channel_op_status::closed)
-          // Someone asked to stop accepting work
-          break;
-        // \todo implement with packaged_task to handle exception and
-        // avoid std::function
-        futures.push_back(work.get_future());
-        // Launch the work on a new unattended fiber
-        boost::fibers::fiber { starting_mode, std::move(work) }.detach();
+    // Each thread receives and starts its own work so that the fiber
+    // stacks are first touched by the thread likely to run them
+    auto &in = *inboxes[i];
+    fiber_stack_allocator salloc { stack, stack.pooled ? stack_caches[i].get()
+                                                       : nullptr };
+    std::vector<batch> batches;
+    while (in.pop_all(batches)) {
+      for (auto &b : batches) {
+        // Only start the work right away for a single task, otherwise
+        // just queue all the fibers of the batch before running any
+        auto mode = b.size() == 1 ? starting_mode
+                                  : boost::fibers::launch::post;
+        auto start = [&] (task &t) {
+          if (stop_requested()) {
+            // Do not even create the fiber of a cancelled task
+            in.unload();
+            task_done();
+            return;
+          }
+          // Launch the work on a new unattended fiber. With a priority it
+          // is only queued, so that its properties are created right
+          // away with the priority, before anybody can run or steal it
+          boost::fibers::algo::pooled_priority_stealing::initial_priority
+            seed { t.priority };
+          boost::fibers::fiber f {
+            t.priority ? boost::fibers::launch::post : mode,
+            std::allocator_arg, salloc,
+            [&in, this, w = std::move(t.work)] () mutable {
+              // A task still queued when cancelled never starts
+              if (!stop_requested()) {
+                fiber_trace::record(fiber_trace::event::start);
+                w();
+                fiber_trace::record(fiber_trace::event::finish);
+              }
+              in.unload();
+              task_done();
+            } };
+          f.detach();
+        };
+        if (b.tasks.empty())
+          start(b.single);
+        else
+          for (auto &t : b.tasks)
+            start(t);
       }
-      // Handle any exception here. Well, actually only the first one
-      // because it will just throw
-      for (auto &f : futures)
-        f.get();
+      batches.clear();
     }
+    // The exceptions are reported by join() so only wait for all the
+    // work of the pool to be done
+    wait_for_completion();
     // Wait for all the threads to finish their fiber execution
     finish_line.wait();
+    fiber_trace::detach();
   }
 
 };
+
+#endif // FIBER_POOL_FIBER_POOL_HPP
@@ -0,0 +1,173 @@
+/** \file
+
+    Configurable allocation of the fiber stacks
+
+    Creating a lot of fibers with the default Boost.Context allocator
+    costs a malloc() or an mmap() per fiber, so the stacks can be
+    recycled through a cache owned by each worker thread.
+*/
+
+#ifndef FIBER_POOL_FIBER_STACK_HPP
+#define FIBER_POOL_FIBER_STACK_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+#include <boost/context/fixedsize_stack.hpp>
+#include <boost/context/protected_fixedsize_stack.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/context/stack_traits.hpp>
+
+/// How the fiber stacks are allocated
+struct stack_policy {
+  /// The stack size in bytes, 0 meaning the Boost.Context default
+  std::size_t size = 0;
+
+  /// Recycle the stacks of the finished fibers in a per-worker cache
+  bool pooled = false;
+
+  /// Add a protected page below each stack to crash on an overflow
+  /// instead of corrupting the memory
+  bool guard_page = false;
+
+  /// The maximum number of stacks kept in each cache
+  std::size_t max_cached = 4096;
+
+
+  std::size_t stack_size() const noexcept {
+    return size ? size : boost::context::stack_traits::default_size();
+  }
+
+
+  /// Allocate a stack directly from the system
+  boost::context::stack_context allocate() const {
+    if (guard_page)
+      return boost::context::protected_fixedsize_stack { stack_size() }
+        .allocate();
+    return boost::context::fixedsize_stack { stack_size() }.allocate();
+  }
+
+
+  /// Give back a stack to the system
+  void deallocate(boost::context::stack_context &sctx) const noexcept {
+    if (guard_page)
+      boost::context::protected_fixedsize_stack { stack_size() }
+        .deallocate(sctx);
+    else
+      boost::context::fixedsize_stack { stack_size() }.deallocate(sctx);
+  }
+};
+
+
+/** A cache of stacks of the same size
+
+    Only the owner worker allocates from the cache but a fiber can
+    finish on any worker after migrating, so the stacks are given back
+    through a lock-free list that the owner takes as a whole when its
+    private list is empty.
+*/
+class stack_cache {
+
+  /// Stored at the top of each free stack
+  struct free_stack {
+    boost::context::stack_context sctx;
+    free_stack * next;
+  };
+
+  const stack_policy policy_;
+
+  /// The free stacks only used by the owner
+  free_stack * local_ = nullptr;
+
+  /// The free stacks given back by any thread
+  std::atomic<free_stack *> remote_ { nullptr };
+
+  /// Approximate number of cached stacks, to bound the memory use
+  std::atomic<std::size_t> cached_ { 0 };
+
+  static void release(const stack_policy &p, free_stack * list) noexcept {
+    while (list) {
+      auto sctx = list->sctx;
+      list = list->next;
+      p.deallocate(sctx);
+    }
+  }
+
+public:
+
+  explicit stack_cache(const stack_policy &policy) : policy_ { policy } {}
+
+  stack_cache(const stack_cache &) = delete;
+  stack_cache & operator=(const stack_cache &) = delete;
+
+
+  ~stack_cache() {
+    release(policy_, local_);
+    release(policy_, remote_.load(std::memory_order_acquire));
+  }
+
+
+  /// Get a stack, to be called only by the owner thread
+  boost::context::stack_context allocate() {
+    if (!local_)
+      local_ = remote_.exchange(nullptr, std::memory_order_acquire);
+    if (!local_)
+      return policy_.allocate();
+    auto sctx = local_->sctx;
+    local_ = local_->next;
+    cached_.fetch_sub(1, std::memory_order_relaxed);
+    return sctx;
+  }
+
+
+  /// Give back a stack, from any thread
+  void deallocate(boost::context::stack_context &sctx) noexcept {
+    if (cached_.load(std::memory_order_relaxed) >= policy_.max_cached) {
+      policy_.deallocate(sctx);
+      return;
+    }
+    cached_.fetch_add(1, std::memory_order_relaxed);
+    // The stack grows downwards from sp, so use its top for the link
+    auto f = ::new (static_cast<char *>(sctx.sp) - sizeof(free_stack))
+      free_stack { sctx, remote_.load(std::memory_order_relaxed) };
+    while (!remote_.compare_exchange_weak(f->next, f,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed))
+      ;
+  }
+};
+
+
+/** The Boost.Context StackAllocator used by the fiber pool
+
+    It is a cheap handle copied into each fiber, either to a cache or
+    to a stack policy.
+*/
+class fiber_stack_allocator {
+  const stack_policy * policy_;
+
+  stack_cache * cache_;
+
+public:
+
+  fiber_stack_allocator(const stack_policy &policy,
+                        stack_cache * cache = nullptr) noexcept
+    : policy_ { &policy }
+    , cache_ { cache } {}
+
+
+  boost::context::stack_context allocate() {
+    return cache_ ? cache_->allocate() : policy_->allocate();
+  }
+
+
+  void deallocate(boost::context::stack_context &sctx) noexcept {
+    if (cache_)
+      cache_->deallocate(sctx);
+    else
+      policy_->deallocate(sctx);
+  }
+};
+
+#endif // FIBER_POOL_FIBER_STACK_HPP
@@ -0,0 +1,213 @@
+/** \file
+
+    Record a timeline of the fiber scheduling to see which fiber ran on
+    which worker and when
+
+    Tracing is compiled in only with TRISYCL_FIBER_POOL_TRACE defined,
+    otherwise fiber_trace::record() is an empty inline function.
+
+    Each worker thread writes its events into its own ring buffer
+    without any synchronization, the oldest events being overwritten
+    when it is full. The time-stamps are read from the CPU time-stamp
+    counter when possible to keep an event to a few nanoseconds. The
+    rings are dumped in the Chrome trace-event JSON format, to be
+    opened with chrome://tracing or https://ui.perfetto.dev
+*/
+
+#ifndef FIBER_POOL_FIBER_TRACE_HPP
+#define FIBER_POOL_FIBER_TRACE_HPP
+
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <boost/fiber/context.hpp>
+
+class fiber_trace {
+
+public:
+
+  /// What happened to a fiber
+  enum class event : std::uint8_t {
+    /// The fiber starts its work
+    start,
+    /// The fiber is picked to run
+    resume,
+    /// The fiber is ready again, after a yield() or a wake-up
+    yield,
+    /// The fiber is stolen by another worker
+    steal,
+    /// The fiber has finished its work
+    finish
+  };
+
+#ifdef TRISYCL_FIBER_POOL_TRACE
+  static constexpr bool enabled = true;
+#else
+  static constexpr bool enabled = false;
+#endif
+
+private:
+
+  struct record_type {
+    std::uint64_t ticks;
+    const void * fiber;
+    event what;
+  };
+
+  /// The events of a worker thread, written only by this thread
+  struct ring {
+    std::vector<record_type> records;
+    /// Total number of events, the ring keeping the last ones
+    std::uint64_t count = 0;
+
+    explicit ring(std::size_t capacity) : records ( capacity ) {}
+  };
+
+  /// The ring of the current worker thread, if any
+  static inline thread_local ring * current = nullptr;
+
+  std::vector<std::unique_ptr<ring>> rings;
+
+  /// To convert the ticks into time
+  std::uint64_t start_ticks;
+  std::chrono::steady_clock::time_point start_time;
+
+  static std::uint64_t ticks() noexcept {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+      (std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+
+  static const char * name(event e) noexcept {
+    switch (e) {
+    case event::start: return "start";
+    case event::resume: return "resume";
+    case event::yield: return "yield";
+    case event::steal: return "steal";
+    case event::finish: return "finish";
+    }
+    return "?";
+  }
+
+public:
+
+  /** Create the rings of some workers
+
+      \param[in] capacity is the number of events kept by each worker
+      and has to be a power of 2
+  */
+  fiber_trace(std::size_t workers, std::size_t capacity)
+    : start_ticks { ticks() }
+    , start_time { std::chrono::steady_clock::now() } {
+    if (!std::has_single_bit(capacity))
+      throw std::invalid_argument { "capacity must be a power of 2" };
+    if constexpr (enabled)
+      for (std::size_t w = 0; w < workers; ++w)
+        rings.push_back(std::make_unique<ring>(capacity));
+  }
+
+
+  /// Record the events of the calling thread as the worker \p w ones
+  void attach(std::size_t w) noexcept {
+    if constexpr (enabled)
+      current = rings[w].get();
+  }
+
+
+  /// Stop recording the events of the calling thread
+  static void detach() noexcept {
+    if constexpr (enabled)
+      current = nullptr;
+  }
+
+
+  /// Record an event of the calling thread, if it is a traced worker
+  static void record([[maybe_unused]] event what,
+                     [[maybe_unused]] const void * fiber) noexcept {
+    if constexpr (enabled)
+      if (auto r = current) {
+        r->records[r->count & (r->records.size() - 1)] =
+          { ticks(), fiber, what };
+        ++r->count;
+      }
+  }
+
+
+  /// Record an event of the running fiber
+  static void record([[maybe_unused]] event what) noexcept {
+    if constexpr (enabled)
+      record(what, boost::fibers::context::active());
+  }
+
+
+  /** Write the events in Chrome trace-event JSON format
+
+      Each worker is a thread of the trace. A fiber running on a worker
+      is a slice from its resume to the next resume on this worker or
+      to its own next event, and every event is also an instant event.
+
+      It has to be called while no worker is recording.
+  */
+  void write_json(std::ostream &o) const {
+    auto end_ticks = ticks();
+    std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start_time;
+    double us_per_tick = end_ticks == start_ticks
+      ? 0 : elapsed.count()/(end_ticks - start_ticks);
+    auto us = [&] (std::uint64_t t) {
+      return (t - start_ticks)*us_per_tick;
+    };
+    // Give small numbers to the fibers for readability
+    std::map<const void *, std::size_t> fiber_ids;
+    auto id = [&] (const void * f) {
+      return fiber_ids.try_emplace(f, fiber_ids.size()).first->second;
+    };
+    o << "{\"traceEvents\":[";
+    const char * separator = "\n";
+    for (std::size_t w = 0; w < rings.size(); ++w) {
+      auto &r = *rings[w];
+      auto size = r.records.size();
+      auto first = r.count > size ? r.count - size : 0;
+      const record_type * running = nullptr;
+      for (auto i = first; i < r.count; ++i) {
+        auto &e = r.records[i & (size - 1)];
+        // The running fiber stops with the next resume or with its own
+        // next event, which is a yield, a finish or being stolen
+        if (running && (e.what == event::resume
+                        || (e.fiber == running->fiber
+                            && e.what != event::start))) {
+          o << separator << "{\"name\":\"fiber " << id(running->fiber)
+            << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << w
+            << ",\"ts\":" << us(running->ticks)
+            << ",\"dur\":" << us(e.ticks) - us(running->ticks) << '}';
+          separator = ",\n";
+          running = nullptr;
+        }
+        if (e.what == event::resume)
+          running = &e;
+        o << separator << "{\"name\":\"" << name(e.what)
+          << "\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":" << w
+          << ",\"ts\":" << us(e.ticks)
+          << ",\"args\":{\"fiber\":" << id(e.fiber) << "}}";
+        separator = ",\n";
+      }
+    }
+    o << "\n]}\n";
+  }
+};
+
+#endif // FIBER_POOL_FIBER_TRACE_HPP
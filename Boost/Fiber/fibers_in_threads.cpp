@@ -10,6 +10,8 @@
     fibers have finished, otherwise there is a deadlock.
 */
 
+#include <algorithm>
+#include <array>
 #include <future>
 #include <iostream>
 #include <memory>
@@ -18,12 +20,8 @@
 #include <boost/thread/barrier.hpp>
 #include <boost/fiber/all.hpp>
 
-#include <spdlog/spdlog.h>
-#include <spdlog/async.h>
-#include <spdlog/fmt/ostr.h>
-#include <spdlog/sinks/stdout_sinks.h>
-
-using namespace std::literals;
+#include "fiber_log.hpp"
+#include "ring_channel.hpp"
 
 auto constexpr capacity = 4;
 auto constexpr message_length = 10;
@@ -41,21 +39,15 @@ boost::barrier starting_block { num_threads };
 // all the threads.
 boost::fibers::barrier finish_line { num_threads };
 
-std::shared_ptr<spdlog::logger> console;
-
-auto logging = [] (auto message, auto... args) {
-  auto format = "Fiber {} on thread {}: "s + message;
-  console->info(format.c_str(), boost::this_fiber::get_id(),
-                std::this_thread::get_id(), args...);
-};
-
 
 struct router {
-  /// Ingress packet queue
-  boost::fibers::buffered_channel<packet> ingress { capacity };
+  /// Ingress packet queue, written by several producers and only read
+  /// by the router
+  ring_channel<packet, false, true> ingress { capacity };
 
-  /// Egress packet queue
-  boost::fibers::buffered_channel<packet> egress { capacity };
+  /// Egress packet queue, only written by the router and read by
+  /// several consumers
+  ring_channel<packet, true, false> egress { capacity };
 
   /// Fiber used as a data mover between queues
   boost::fibers::fiber f;
@@ -75,17 +67,23 @@ struct router {
                destructor...) to launch it */
            boost::fibers::launch::dispatch,
            [&] {
-             logging("router {} starting with buffered_channel {}",
-                     (void *)this, (void *)&ingress);
+             fiber_log::info("router {} starting with ring_channel {}",
+                             (void *)this, (void *)&ingress);
+             // Forward the packets by bursts of what is available
+             std::array<packet, capacity> burst;
              // message_length*2 because we have 2 producers
-             for (int i = 0; i < message_length*2; ++i) {
-                logging("router {} reading from buffered_channel {}",
-                        (void *)this, (void *)&ingress);
-               auto v = ingress.value_pop();
-               logging("router {} routing data value {}", (void *)this, v);
-               egress.push(v);
+             for (int i = 0; i < message_length*2;) {
+                fiber_log::info("router {} reading from ring_channel {}",
+                                (void *)this, (void *)&ingress);
+               auto n = ingress.pop_n(std::span { burst }.first
+                                      (std::min<std::size_t>
+                                       (burst.size(), message_length*2 - i)));
+               fiber_log::info("router {} routing {} packets from {}",
+                               (void *)this, n, burst[0]);
+               egress.push_n(std::span { burst }.first(n));
+               i += n;
              }
-             logging("router {} is shutting down", (void *)this);;
+             fiber_log::info("router {} is shutting down", (void *)this);;
            }
       };
       // Wait for shutdown to avoid calling std::terminate on destruction...
@@ -96,15 +94,15 @@ struct router {
 
 
   void write(int v) {
-    logging("writing {} to router {} on buffered_channel {}",
-            v, (void *)this, (void *)&ingress);
+    fiber_log::info("writing {} to router {} on ring_channel {}",
+                    v, (void *)this, (void *)&ingress);
     ingress.push(v);
   }
 
 
   int read() {
-    logging("reading from router {} from buffered_channel {}...",
-            (void *)this, (void *)&ingress);
+    fiber_log::info("reading from router {} from ring_channel {}...",
+                    (void *)this, (void *)&ingress);
     return egress.value_pop();
   }
 
@@ -117,15 +115,15 @@ struct router {
 
 int main() {
   router r;
-  spdlog::init_thread_pool(10000, 1);
-  console = spdlog::create_async<spdlog::sinks::stdout_sink_mt>("console");
+  // The fiber and thread ids are added by the logger to each message
+  fiber_log::start(std::cout);
 
   // Launch some producers
   auto producer = std::async(std::launch::async, [&] {
       boost::fibers::use_scheduling_algorithm
         <boost::fibers::algo::work_stealing>(num_threads, suspend);
       starting_block.wait();
-      logging("starting producer");
+      fiber_log::info("starting producer");
 
       auto prod = [&] (int id) {
         return [&, id] {
@@ -146,12 +144,13 @@ int main() {
       boost::fibers::use_scheduling_algorithm
         <boost::fibers::algo::work_stealing>(num_threads, suspend);
       starting_block.wait();
-      logging("starting consumer");
+      fiber_log::info("starting consumer");
       auto cons = [&] (int id) {
         return [&, id] {
           for (int i = id; i < message_length; ++i) {
             auto v = r.read();
-            logging("consumer {} read {} from router {}", id, v, (void *)&r);
+            fiber_log::info("consumer {} read {} from router {}",
+                            id, v, (void *)&r);
           }
         };
       };
@@ -166,4 +165,5 @@ int main() {
   // Wait for everybody to finish
   producer.get();
   consumer.get();
+  fiber_log::stop();
 }
@@ -5,23 +5,27 @@
     thread (not in different threads).
 */
 
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <future>
 #include <iostream>
 #include <thread>
 #include <boost/fiber/all.hpp>
 
+#include "ring_channel.hpp"
+
 auto constexpr capacity = 4;
 auto constexpr message_length = 10;
 
 using packet = int;
 
 struct router {
-  /// Ingress packet queue
-  boost::fibers::buffered_channel<packet> ingress { capacity };
+  /// Ingress packet queue, between the producer and the router
+  spsc_ring_channel<packet> ingress { capacity };
 
-  /// Egress packet queue
-  boost::fibers::buffered_channel<packet> egress { capacity };
+  /// Egress packet queue, between the router and the consumer
+  spsc_ring_channel<packet> egress { capacity };
 
   /// Fiber used as a data mover between queues
   boost::fibers::fiber f;
@@ -41,18 +45,24 @@ struct router {
              std::cout << "Thread " << std::this_thread::get_id()
                        << " router " << this << " on fiber "
                        << boost::this_fiber::get_id()
-                       << " starting with buffered_channel "
+                       << " starting with ring_channel "
                        << &ingress << std::endl;
-             for (int i = 0; i < message_length; ++i) {
+             // Forward the packets by bursts of what is available
+             std::array<packet, capacity> burst;
+             for (int i = 0; i < message_length;) {
                std::cout << "router " << this << " on fiber "
                          << boost::this_fiber::get_id()
-                         << " reading from buffered_channel "
+                         << " reading from ring_channel "
                          << &ingress << " ..." << std::endl;
-               auto v = ingress.value_pop();
+               auto n = ingress.pop_n(std::span { burst }.first
+                                      (std::min<std::size_t>
+                                       (burst.size(), message_length - i)));
                std::cout << "router " << this << " on fiber "
                          << boost::this_fiber::get_id()
-                         << " routing data value " << v << std::endl;
-               egress.push(v);
+                         << " routing " << n << " packets from "
+                         << burst[0] << std::endl;
+               egress.push_n(std::span { burst }.first(n));
+               i += n;
              }
              std::cout << "router " << this << " on fiber "
                        << boost::this_fiber::get_id()
@@ -67,7 +77,7 @@ struct router {
         std::cout << "Thread " << std::this_thread::get_id()
                   << " fiber " << boost::this_fiber::get_id()
                   << " is writing " << v << " to router " << this
-                  << " on buffered_channel " << &ingress << std::endl;
+                  << " on ring_channel " << &ingress << std::endl;
     ingress.push(v);
   }
 
@@ -76,7 +86,7 @@ struct router {
     std::cout << "Thread " << std::this_thread::get_id()
               << " fiber " << boost::this_fiber::get_id()
               << " is reading from router " << this
-              << " from buffered_channel " << &egress << std::endl;
+              << " from ring_channel " << &egress << std::endl;
     return egress.value_pop();
   }
 
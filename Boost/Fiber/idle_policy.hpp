@@ -0,0 +1,361 @@
+/** \file
+
+    How a worker thread of the pooled schedulers waits when it has no
+    fiber to run
+
+    Besides busy-waiting and sleeping on a condition variable as the
+    original Boost.Fiber schedulers, the adaptive mode spins for a few
+    rounds, then yields the CPU for a few more rounds and eventually
+    parks the thread on a futex. A notification costs a single atomic
+    exchange when the worker is not parked, and a system call only when
+    it is.
+
+    A retired worker, which an elastic pool keeps in reserve, parks on
+    the futex as soon as it has no work whatever the mode, so that it
+    releases its core, and it is never woken up to steal some work.
+*/
+
+#ifndef BOOST_FIBERS_ALGO_IDLE_POLICY_H
+#define BOOST_FIBERS_ALGO_IDLE_POLICY_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <boost/config.hpp>
+
+#include "worker_stats.hpp"
+
+namespace boost::fibers::algo {
+
+/// How a worker without work waits
+enum class idle_mode {
+  /// Busy-wait, for the lowest latency at the price of a full core
+  busy,
+  /// Sleep on a condition variable until notified
+  sleep,
+  /// Spin, then yield, then park on a futex
+  adaptive
+};
+
+
+class idle_waiter;
+
+/** The workers of a pool which may be parked, to wake one of them when
+    some work is available to steal or to share
+
+    The capacity is fixed since the workers enroll concurrently. Waking
+    one is only a hint to get more parallelism: the worker having the
+    work runs it anyway.
+*/
+class idle_workers {
+  friend class idle_waiter;
+
+  /// Number of parked workers, to avoid scanning when there is none
+  std::atomic<std::uint32_t> parked_ { 0 };
+
+  std::vector<std::atomic<idle_waiter *>> waiters_;
+
+  std::atomic<std::uint32_t> enrolled_ { 0 };
+
+ public:
+
+  explicit idle_workers(std::size_t capacity) : waiters_ ( capacity ) {}
+
+
+  /// Record a worker, ignored beyond the capacity
+  void enroll(idle_waiter * w) noexcept {
+    if (auto slot = enrolled_.fetch_add(1, std::memory_order_relaxed);
+        slot < waiters_.size())
+      waiters_[slot].store(w, std::memory_order_release);
+  }
+
+
+  /// Forget about a worker before it goes away
+  void leave(idle_waiter * w) noexcept {
+    for (auto &slot : waiters_) {
+      auto expected = w;
+      if (slot.compare_exchange_strong(expected, nullptr))
+        return;
+    }
+  }
+
+
+  /// Whether some workers are parked
+  bool any_parked() const noexcept {
+    return parked_.load(std::memory_order_relaxed) != 0;
+  }
+
+
+  /// Wake up one parked worker, if any
+  void wake_one() noexcept;
+};
+
+
+/// The suspend/notify mechanics of a worker thread
+class idle_waiter {
+
+  enum : std::uint32_t { awake, parked, notified };
+
+  const idle_mode mode_;
+
+  /// The pool-wide parking registry, if any
+  idle_workers * pool_;
+
+  /// The futex word for the adaptive mode
+  alignas(64) std::atomic<std::uint32_t> state_ { awake };
+
+  /// Whether the worker is kept in reserve
+  std::atomic<bool> retired_ { false };
+
+  /// Consecutive rounds without work
+  unsigned idle_rounds_ = 0;
+
+  /// The statistics of the worker, if any
+  worker_counters * stats_;
+
+  /// Whether the worker is currently without work, to measure the idle
+  /// time with one clock reading at each transition
+  bool idle_ = false;
+  std::chrono::steady_clock::time_point idle_since_ {};
+
+  /// The suspend/notify mechanics of the sleep mode
+  std::mutex mtx_ {};
+  std::condition_variable cnd_ {};
+  bool flag_ { false };
+
+  /// Whether the worker waits on cnd_, so that a waker can find it
+  bool sleeping_ { false };
+
+  /// Park the thread until notified or until time_point
+  void park(std::chrono::steady_clock::time_point const& time_point)
+    noexcept {
+    // Announce the parking first so that a waker seeing no parked
+    // worker cannot miss this one by much
+    if (pool_)
+      pool_->parked_.fetch_add(1, std::memory_order_seq_cst);
+    auto expected = std::uint32_t { awake };
+    if (!state_.compare_exchange_strong(expected, parked)) {
+      // Already notified, so consume the notification and go back to work
+      if (pool_)
+        pool_->parked_.fetch_sub(1, std::memory_order_relaxed);
+      state_.store(awake, std::memory_order_relaxed);
+      return;
+    }
+    if (stats_)
+      stats_->park();
+    while (state_.load(std::memory_order_acquire) == parked) {
+#ifdef __linux__
+      timespec timeout;
+      timespec * tp = nullptr;
+      if (std::chrono::steady_clock::time_point::max() != time_point) {
+        auto delay = time_point - std::chrono::steady_clock::now();
+        if (delay <= delay.zero())
+          break;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(delay)
+          .count();
+        timeout.tv_sec = ns/1'000'000'000;
+        timeout.tv_nsec = ns%1'000'000'000;
+        tp = &timeout;
+      }
+      ::syscall(SYS_futex, &state_, FUTEX_WAIT_PRIVATE,
+                std::uint32_t { parked }, tp, nullptr, 0);
+#else
+      // Poll without the futex
+      auto poll = std::chrono::steady_clock::now()
+        + std::chrono::microseconds { 50 };
+      if (time_point <= std::chrono::steady_clock::now())
+        break;
+      std::this_thread::sleep_until(time_point < poll ? time_point : poll);
+#endif
+    }
+    if (pool_)
+      pool_->parked_.fetch_sub(1, std::memory_order_relaxed);
+    if (stats_ && state_.load(std::memory_order_relaxed) == notified)
+      stats_->wakeup();
+    state_.store(awake, std::memory_order_relaxed);
+  }
+
+
+  /// Wake up the thread if parked on the futex
+  void wake() noexcept {
+#ifdef __linux__
+    ::syscall(SYS_futex, &state_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+  }
+
+ public:
+
+  /// Rounds spent spinning before yielding in adaptive mode
+  static constexpr unsigned spin_rounds = 64;
+
+  /// Rounds spent yielding before parking in adaptive mode
+  static constexpr unsigned yield_rounds = 16;
+
+
+  explicit idle_waiter(idle_mode mode, idle_workers * pool = nullptr,
+                       worker_counters * stats = nullptr)
+    : mode_ { mode }
+    , pool_ { pool }
+    , stats_ { stats } {
+    if (pool_)
+      pool_->enroll(this);
+  }
+
+
+  ~idle_waiter() {
+    if (pool_)
+      pool_->leave(this);
+  }
+
+  idle_waiter(idle_waiter const&) = delete;
+  idle_waiter & operator=(idle_waiter const&) = delete;
+
+
+  idle_mode mode() const noexcept {
+    return mode_;
+  }
+
+
+  /// To be called when some work has been found
+  void working() noexcept {
+    idle_rounds_ = 0;
+    if (idle_) {
+      idle_ = false;
+      stats_->idle(std::chrono::steady_clock::now() - idle_since_);
+    }
+  }
+
+
+  void suspend_until(std::chrono::steady_clock::time_point const& time_point)
+    noexcept {
+    if (stats_ && !idle_) {
+      idle_ = true;
+      idle_since_ = std::chrono::steady_clock::now();
+      stats_->idle_begin(idle_since_);
+    }
+    if (mode_ == idle_mode::sleep) {
+      if (stats_)
+        stats_->park();
+      std::unique_lock lk { mtx_ };
+      // Count as parked for the wakers, as in park()
+      if (pool_)
+        pool_->parked_.fetch_add(1, std::memory_order_seq_cst);
+      sleeping_ = true;
+      if (std::chrono::steady_clock::time_point::max() == time_point) {
+        cnd_.wait(lk, [&] { return flag_; });
+        if (stats_)
+          stats_->wakeup();
+      }
+      else if (cnd_.wait_until(lk, time_point, [&] { return flag_; })
+               && stats_)
+        stats_->wakeup();
+      flag_ = false;
+      sleeping_ = false;
+      if (pool_)
+        pool_->parked_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    else if (retired_.load(std::memory_order_acquire))
+      park(time_point);
+    else if (mode_ == idle_mode::adaptive) {
+      if (idle_rounds_ < spin_rounds) {
+        ++idle_rounds_;
+        // Just return to look for some work again
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+      }
+      else if (idle_rounds_ < spin_rounds + yield_rounds) {
+        ++idle_rounds_;
+        std::this_thread::yield();
+      }
+      else {
+        park(time_point);
+        idle_rounds_ = 0;
+      }
+    }
+  }
+
+
+  void notify() noexcept {
+    if (mode_ == idle_mode::sleep) {
+      std::unique_lock lk { mtx_ };
+      flag_ = true;
+      lk.unlock();
+      cnd_.notify_all();
+    }
+    else if (mode_ == idle_mode::adaptive
+             || retired_.load(std::memory_order_acquire))
+      // Only pay for a system call when the worker is really parked
+      if (state_.exchange(notified, std::memory_order_acq_rel) == parked)
+        wake();
+  }
+
+
+  bool retired() const noexcept {
+    return retired_.load(std::memory_order_relaxed);
+  }
+
+
+  /// Keep the worker in reserve or bring it back to work
+  void retire(bool r) noexcept {
+    if (retired_.exchange(r, std::memory_order_acq_rel) && !r) {
+      // Wake it up whatever the mode, since it may be parked while
+      // a busy worker is not notified otherwise
+      if (mode_ == idle_mode::sleep)
+        notify();
+      else if (state_.exchange(notified, std::memory_order_acq_rel)
+               == parked)
+        wake();
+    }
+  }
+
+
+  /// Wake up this worker only if it is parked, or sleeping in sleep mode
+  bool wake_if_parked() noexcept {
+    if (retired())
+      return false;
+    if (mode_ == idle_mode::sleep) {
+      std::unique_lock lk { mtx_ };
+      // Already notified by someone else otherwise
+      if (!sleeping_ || flag_)
+        return false;
+      flag_ = true;
+      lk.unlock();
+      cnd_.notify_all();
+      return true;
+    }
+    auto expected = std::uint32_t { parked };
+    if (state_.compare_exchange_strong(expected, notified,
+                                       std::memory_order_acq_rel)) {
+      wake();
+      return true;
+    }
+    return false;
+  }
+};
+
+
+inline void idle_workers::wake_one() noexcept {
+  if (!any_parked())
+    return;
+  for (auto &slot : waiters_)
+    if (auto w = slot.load(std::memory_order_acquire);
+        w && w->wake_if_parked())
+      return;
+}
+
+}
+
+#endif // BOOST_FIBERS_ALGO_IDLE_POLICY_H
@@ -0,0 +1,339 @@
+/** \file
+
+    A network-on-chip simulator made of routers connected as a 2D mesh
+    or torus, each router port being moved by its own fiber of a
+    fiber_pool
+
+    Each input port of a router is a ring_channel drained by a fiber
+    which routes the packets by bursts with dimension-order routing,
+    first along X and then along Y, and pushes them to the input port
+    of the next router or delivers them locally.
+
+    On a torus the wrap-around links close some rings of channels, so
+    each input port has 2 virtual channels and a packet moves to the
+    second one when it crosses the wrap-around link of its current
+    dimension (the dateline) to avoid any deadlock.
+*/
+
+#ifndef FIBER_POOL_NOC_HPP
+#define FIBER_POOL_NOC_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include "fiber_pool.hpp"
+#include "ring_channel.hpp"
+#include "xorshift.hpp"
+
+namespace noc {
+
+enum class topology { mesh, torus };
+
+/// The ports of a router, the local one injecting and delivering
+enum class port : std::uint8_t { east, west, north, south, local };
+
+inline constexpr std::size_t port_number = 5;
+
+
+struct packet {
+  std::uint32_t source;
+  std::uint32_t destination;
+  /// Number of links crossed so far
+  std::uint32_t hops;
+  /// Virtual channel used on the current dimension
+  std::uint8_t vc;
+  /// Injection time, in steady_clock ticks
+  std::chrono::steady_clock::rep injected;
+};
+
+
+/// What is measured by a simulation run
+struct statistics {
+  std::uint64_t delivered = 0;
+  std::uint64_t hops = 0;
+  /// Sum of the packet latencies
+  std::chrono::nanoseconds latency { 0 };
+  std::chrono::duration<double> elapsed { 0 };
+
+
+  /// Aggregate packet rate of the whole network
+  double packets_per_second() const {
+    return delivered/elapsed.count();
+  }
+
+
+  double mean_hops() const {
+    return static_cast<double>(hops)/delivered;
+  }
+
+
+  /// Mean time for a packet to cross a router and a link
+  double hop_latency_ns() const {
+    return hops ? static_cast<double>(latency.count())/hops : 0;
+  }
+};
+
+
+class network {
+
+public:
+
+  struct configuration {
+    std::size_t width = 4;
+    std::size_t height = 4;
+    noc::topology topology = topology::mesh;
+    /// Capacity of each virtual channel of an input port, a power of 2
+    std::size_t capacity = 16;
+    /// Maximum number of packets moved at once by a port fiber
+    std::size_t burst = 16;
+  };
+
+private:
+
+  /// Written by the single fiber of the upstream port for the local
+  /// port, by all the input fibers of the upstream router otherwise
+  using channel = ring_channel<packet, false, true>;
+
+  const configuration conf;
+
+  /// Number of virtual channels per input port
+  const std::size_t vcs;
+
+  /// The channels of each router, indexed by (router*port_number +
+  /// port)*vcs + vc, null when there is no link
+  std::vector<std::unique_ptr<channel>> channels;
+
+  std::atomic<std::uint64_t> delivered = 0;
+  std::atomic<std::uint64_t> hops = 0;
+  std::atomic<std::chrono::steady_clock::rep> latency = 0;
+
+  /// Number of packets to deliver before stopping
+  std::uint64_t expected = 0;
+
+  std::size_t router_of(std::size_t x, std::size_t y) const {
+    return y*conf.width + x;
+  }
+
+
+  channel * input(std::size_t router, port p, std::size_t vc) const {
+    return channels[(router*port_number + static_cast<std::size_t>(p))*vcs
+                    + vc].get();
+  }
+
+
+  /// Whether there is a link leaving a router through a port
+  bool has_link(std::size_t x, std::size_t y, port p) const {
+    if (conf.topology == topology::torus)
+      return true;
+    switch (p) {
+    case port::east: return x + 1 < conf.width;
+    case port::west: return x > 0;
+    case port::north: return y + 1 < conf.height;
+    case port::south: return y > 0;
+    default: return true;
+    }
+  }
+
+
+  /** The output of a packet at a router with dimension-order routing
+
+      On a torus a packet goes in the direction of the shortest way
+      round.
+  */
+  port route(std::size_t x, std::size_t y, const packet &p) const {
+    auto dx = p.destination % conf.width;
+    auto dy = p.destination / conf.width;
+    auto direction = [&] (std::size_t from, std::size_t to,
+                          std::size_t size, port up, port down) {
+      if (conf.topology == topology::mesh)
+        return to > from ? up : down;
+      return (to + size - from) % size <= size/2 ? up : down;
+    };
+    if (x != dx)
+      return direction(x, dx, conf.width, port::east, port::west);
+    if (y != dy)
+      return direction(y, dy, conf.height, port::north, port::south);
+    return port::local;
+  }
+
+
+  /** Send a packet from a router through an output port
+
+      \return the input port of the next router, which is the opposite
+      of the output port
+  */
+  port next(std::size_t &x, std::size_t &y, port out, packet &p) const {
+    auto w = conf.width;
+    auto h = conf.height;
+    bool wrap = false;
+    port in = port::local;
+    switch (out) {
+    case port::east:
+      wrap = x == w - 1; x = (x + 1) % w; in = port::west; break;
+    case port::west:
+      wrap = x == 0; x = (x + w - 1) % w; in = port::east; break;
+    case port::north:
+      wrap = y == h - 1; y = (y + 1) % h; in = port::south; break;
+    case port::south:
+      wrap = y == 0; y = (y + h - 1) % h; in = port::north; break;
+    default: break;
+    }
+    // Cross the dateline
+    if (wrap)
+      p.vc = 1;
+    ++p.hops;
+    return in;
+  }
+
+
+  /// Close all the channels to stop the port fibers
+  void stop() {
+    for (auto &c : channels)
+      if (c)
+        c->close();
+  }
+
+
+  /// Drain an input channel of a router until the end of the simulation
+  void forward(std::size_t router, port in, std::size_t vc) {
+    auto x0 = router % conf.width;
+    auto y0 = router / conf.width;
+    std::vector<packet> burst(conf.burst);
+    // The packets waiting for each output channel, to push them by
+    // bursts too
+    std::vector<std::vector<packet>> outputs(port_number*vcs);
+    while (auto n = input(router, in, vc)->pop_n(burst)) {
+      std::uint64_t local = 0;
+      std::uint64_t local_hops = 0;
+      std::chrono::steady_clock::rep local_latency = 0;
+      auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+      for (auto &p : std::span { burst }.first(n)) {
+        auto out = route(x0, y0, p);
+        if (out == port::local) {
+          ++local;
+          local_hops += p.hops;
+          local_latency += now - p.injected;
+          continue;
+        }
+        // Restart on the first virtual channel with a new dimension
+        bool along_x = out == port::east || out == port::west;
+        bool came_along_x = in == port::east || in == port::west;
+        if (in == port::local || along_x != came_along_x)
+          p.vc = 0;
+        auto x = x0;
+        auto y = y0;
+        auto next_in = next(x, y, out, p);
+        outputs[static_cast<std::size_t>(next_in)*vcs + p.vc].push_back(p);
+      }
+      for (std::size_t o = 0; o != outputs.size(); ++o)
+        if (!outputs[o].empty()) {
+          auto x = x0;
+          auto y = y0;
+          packet dummy {};
+          auto out = static_cast<port>(o/vcs);
+          // The output port is the opposite of the next input port
+          auto opposite = static_cast<port>(static_cast<std::size_t>(out)
+                                            ^ 1U);
+          next(x, y, opposite, dummy);
+          input(router_of(x, y), out, o % vcs)->push_n(outputs[o]);
+          outputs[o].clear();
+        }
+      if (local) {
+        hops.fetch_add(local_hops, std::memory_order_relaxed);
+        latency.fetch_add(local_latency, std::memory_order_relaxed);
+        if (delivered.fetch_add(local, std::memory_order_acq_rel) + local
+            == expected)
+          stop();
+      }
+    }
+  }
+
+
+  /// Inject some packets with uniformly random destinations
+  void inject(std::size_t router, std::size_t packets) {
+    auto routers = conf.width*conf.height;
+    xorshift32 random { static_cast<std::uint32_t>(router) };
+    std::vector<packet> burst;
+    for (std::size_t i = 0; i != packets; ++i) {
+      // Never send to itself
+      auto destination = (router + 1 + random() % (routers - 1)) % routers;
+      burst.push_back({ static_cast<std::uint32_t>(router),
+                        static_cast<std::uint32_t>(destination), 0, 0,
+                        std::chrono::steady_clock::now()
+                        .time_since_epoch().count() });
+      if (burst.size() == conf.burst || i + 1 == packets) {
+        input(router, port::local, 0)->push_n(burst);
+        burst.clear();
+      }
+    }
+  }
+
+public:
+
+  /// \throw std::invalid_argument for a network with less than 2
+  /// routers, a torus thinner than 2 routers or an empty burst
+  explicit network(const configuration &c)
+    : conf { c }
+    , vcs { c.topology == topology::torus ? 2U : 1U } {
+    if (c.width*c.height < 2)
+      throw std::invalid_argument { "the network needs 2 routers" };
+    if (c.topology == topology::torus && (c.width < 2 || c.height < 2))
+      throw std::invalid_argument { "a torus needs 2 routers per side" };
+    if (c.burst == 0)
+      throw std::invalid_argument { "a burst needs at least 1 packet" };
+    channels.resize(c.width*c.height*port_number*vcs);
+    for (std::size_t y = 0; y != c.height; ++y)
+      for (std::size_t x = 0; x != c.width; ++x)
+        for (std::size_t p = 0; p != port_number; ++p)
+          // An input port exists where an output port of the same
+          // router exists, all the links being bidirectional
+          if (has_link(x, y, static_cast<port>(p)))
+            for (std::size_t vc = 0;
+                 vc != (p == static_cast<std::size_t>(port::local)
+                        ? 1 : vcs);
+                 ++vc)
+              channels[(router_of(x, y)*port_number + p)*vcs + vc] =
+                std::make_unique<channel>(c.capacity);
+  }
+
+
+  /** Simulate the injection of some packets from each router
+
+      It can be run only once per network.
+
+      \param[in] fp is the pool running the port fibers, which is
+      joined at the end
+  */
+  statistics run(fiber_pool &fp, std::size_t packets_per_router) {
+    auto routers = conf.width*conf.height;
+    expected = routers*packets_per_router;
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t r = 0; r != routers; ++r)
+      for (std::size_t p = 0; p != port_number; ++p)
+        for (std::size_t vc = 0; vc != vcs; ++vc)
+          if (channels[(r*port_number + p)*vcs + vc])
+            fp.submit([=, this] { forward(r, static_cast<port>(p), vc); });
+    for (std::size_t r = 0; r != routers; ++r)
+      fp.submit([=, this] { inject(r, packets_per_router); });
+    if (expected == 0)
+      stop();
+    fp.join();
+    statistics s;
+    s.elapsed = std::chrono::steady_clock::now() - start;
+    s.delivered = delivered;
+    s.hops = hops;
+    s.latency = std::chrono::duration_cast<std::chrono::nanoseconds>
+      (std::chrono::steady_clock::duration { latency.load() });
+    return s;
+  }
+};
+
+}
+
+#endif // FIBER_POOL_NOC_HPP
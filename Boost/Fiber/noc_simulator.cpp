@@ -0,0 +1,133 @@
+/** \file
+
+    Simulate a network-on-chip of routers on a fiber pool, see noc.hpp,
+    to see how the packet rate and the latency scale with the size of
+    the network and the number of threads
+
+    Sweep over some "--name value" options, each value being a
+    comma-separated list:
+    --width 2,4,8 --height 2,4,8 --topology mesh,torus --threads 1,2,4
+    with also --packets per router (10000 by default), --capacity of
+    each input virtual channel (16 by default) and --burst size (16 by
+    default).
+
+    Each point is run --warmup times (1 by default) and then
+    --repetitions times (5 by default) to report the median, written
+    with --json file.json and --csv file.csv as with the benchmark.
+    --help prints a summary of the options.
+*/
+
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmark_harness.hpp"
+#include "noc.hpp"
+
+/// The options described above
+constexpr const char * usage = R"(usage: noc_simulator [--name value]...
+
+Sweep over some options, each value being a comma-separated list:
+  --width 2,4,8 --height 2,4,8 --topology mesh,torus --threads 1,2,4
+  --packets per router (10000)
+  --capacity of each input virtual channel (16)
+  --burst size (16)
+  --warmup runs (1) and --repetitions (5) of each point
+  --json file.json and --csv file.csv to write the results
+)";
+
+int main(int argc, char *argv[]) try {
+  namespace bh = benchmark_harness;
+  bh::command_line cl { argc, argv, 1 };
+  if (cl.help()) {
+    std::cout << usage;
+    return 0;
+  }
+  std::vector<std::size_t> default_threads;
+  for (std::size_t t = 1; t <= std::thread::hardware_concurrency(); t *= 2)
+    default_threads.push_back(t);
+  auto widths = cl.list<std::size_t>("width", { 2, 4, 8 });
+  auto heights = cl.list<std::size_t>("height", { 2, 4, 8 });
+  auto topologies = cl.list<std::string>("topology", { "mesh", "torus" });
+  auto threads = cl.list<std::size_t>("threads", default_threads);
+  auto packets = cl.get<std::size_t>("packets", 10'000);
+  auto capacity = cl.get<std::size_t>("capacity", 16);
+  auto burst = cl.get<std::size_t>("burst", 16);
+  auto warmup = cl.get<std::size_t>("warmup", 1);
+  auto repetitions = cl.get<std::size_t>("repetitions", 5);
+  cl.check({ "json", "csv" });
+  for (auto &topology : topologies)
+    if (topology != "mesh" && topology != "torus")
+      throw std::invalid_argument { "unknown topology " + topology };
+
+  bh::report report;
+  for (auto &topology : topologies)
+    for (auto width : widths)
+      for (auto height : heights)
+        for (auto thread_number : threads) {
+          noc::network::configuration conf {
+            .width = width,
+            .height = height,
+            .topology = topology == "torus" ? noc::topology::torus
+                                            : noc::topology::mesh,
+            .capacity = capacity,
+            .burst = burst
+          };
+          std::vector<std::pair<std::string, std::string>> parameters {
+            { "topology", topology },
+            { "width", std::to_string(width) },
+            { "height", std::to_string(height) },
+            { "threads", std::to_string(thread_number) },
+            { "packets", std::to_string(packets) },
+            { "capacity", std::to_string(capacity) },
+            { "burst", std::to_string(burst) }
+          };
+          for (auto &[name, value] : parameters)
+            std::cout << name << ": " << value << ' ';
+          std::cout << std::endl;
+          std::vector<double> hop_latencies;
+          double mean_hops = 0;
+          auto rates = bh::repeat(warmup, repetitions, [&] {
+            noc::network n { conf };
+            fiber_pool fp { static_cast<int>(thread_number),
+                            fiber_pool::sched::work_stealing,
+                            fiber_pool::options {
+                              .idle = fiber_pool::idle_mode::adaptive } };
+            auto s = n.run(fp, packets);
+            hop_latencies.push_back(s.hop_latency_ns());
+            mean_hops = s.mean_hops();
+            return s.packets_per_second();
+          });
+          // Only keep the latencies of the measured runs
+          hop_latencies.erase(hop_latencies.begin(),
+                              hop_latencies.begin() + warmup);
+          bh::measurement rate { "noc", parameters, "packet_rate_Hz", true,
+                                 bh::summarize(rates) };
+          bh::measurement latency { "noc", parameters, "hop_latency_ns",
+                                    false, bh::summarize(hop_latencies) };
+          std::cout << " packet rate: " << rate.stats.median
+                    << " packets/s [p10 " << rate.stats.p10 << ", p90 "
+                    << rate.stats.p90 << "], latency per hop: "
+                    << latency.stats.median << " ns, mean hops: "
+                    << mean_hops << std::endl;
+          report.add(std::move(rate));
+          report.add(std::move(latency));
+        }
+
+  if (cl.has("json")) {
+    std::ofstream f { cl.get<std::string>("json", "") };
+    report.write_json(f);
+  }
+  if (cl.has("csv")) {
+    std::ofstream f { cl.get<std::string>("csv", "") };
+    report.write_csv(f);
+  }
+  return 0;
+}
+catch (std::invalid_argument &e) {
+  std::cerr << "noc_simulator: " << e.what() << "\n\n" << usage;
+  return 1;
+}
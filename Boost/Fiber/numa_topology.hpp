@@ -0,0 +1,325 @@
+/** \file
+
+    Describe the NUMA topology of the machine to keep the fibers close
+    to their memory
+
+    The topology is read from the Linux sysfs but it can also be given
+    by hand, for example to experiment with a multi-node configuration
+    on a single-node machine.
+
+    It also provides the CPU orders used to place the worker threads.
+*/
+
+#ifndef FIBER_POOL_NUMA_TOPOLOGY_HPP
+#define FIBER_POOL_NUMA_TOPOLOGY_HPP
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+class numa_topology {
+
+public:
+
+  /// The logical CPUs of each NUMA node, indexed by node number
+  std::vector<std::vector<int>> nodes;
+
+  /** The relative memory access cost from a node to another, indexed
+      like nodes, as in the ACPI SLIT table
+
+      Empty when unknown, as with a hand-written topology.
+  */
+  std::vector<std::vector<int>> distances;
+
+
+  /** Group some logical CPUs by physical core, according to the SMT
+      siblings known by sysfs
+
+      A CPU without sibling information is considered as a core on its
+      own, as with a hand-written topology.
+  */
+  static std::vector<std::vector<int>>
+  group_by_core(const std::vector<int> &cpus) {
+    std::vector<std::vector<int>> cores;
+    std::vector<int> seen;
+    for (auto cpu : cpus) {
+      if (std::find(seen.begin(), seen.end(), cpu) != seen.end())
+        continue;
+      std::vector<int> siblings;
+      std::ifstream f { "/sys/devices/system/cpu/cpu" + std::to_string(cpu)
+                        + "/topology/thread_siblings_list" };
+      std::string list;
+      if (std::getline(f, list))
+        try {
+          siblings = parse_cpu_list(list);
+        } catch (const std::invalid_argument &) {}
+      // Only keep the siblings which are part of the CPUs to group
+      std::erase_if(siblings, [&] (int s) {
+        return std::find(cpus.begin(), cpus.end(), s) == cpus.end();
+      });
+      if (siblings.empty())
+        siblings = { cpu };
+      seen.insert(seen.end(), siblings.begin(), siblings.end());
+      cores.push_back(std::move(siblings));
+    }
+    return cores;
+  }
+
+
+  /** Parse a Linux CPU list like "0-3,8,10-11"
+
+      \throw std::invalid_argument on a malformed list
+  */
+  static std::vector<int> parse_cpu_list(std::string_view list) {
+    std::vector<int> cpus;
+    auto number = [&] (std::string_view s) {
+      int n;
+      auto [end, error] = std::from_chars(s.data(), s.data() + s.size(), n);
+      if (error != std::errc {} || end != s.data() + s.size() || n < 0)
+        throw std::invalid_argument { "bad CPU list: " + std::string { list } };
+      return n;
+    };
+    while (!list.empty()) {
+      auto comma = list.find(',');
+      auto range = list.substr(0, comma);
+      list = comma == list.npos ? std::string_view {} : list.substr(comma + 1);
+      // Tolerate the trailing new-line of a sysfs file
+      while (!range.empty() && (range.back() == '\n' || range.back() == ' '))
+        range.remove_suffix(1);
+      if (range.empty())
+        continue;
+      if (auto dash = range.find('-'); dash != range.npos)
+        for (auto cpu = number(range.substr(0, dash)),
+               last = number(range.substr(dash + 1));
+             cpu <= last; ++cpu)
+          cpus.push_back(cpu);
+      else
+        cpus.push_back(number(range));
+    }
+    return cpus;
+  }
+
+
+  /** Build a topology by hand from a list of nodes separated by ';',
+      each one being a CPU list
+
+      For example "0-3;4-7" describes 2 nodes of 4 CPUs each.
+  */
+  static numa_topology parse(std::string_view description) {
+    numa_topology t;
+    while (!description.empty()) {
+      auto semicolon = description.find(';');
+      t.nodes.push_back(parse_cpu_list(description.substr(0, semicolon)));
+      description = semicolon == description.npos
+        ? std::string_view {} : description.substr(semicolon + 1);
+    }
+    return t;
+  }
+
+
+  /** Read the topology of the machine from sysfs
+
+      Fall back to a single node with all the CPUs if it is not
+      available, as on non-Linux systems.
+  */
+  static numa_topology from_sysfs() {
+    numa_topology t;
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    for (int node = 0;; ++node) {
+      fs::path dir = "/sys/devices/system/node/node" + std::to_string(node);
+      if (!fs::exists(dir / "cpulist", ec))
+        break;
+      std::ifstream f { dir / "cpulist" };
+      std::string list;
+      std::getline(f, list);
+      try {
+        t.nodes.push_back(parse_cpu_list(list));
+      } catch (const std::invalid_argument &) {
+        // Do not trust a partially understood topology
+        t.nodes.clear();
+        break;
+      }
+      // A line of numbers like "10 21"
+      std::ifstream d { dir / "distance" };
+      auto &row = t.distances.emplace_back();
+      for (int distance; d >> distance;)
+        row.push_back(distance);
+    }
+    // Forget about the memory-only nodes, in the distances too
+    for (auto node = t.nodes.size(); node-- > 0;)
+      if (t.nodes[node].empty()) {
+        t.nodes.erase(t.nodes.begin() + node);
+        if (node < t.distances.size())
+          t.distances.erase(t.distances.begin() + node);
+        for (auto &row : t.distances)
+          if (node < row.size())
+            row.erase(row.begin() + node);
+      }
+    // Only keep a complete distance matrix
+    if (t.distances.size() != t.nodes.size()
+        || std::any_of(t.distances.begin(), t.distances.end(), [&] (auto &r) {
+             return r.size() != t.nodes.size(); }))
+      t.distances.clear();
+    if (t.nodes.empty()) {
+      t.nodes.emplace_back();
+      auto cpus = std::max(1U, std::thread::hardware_concurrency());
+      for (int cpu = 0; cpu < static_cast<int>(cpus); ++cpu)
+        t.nodes.back().push_back(cpu);
+    }
+    return t;
+  }
+
+
+  bool empty() const noexcept {
+    return nodes.empty();
+  }
+
+
+  /// The total number of logical CPUs
+  std::size_t cpu_count() const noexcept {
+    std::size_t n = 0;
+    for (auto &cpus : nodes)
+      n += cpus.size();
+    return n;
+  }
+
+
+  /// The NUMA node of a logical CPU, 0 if unknown
+  std::uint32_t node_of_cpu(int cpu) const noexcept {
+    for (std::uint32_t node = 0; node < nodes.size(); ++node)
+      if (std::find(nodes[node].begin(), nodes[node].end(), cpu)
+          != nodes[node].end())
+        return node;
+    return 0;
+  }
+
+
+  /** The nodes by increasing distance from \p node, starting with \p
+      node itself
+
+      Without distance information, or between equidistant nodes, the
+      nearest node number comes first in the order node + 1, node - 1,
+      node + 2, node - 2...
+  */
+  std::vector<std::uint32_t> nodes_by_distance(std::uint32_t node) const {
+    std::vector<std::uint32_t> order;
+    for (std::size_t k = 0; k + 1 < 2*nodes.size(); ++k) {
+      auto step = (k + 1)/2;
+      // A node below 0 wraps around to a huge number
+      auto n = k % 2 ? node + step : node - step;
+      if (n < nodes.size())
+        order.push_back(n);
+    }
+    if (!distances.empty())
+      std::stable_sort(order.begin() + !order.empty(), order.end(),
+                       [&] (auto a, auto b) {
+                         return distances[node][a] < distances[node][b];
+                       });
+    return order;
+  }
+
+
+  /** The CPUs in the order filling a node before the next one, with
+      the SMT siblings of a core next to each other
+
+      Consecutive workers placed in this order share as much cache as
+      possible.
+  */
+  std::vector<int> compact_order() const {
+    std::vector<int> order;
+    for (auto &cpus : nodes)
+      for (auto &core : group_by_core(cpus))
+        order.insert(order.end(), core.begin(), core.end());
+    return order;
+  }
+
+
+  /** The CPUs in the order cycling over the nodes and using a single
+      SMT thread per core before the siblings
+
+      Consecutive workers placed in this order get as much memory
+      bandwidth and as many private caches as possible.
+  */
+  std::vector<int> scatter_order() const {
+    // For each node, the CPUs with the first thread of each core first
+    std::vector<std::vector<int>> per_node;
+    for (auto &cpus : nodes) {
+      auto cores = group_by_core(cpus);
+      std::size_t widest = 0;
+      for (auto &core : cores)
+        widest = std::max(widest, core.size());
+      auto &order = per_node.emplace_back();
+      for (std::size_t thread = 0; thread < widest; ++thread)
+        for (auto &core : cores)
+          if (thread < core.size())
+            order.push_back(core[thread]);
+    }
+    std::size_t largest = 0;
+    for (auto &cpus : per_node)
+      largest = std::max(largest, cpus.size());
+    std::vector<int> order;
+    for (std::size_t i = 0; i < largest; ++i)
+      for (auto &cpus : per_node)
+        if (i < cpus.size())
+          order.push_back(cpus[i]);
+    return order;
+  }
+
+
+  /** Map each of the \p workers workers to a node
+
+      The workers fill the nodes in order, proportionally to the number
+      of CPUs of each node, and wrap around when there are more
+      workers than CPUs.
+  */
+  std::vector<std::uint32_t> worker_nodes(std::uint32_t workers) const {
+    std::vector<std::uint32_t> mapping;
+    auto cpus = std::max<std::size_t>(1, cpu_count());
+    for (std::uint32_t w = 0; w < workers; ++w) {
+      auto slot = w % cpus;
+      std::uint32_t node = 0;
+      while (node + 1 < nodes.size() && slot >= nodes[node].size())
+        slot -= nodes[node++].size();
+      mapping.push_back(node);
+    }
+    return mapping;
+  }
+
+};
+
+
+/** Restrict the calling thread to some logical CPUs
+
+    This is best effort: it returns false when it is not possible, for
+    example with CPUs missing from a hand-written topology.
+*/
+inline bool bind_current_thread(const std::vector<int> &cpus) {
+#ifdef __linux__
+  if (cpus.empty())
+    return false;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto cpu : cpus)
+    if (cpu < CPU_SETSIZE)
+      CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  static_cast<void>(cpus);
+  return false;
+#endif
+}
+
+#endif // FIBER_POOL_NUMA_TOPOLOGY_HPP
@@ -0,0 +1,426 @@
+//          Copyright Oliver Kowalke 2015 / Lennart Braun 2019
+//          / Ronan Keryell 2020
+//
+// Distributed under the Boost Software License, Version 1.0.
+//    (See accompanying file LICENSE_1_0.txt or copy at
+//          http://www.boost.org/LICENSE_1_0.txt)
+
+// This file is adapted from pooled_work_stealing.hpp and from the
+// priority scheduler example of Boost.Fiber
+// https://github.com/boostorg/fiber/blob/develop/examples/priority.cpp
+//
+// It provides a work stealing scheduler across a given number of
+// threads where each fiber has a priority given by its fiber_properties.
+//
+// Each worker keeps one run queue per priority level behind a spinlock
+// and always runs its most urgent fiber first. A thief steals the most
+// urgent fiber of its victim, so urgent work spreads to the idle
+// workers first.
+//
+// The main context of a worker runs before any other fiber so that new
+// work keeps being accepted even when the worker is saturated. The
+// dispatcher context, which makes ready the fibers woken up from other
+// threads, runs at least every dispatcher_period fibers or when there
+// is nothing else to do, instead of every other fiber.
+//
+// An idle worker waits according to an idle_mode, see idle_policy.hpp.
+// Each worker counts its activity in its own slot of the shared
+// context, see worker_stats.hpp, and can trace the scheduling events,
+// see fiber_trace.hpp.
+//
+// The fibers sleeping with timing_wheel::sleep_until() wait on a
+// timing wheel of their worker, ticked at each pick of the next fiber,
+// see timing_wheel.hpp.
+
+#ifndef BOOST_FIBERS_ALGO_POOLED_PRIORITY_STEALING_H
+#define BOOST_FIBERS_ALGO_POOLED_PRIORITY_STEALING_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <boost/config.hpp>
+#include <boost/context/detail/prefetch.hpp>
+#include <boost/fiber/algo/algorithm.hpp>
+#include <boost/fiber/context.hpp>
+#include <boost/fiber/detail/spinlock.hpp>
+#include <boost/fiber/properties.hpp>
+#include <boost/fiber/scheduler.hpp>
+#include <boost/thread/barrier.hpp>
+
+#include "fiber_trace.hpp"
+#include "idle_policy.hpp"
+#include "timing_wheel.hpp"
+#include "worker_stats.hpp"
+#include "xorshift.hpp"
+
+#ifdef BOOST_HAS_ABI_HEADERS
+#  include BOOST_ABI_PREFIX
+#endif
+
+namespace boost::fibers::algo {
+
+class pooled_priority_stealing;
+
+/// The priority of a fiber, the higher the more urgent
+class priority_props : public fiber_properties {
+  friend class pooled_priority_stealing;
+
+  /// Atomic since a thief may read it while the owner changes it
+  std::atomic<int> priority_ = 0;
+
+  /// The scheduler whose run queue holds the fiber, only changed with
+  /// the lock of this run queue
+  std::atomic<pooled_priority_stealing *> queued_in_ = nullptr;
+
+ public:
+
+  explicit priority_props(context * ctx) : fiber_properties { ctx } {}
+
+
+  int priority() const noexcept {
+    return priority_.load(std::memory_order_relaxed);
+  }
+
+
+  /** Change the priority of the fiber
+
+      It is clamped between 0 and pooled_priority_stealing::levels - 1
+      by the scheduler.
+  */
+  void set_priority(int p) noexcept {
+    if (priority_.exchange(p, std::memory_order_relaxed) != p)
+      notify();
+  }
+};
+
+
+class pooled_priority_stealing
+  : public algorithm_with_properties<priority_props> {
+
+ public:
+
+  /// Number of priority levels
+  static constexpr std::size_t levels = 8;
+
+  /// The maximum number of fibers run before a ready dispatcher
+  static constexpr unsigned dispatcher_period = 16;
+
+  /// Shared storage among the working threads
+  struct pool_ctx {
+    pool_ctx(std::uint32_t thread_count, idle_mode idle)
+      : thread_count_ { thread_count }
+      , idle_ { idle }
+      , idle_workers_ { thread_count }
+      , schedulers_ { thread_count, nullptr }
+      , barrier_ { thread_count }
+      , stats_ ( thread_count )
+    {}
+
+    /// Number of threads in the worker pool
+    const std::uint32_t thread_count_;
+
+    /// How a thread without work waits
+    const idle_mode idle_;
+
+    /// To wake up a parked worker when there is some work to steal
+    idle_workers idle_workers_;
+
+    /// Counter used to give a unique id_ to the worker
+    std::atomic<std::uint32_t> counter_ = 0;
+
+    /// Keep track of each worker scheduler
+    std::vector<intrusive_ptr<pooled_priority_stealing>> schedulers_;
+
+    /// Synchronize all the working thread after starting and before finishing
+    boost::barrier barrier_;
+
+    /// The statistics of each worker, indexed by worker id
+    std::vector<worker_counters> stats_;
+  };
+
+  /// Type tracking the common worker data
+  using ctx = std::shared_ptr<pool_ctx>;
+
+ private:
+
+  using queue_type = scheduler::ready_queue_type;
+
+  /// Some shared datastructure among the working threads
+  ctx pool_ctx_;
+
+  /// The thread order in the working pool. 0 is first starting thread
+  std::uint32_t id_;
+
+  /// Protect the run queues against the thieves
+  mutable detail::spinlock splk_ {};
+
+  /// The runnable fibers of each priority level
+  std::array<queue_type, levels> rqueues_ {};
+
+  /// Number of fibers in rqueues_, to check it without the lock
+  std::atomic<std::size_t> size_ { 0 };
+
+  /// The pinned contexts except the dispatcher, only used by this
+  /// thread
+  queue_type pinned_ {};
+
+  /// The dispatcher context when it is ready
+  context * dispatcher_ = nullptr;
+
+  /// Number of fibers run since the dispatcher last ran
+  unsigned since_dispatcher_ = 0;
+
+  /// The thread-local suspend/notify mechanics
+  idle_waiter waiter_;
+
+  /// The fibers sleeping on this worker, see timing_wheel.hpp
+  timing_wheel timers_;
+
+  /// Pick the victims, see xorshift.hpp
+  xorshift32 random_;
+
+  /// The priority of the fibers getting their properties on this thread
+  static inline thread_local int initial_priority_ = 0;
+
+  static std::size_t level(const priority_props &props) noexcept {
+    return std::clamp<int>(props.priority(), 0, levels - 1);
+  }
+
+
+  /// Queue a fiber, with the lock held
+  void enqueue(context * c, priority_props &props) noexcept {
+    rqueues_[level(props)].push_back(*c);
+    props.queued_in_.store(this, std::memory_order_relaxed);
+    size_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+
+  /// Take the most urgent fiber, with the lock held
+  context * dequeue() noexcept {
+    for (auto q = rqueues_.rbegin(); q != rqueues_.rend(); ++q)
+      if (!q->empty()) {
+        auto c = &q->front();
+        q->pop_front();
+        properties(c).queued_in_.store(nullptr, std::memory_order_relaxed);
+        size_.fetch_sub(1, std::memory_order_relaxed);
+        return c;
+      }
+    return nullptr;
+  }
+
+ public:
+
+  static ctx create_pool_ctx(std::uint32_t thread_count, idle_mode idle) {
+    return std::make_shared<pool_ctx>(thread_count, idle);
+  }
+
+
+  pooled_priority_stealing(const ctx &pc)
+    : pool_ctx_ { pc }
+    , id_ { pc->counter_++ }
+    , waiter_ { pc->idle_, &pc->idle_workers_, &pc->stats_[id_] }
+    , random_ { id_ } {
+      BOOST_ASSERT(id_ < pool_ctx_->thread_count_);
+      pool_ctx_->schedulers_[id_] = this;
+      timers_.install();
+      pool_ctx_->barrier_.wait();
+    }
+
+
+  ~pooled_priority_stealing() {
+    timers_.uninstall();
+    // Wait for all thread of the pool such that pointers in pool_ctx_
+    // stay valid while still in use
+    pool_ctx_->barrier_.wait();
+  }
+
+  pooled_priority_stealing(pooled_priority_stealing const&) = delete;
+  pooled_priority_stealing(pooled_priority_stealing &&) = delete;
+
+  pooled_priority_stealing &
+  operator=(pooled_priority_stealing const&) = delete;
+  pooled_priority_stealing & operator=(pooled_priority_stealing &&) = delete;
+
+
+  void awakened(context * c, priority_props &props) noexcept override {
+    if (c->is_context(type::dispatcher_context)) {
+      dispatcher_ = c;
+      return;
+    }
+    if (c->is_context(type::pinned_context)) {
+      pinned_.push_back(*c);
+      return;
+    }
+    c->detach();
+    fiber_trace::record(fiber_trace::event::yield, c);
+    bool surplus;
+    {
+      detail::spinlock_lock lk { splk_ };
+      surplus = size_.load(std::memory_order_relaxed) != 0;
+      enqueue(c, props);
+    }
+    // Some other worker could help if there is already some work
+    if (surplus)
+      pool_ctx_->idle_workers_.wake_one();
+  }
+
+
+  context * pick_next() noexcept override {
+    timers_.tick();
+    auto &stats = pool_ctx_->stats_[id_];
+    if (!pinned_.empty()) {
+      auto c = &pinned_.front();
+      pinned_.pop_front();
+      stats.context_switch();
+      return c;
+    }
+    if (dispatcher_ && since_dispatcher_ >= dispatcher_period)
+      return run_dispatcher();
+    context * victim = nullptr;
+    if (size_.load(std::memory_order_relaxed) != 0) {
+      detail::spinlock_lock lk { splk_ };
+      victim = dequeue();
+    }
+    if (nullptr != victim)
+      stats.local_pop();
+    else if (BOOST_LIKELY(pool_ctx_->thread_count_ > 1))
+      //  Work stealing is only possible with more than 1 thread
+      victim = steal_any();
+    if (nullptr != victim) {
+      waiter_.working();
+      stats.context_switch();
+      boost::context::detail::prefetch_range(victim, sizeof(context));
+      context::active()->attach(victim);
+      fiber_trace::record(fiber_trace::event::resume, victim);
+      ++since_dispatcher_;
+    }
+    else if (dispatcher_)
+      return run_dispatcher();
+    return victim;
+  }
+
+
+  /// Give the most urgent runnable fiber to another worker
+  context * steal() noexcept {
+    if (size_.load(std::memory_order_relaxed) == 0)
+      return nullptr;
+    detail::spinlock_lock lk { splk_ };
+    return dequeue();
+  }
+
+
+  /** Move a fiber to the run queue of its new priority
+
+      It only applies to a fiber waiting in the run queue of this
+      worker. Otherwise the new priority is used the next time the fiber
+      is ready.
+  */
+  void property_change(context * c, priority_props &props) noexcept override {
+    if (c->is_context(type::pinned_context))
+      return;
+    detail::spinlock_lock lk { splk_ };
+    if (props.queued_in_.load(std::memory_order_relaxed) != this)
+      return;
+    c->ready_unlink();
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    enqueue(c, props);
+  }
+
+
+  /** Give a priority to the fibers whose properties are created by the
+      calling thread while this object lives
+
+      The properties of a fiber are created when it is made ready for
+      the first time, so a fiber launched with launch::post in the
+      meantime reaches its run queue with its priority already set,
+      without any window where it could be queued or stolen at the
+      default priority.
+  */
+  class initial_priority {
+    int previous_;
+
+   public:
+
+    explicit initial_priority(int p) noexcept
+      : previous_ { std::exchange(initial_priority_, p) } {}
+
+    ~initial_priority() {
+      initial_priority_ = previous_;
+    }
+
+    initial_priority(initial_priority const&) = delete;
+    initial_priority & operator=(initial_priority const&) = delete;
+  };
+
+
+  fiber_properties * new_properties(context * c) override {
+    auto props = new priority_props { c };
+    props->priority_.store(initial_priority_, std::memory_order_relaxed);
+    return props;
+  }
+
+
+  bool has_ready_fibers() const noexcept override {
+    return !pinned_.empty() || dispatcher_
+      || size_.load(std::memory_order_relaxed) != 0;
+  }
+
+
+  void suspend_until(std::chrono::steady_clock::time_point const& time_point)
+    noexcept override {
+    // Wake up in time for the next sleeping fiber
+    waiter_.suspend_until(timers_.deadline(time_point));
+  }
+
+
+  void notify() noexcept override {
+    waiter_.notify();
+  }
+
+
+ private:
+
+  context * run_dispatcher() noexcept {
+    auto c = dispatcher_;
+    dispatcher_ = nullptr;
+    since_dispatcher_ = 0;
+    pool_ctx_->stats_[id_].context_switch();
+    return c;
+  }
+
+
+  /// Try each other worker once, starting from a random one
+  context * steal_any() noexcept {
+    std::uint32_t size = pool_ctx_->thread_count_;
+    auto start = random_() % size;
+    auto &stats = pool_ctx_->stats_[id_];
+    for (std::uint32_t i = 0; i < size; ++i) {
+      auto id = (start + i) % size;
+      // Prevent stealing from own scheduler
+      if (id == id_)
+        continue;
+      auto victim = pool_ctx_->schedulers_[id]->steal();
+      stats.steal(victim != nullptr);
+      if (victim) {
+        fiber_trace::record(fiber_trace::event::steal, victim);
+        return victim;
+      }
+    }
+    return nullptr;
+  }
+
+};
+
+}
+
+#ifdef BOOST_HAS_ABI_HEADERS
+#  include BOOST_ABI_SUFFIX
+#endif
+
+#endif // BOOST_FIBERS_ALGO_POOLED_PRIORITY_STEALING_H
@@ -17,14 +17,33 @@
 //
 // The main change to the original scheduler is to replace static
 // variables by a shared context.
+//
+// An idle worker waits according to an idle_mode, see idle_policy.hpp,
+// and a worker adding to a non-empty global queue wakes up a parked
+// one, or a sleeping one in idle_mode::sleep.
+//
+// Each worker counts its activity in its own slot of the shared
+// context, see worker_stats.hpp, and can trace the scheduling events,
+// see fiber_trace.hpp.
+//
+// The global run queue is a parameter: either the original deque
+// behind a mutex or a lock-free bounded ring spilling into a locked
+// deque only when it is full.
+//
+// The fibers sleeping with timing_wheel::sleep_until() wait on a
+// timing wheel of their worker, ticked at each pick of the next fiber,
+// and then go back to the global queue, see timing_wheel.hpp.
 
 #ifndef BOOST_FIBERS_ALGO_POOLED_SHARED_WORK_H
 #define BOOST_FIBERS_ALGO_POOLED_SHARED_WORK_H
 
-#include <condition_variable>
+#include <atomic>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <deque>
 #include <mutex>
+#include <vector>
 
 #include <boost/config.hpp>
 #include <boost/assert.hpp>
@@ -35,6 +54,12 @@
 #include <boost/fiber/scheduler.hpp>
 #include "boost/fiber/type.hpp"
 
+#include "bounded_mpmc_queue.hpp"
+#include "fiber_trace.hpp"
+#include "idle_policy.hpp"
+#include "timing_wheel.hpp"
+#include "worker_stats.hpp"
+
 #ifdef BOOST_HAS_ABI_HEADERS
 #  include BOOST_ABI_PREFIX
 #endif
@@ -46,26 +71,139 @@
 
 namespace boost::fibers::algo {
 
-class BOOST_FIBERS_DECL pooled_shared_work : public algorithm {
+/// The original global run queue, a deque protected by a mutex
+class locked_run_queue {
+  std::deque<context *> queue_ {};
+
+  mutable std::mutex mtx_ {};
+
+ public:
+
+  explicit locked_run_queue(std::size_t /* capacity */) {}
+
+
+  void push(context * ctx) {
+    std::unique_lock lk { mtx_ };
+    queue_.push_back(ctx);
+  }
+
+
+  context * pop() noexcept {
+    std::unique_lock lk { mtx_ };
+    if (queue_.empty())
+      return nullptr;
+    auto ctx = queue_.front();
+    queue_.pop_front();
+    return ctx;
+  }
+
+
+  bool empty() const noexcept {
+    std::unique_lock lk { mtx_ };
+    return queue_.empty();
+  }
+};
+
+
+/** A global run queue which is a lock-free bounded ring in the common
+    case
+
+    When the ring is full, the contexts go to an overflow deque behind
+    a mutex. Each successful pop from the ring moves back one overflow
+    context into the ring so that the overflow is drained even when
+    the ring never gets empty.
+*/
+class lockfree_run_queue {
+  bounded_mpmc_queue<context *> ring_;
+
+  std::deque<context *> overflow_ {};
+
+  std::mutex overflow_mtx_ {};
+
+  /// Allow checking the overflow without taking its lock
+  std::atomic<std::size_t> overflow_size_ { 0 };
+
+  context * pop_overflow() noexcept {
+    std::unique_lock lk { overflow_mtx_ };
+    if (overflow_.empty())
+      return nullptr;
+    auto ctx = overflow_.front();
+    overflow_.pop_front();
+    overflow_size_.fetch_sub(1, std::memory_order_relaxed);
+    return ctx;
+  }
+
+ public:
 
-  using rqueue_type = std::deque<context *>;
+  explicit lockfree_run_queue(std::size_t capacity) : ring_ { capacity } {}
+
+
+  void push(context * ctx) {
+    if (BOOST_LIKELY(ring_.try_push(ctx)))
+      return;
+    std::unique_lock lk { overflow_mtx_ };
+    overflow_.push_back(ctx);
+    overflow_size_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+
+  context * pop() noexcept {
+    context * ctx = nullptr;
+    if (BOOST_LIKELY(ring_.try_pop(ctx))) {
+      if (BOOST_UNLIKELY(overflow_size_.load(std::memory_order_relaxed) != 0))
+        // There is now some room in the ring for an old context
+        if (auto spilled = pop_overflow(); nullptr != spilled)
+          push(spilled);
+      return ctx;
+    }
+    if (overflow_size_.load(std::memory_order_relaxed) == 0)
+      return nullptr;
+    return pop_overflow();
+  }
+
+
+  bool empty() const noexcept {
+    return ring_.empty_approx()
+      && overflow_size_.load(std::memory_order_relaxed) == 0;
+  }
+};
+
+
+template <typename RunQueue>
+class basic_pooled_shared_work : public algorithm {
+
+  using rqueue_type = RunQueue;
   using lqueue_type = scheduler::ready_queue_type;
 
  public:
 
+  /// Default number of contexts in a bounded global queue
+  static constexpr std::size_t default_capacity = 1024;
+
   /// Shared storage among the working threads
   struct pool_ctx {
-    pool_ctx(bool suspend) : suspend_ { suspend }
+    pool_ctx(idle_mode idle, std::uint32_t thread_count,
+             std::size_t capacity = default_capacity)
+      : idle_ { idle }
+      , idle_workers_ { thread_count }
+      , rqueue_ { capacity }
+      , stats_ ( thread_count )
     {}
 
-    /// Indicate if a thread without work goes to sleep instead of busy-waiting
-    const bool suspend_;
+    /// How a thread without work waits
+    const idle_mode idle_;
+
+    /// To wake up a parked worker when there is some more work
+    idle_workers idle_workers_;
 
     /// The global queue storing the runnable fibers
-    rqueue_type rqueue_ {};
+    rqueue_type rqueue_;
 
-    /// For concurrent access to the global queue
-    std::mutex rqueue_mtx_ {};
+    /// Counter used to give a statistics slot to each worker
+    std::atomic<std::uint32_t> counter_ = 0;
+
+    /// The statistics of each worker
+    std::vector<worker_counters> stats_;
   };
 
   /// Type tracking the common worker data
@@ -79,27 +217,43 @@ class BOOST_FIBERS_DECL pooled_shared_work : public algorithm {
   /// The runnable local fibers bound to the thread
   lqueue_type lqueue_ {};
 
+  /// The statistics of this worker
+  worker_counters * stats_;
+
   /// The thread-local suspend/notify mechanics
-  std::mutex mtx_ {};
-  std::condition_variable cnd_ {};
-  bool flag_ { false };
+  idle_waiter waiter_;
+
+  /// The fibers sleeping on this worker, see timing_wheel.hpp
+  timing_wheel timers_;
 
  public:
 
   static ctx
-  create_pool_ctx(bool suspend) {
-    return std::make_shared<pool_ctx>(suspend);
+  create_pool_ctx(idle_mode idle, std::uint32_t thread_count,
+                  std::size_t capacity = default_capacity) {
+    return std::make_shared<pool_ctx>(idle, thread_count, capacity);
   }
 
 
-  pooled_shared_work(const ctx &pc) : pool_ctx_ { pc }
-  {}
+  basic_pooled_shared_work(const ctx &pc)
+    : pool_ctx_ { pc }
+    , stats_ { &pc->stats_.at(pc->counter_++) }
+    , waiter_ { pc->idle_, &pc->idle_workers_, stats_ }
+  {
+    timers_.install();
+  }
+
 
-  pooled_shared_work(pooled_shared_work const&) = delete;
-  pooled_shared_work(pooled_shared_work &&) = delete;
+  ~basic_pooled_shared_work() {
+    timers_.uninstall();
+  }
 
-  pooled_shared_work & operator=(pooled_shared_work const&) = delete;
-  pooled_shared_work & operator=(pooled_shared_work &&) = delete;
+  basic_pooled_shared_work(basic_pooled_shared_work const&) = delete;
+  basic_pooled_shared_work(basic_pooled_shared_work &&) = delete;
+
+  basic_pooled_shared_work &
+  operator=(basic_pooled_shared_work const&) = delete;
+  basic_pooled_shared_work & operator=(basic_pooled_shared_work &&) = delete;
 
   void awakened(context * ctx) noexcept override {
     if (ctx->is_context(type::pinned_context)) { /*<
@@ -110,31 +264,32 @@ class BOOST_FIBERS_DECL pooled_shared_work : public algorithm {
       lqueue_.push_back(*ctx);
     } else {
       ctx->detach();
-      std::unique_lock lk { pool_ctx_->rqueue_mtx_ }; /*<
+      fiber_trace::record(fiber_trace::event::yield, ctx);
+      // Some other worker could help if there is already some work
+      bool surplus = !pool_ctx_->rqueue_.empty();
+      pool_ctx_->rqueue_.push(ctx); /*<
             worker fiber, enqueue on shared queue
       >*/
-      pool_ctx_->rqueue_.push_back(ctx);
+      if (surplus)
+        pool_ctx_->idle_workers_.wake_one();
     }
   }
 
 
   context * pick_next() noexcept override {
-    context * ctx = nullptr;
-    std::unique_lock lk { pool_ctx_->rqueue_mtx_ };
-    auto &rq = pool_ctx_->rqueue_;
-    if (!rq.empty()) { /*<
+    timers_.tick();
+    context * ctx = pool_ctx_->rqueue_.pop(); /*<
             pop an item from the ready queue
       >*/
-      ctx = rq.front();
-      rq.pop_front();
-      lk.unlock();
-      BOOST_ASSERT(nullptr != ctx);
+    if (nullptr != ctx) {
+      waiter_.working();
+      stats_->local_pop();
       context::active()->attach(ctx); /*<
             attach context to current scheduler via the active fiber
             of this thread
        >*/
+      fiber_trace::record(fiber_trace::event::resume, ctx);
     } else {
-      lk.unlock();
       if (!lqueue_.empty()) { /*<
                 nothing in the ready queue, return main or dispatcher fiber
         >*/
@@ -142,43 +297,37 @@ class BOOST_FIBERS_DECL pooled_shared_work : public algorithm {
         lqueue_.pop_front();
       }
     }
+    if (nullptr != ctx)
+      stats_->context_switch();
     return ctx;
   }
 
 
   bool has_ready_fibers() const noexcept override {
-    std::unique_lock lock { pool_ctx_->rqueue_mtx_ };
     return !pool_ctx_->rqueue_.empty() || !lqueue_.empty();
   }
 
 
   void suspend_until(std::chrono::steady_clock::time_point const& time_point)
     noexcept override {
-    if (pool_ctx_->suspend_) {
-      if (std::chrono::steady_clock::time_point::max() == time_point) {
-        std::unique_lock lk { mtx_ };
-        cnd_.wait(lk, [this](){ return flag_; });
-        flag_ = false;
-      } else {
-        std::unique_lock lk { mtx_ };
-        cnd_.wait_until(lk, time_point, [this](){ return flag_; });
-        flag_ = false;
-      }
-    }
+    // Wake up in time for the next sleeping fiber
+    waiter_.suspend_until(timers_.deadline(time_point));
   }
 
 
   void notify() noexcept override {
-    if (pool_ctx_->suspend_) {
-      std::unique_lock lk { mtx_ };
-      flag_ = true;
-      lk.unlock();
-      cnd_.notify_all();
-    }
+    waiter_.notify();
   }
 
 };
 
+/// The original scheduler with a global queue protected by a mutex
+using pooled_shared_work = basic_pooled_shared_work<locked_run_queue>;
+
+/// The scheduler with a mostly lock-free global queue
+using pooled_lockfree_shared_work =
+  basic_pooled_shared_work<lockfree_run_queue>;
+
 }
 
 #ifdef _MSC_VER
@@ -15,16 +15,41 @@
 //
 // The main change to the original scheduler is to replace static
 // variables by a shared context.
+//
+// An idle worker waits according to an idle_mode, see idle_policy.hpp,
+// and a worker with some surplus of work wakes up a parked one.
+//
+// When the workers are grouped by NUMA node, a worker without work
+// first tries to steal from the workers of its own node and crosses
+// the node boundary only when they have nothing to give, trying the
+// nearest nodes according to the sysfs distances first.
+//
+// Otherwise the victims are tried either at random as in the original
+// scheduler or by increasing distance of the worker ids, which are
+// often bound to neighbour CPUs. A thief can also take half of the
+// victim queue at once instead of a single fiber.
+//
+// Each worker counts its activity in its own slot of the shared
+// context, see worker_stats.hpp, and can trace the scheduling events,
+// see fiber_trace.hpp.
+//
+// Only the workers with the lowest ids are active, the other ones
+// being retired until the pool needs them again. A retired worker
+// does not steal, hands the fibers it gets over to the active workers
+// and parks, see idle_policy.hpp, while the active workers still steal
+// from it to drain its queue.
+//
+// The fibers sleeping with timing_wheel::sleep_until() wait on a
+// timing wheel of their worker, ticked at each pick of the next fiber,
+// see timing_wheel.hpp.
 
 #ifndef BOOST_FIBERS_ALGO_POOLED_WORK_STEALING_H
 #define BOOST_FIBERS_ALGO_POOLED_WORK_STEALING_H
 
 #include <atomic>
-#include <condition_variable>
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
-#include <mutex>
 #include <vector>
 
 #include <boost/config.hpp>
@@ -32,35 +57,94 @@
 #include <boost/fiber/detail/config.hpp>
 #include <boost/fiber/algo/algorithm.hpp>
 #include <boost/fiber/context.hpp>
-#include <boost/fiber/detail/context_spinlock_queue.hpp>
 #include <boost/fiber/detail/context_spmc_queue.hpp>
 #include <boost/fiber/scheduler.hpp>
 #include <boost/thread/barrier.hpp>
 
+#include "context_steal_queue.hpp"
+#include "fiber_trace.hpp"
+#include "idle_policy.hpp"
+#include "timing_wheel.hpp"
+#include "worker_stats.hpp"
+#include "xorshift.hpp"
+
 #ifdef BOOST_HAS_ABI_HEADERS
 #  include BOOST_ABI_PREFIX
 #endif
 
 namespace boost::fibers::algo {
 
+/// How a worker without work chooses the workers to steal from
+enum class victim_selection {
+  /// Uniformly at random, as the original Boost.Fiber scheduler
+  random,
+  /// The nearest worker ids first: id + 1, id - 1, id + 2...
+  neighbours
+};
+
+
 class BOOST_FIBERS_DECL pooled_work_stealing : public algorithm {
 
  public:
 
   /// Shared storage among the working threads
   struct pool_ctx {
-    pool_ctx(std::uint32_t thread_count, bool suspend)
+    pool_ctx(std::uint32_t thread_count, idle_mode idle,
+             std::vector<std::uint32_t> node_of_worker = {},
+             victim_selection victims = victim_selection::random,
+             bool steal_half = false,
+             std::vector<std::vector<std::uint32_t>> node_order = {})
       : thread_count_ { thread_count }
-      , suspend_ { suspend }
+      , active_ { thread_count }
+      , idle_ { idle }
+      , victims_ { victims }
+      , steal_half_ { steal_half }
+      , idle_workers_ { thread_count }
       , schedulers_ { thread_count, nullptr }
       , barrier_ { thread_count }
-    {}
+      , node_of_worker_ { std::move(node_of_worker) }
+      , node_order_ { std::move(node_order) }
+      , stats_ ( thread_count )
+    {
+      BOOST_ASSERT(node_of_worker_.empty()
+                   || node_of_worker_.size() == thread_count);
+      for (std::uint32_t w = 0; w < node_of_worker_.size(); ++w) {
+        auto node = node_of_worker_[w];
+        if (node >= node_workers_.size())
+          node_workers_.resize(node + 1);
+        node_workers_[node].push_back(w);
+      }
+      // By default the nearest node number comes first
+      for (std::uint32_t node = node_order_.size();
+           node < node_workers_.size(); ++node) {
+        auto &order = node_order_.emplace_back();
+        for (std::size_t k = 0; k + 1 < 2*node_workers_.size(); ++k) {
+          auto distance = (k + 1)/2;
+          // A node below 0 wraps around to a huge number
+          auto n = k % 2 ? node + distance : node - distance;
+          if (n < node_workers_.size())
+            order.push_back(n);
+        }
+      }
+    }
 
     /// Number of threads in the worker pool
     const std::uint32_t thread_count_;
 
-    /// Indicate if a thread without work goes to sleep instead of busy-waiting
-    const bool suspend_;
+    /// Number of active workers, the ones with an id lower than it
+    std::atomic<std::uint32_t> active_;
+
+    /// How a thread without work waits
+    const idle_mode idle_;
+
+    /// How to choose the victims outside of the NUMA grouping
+    const victim_selection victims_;
+
+    /// Steal half of the victim queue instead of a single fiber
+    const bool steal_half_;
+
+    /// To wake up a parked worker when there is some work to steal
+    idle_workers idle_workers_;
 
     /// Counter used to give a unique id_ to the worker
     std::atomic<std::uint32_t> counter_ = 0;
@@ -70,6 +154,20 @@ class BOOST_FIBERS_DECL pooled_work_stealing : public algorithm {
 
     /// Synchronize all the working thread after starting and before finishing
     boost::barrier barrier_;
+
+    /// The NUMA node of each worker, empty when the topology is ignored
+    const std::vector<std::uint32_t> node_of_worker_;
+
+    /// The workers of each NUMA node
+    std::vector<std::vector<std::uint32_t>> node_workers_;
+
+    /** For each NUMA node, the nodes to steal from, starting with
+        itself and nearest first, see numa_topology::nodes_by_distance
+    */
+    std::vector<std::vector<std::uint32_t>> node_order_;
+
+    /// The statistics of each worker, indexed by worker id
+    std::vector<worker_counters> stats_;
   };
 
   /// Type tracking the common worker data
@@ -87,31 +185,61 @@ class BOOST_FIBERS_DECL pooled_work_stealing : public algorithm {
 #ifdef BOOST_FIBERS_USE_SPMC_QUEUE
   boost::fibers::detail::context_spmc_queue rqueue_ {};
 #else
-  boost::fibers::detail::context_spinlock_queue rqueue_ {};
+  context_steal_queue rqueue_ {};
 #endif
 
   /// The thread-local suspend/notify mechanics
-  std::mutex mtx_ {};
-  std::condition_variable cnd_ {};
-  bool flag_ { false };
+  idle_waiter waiter_;
+
+  /// The fibers sleeping on this worker, see timing_wheel.hpp
+  timing_wheel timers_;
+
+  /// Pick the victims, see xorshift.hpp
+  xorshift32 random_;
 
  public:
 
+  /// The maximum number of fibers taken by a single steal
+  static constexpr std::size_t max_steal_batch = 64;
+
+
   static ctx
-  create_pool_ctx(std::uint32_t thread_count, bool suspend) {
-    return std::make_shared<pool_ctx>(thread_count, suspend);
+  create_pool_ctx(std::uint32_t thread_count, idle_mode idle,
+                  std::vector<std::uint32_t> node_of_worker = {},
+                  victim_selection victims = victim_selection::random,
+                  bool steal_half = false,
+                  std::vector<std::vector<std::uint32_t>> node_order = {}) {
+    return std::make_shared<pool_ctx>(thread_count, idle,
+                                      std::move(node_of_worker),
+                                      victims, steal_half,
+                                      std::move(node_order));
   }
 
 
   pooled_work_stealing(const ctx &pc)
+    : pooled_work_stealing { pc, pc->counter_++ } {}
+
+
+  /** Use an explicit worker id, for example to match the NUMA node the
+      worker thread is bound to
+
+      The ids across the pool have to be unique and lower than the
+      number of threads, without mixing with the other constructor.
+  */
+  pooled_work_stealing(const ctx &pc, std::uint32_t id)
     : pool_ctx_ { pc }
-    , id_ { pool_ctx_->counter_++ } {
+    , id_ { id }
+    , waiter_ { pc->idle_, &pc->idle_workers_, &pc->stats_[id] }
+    , random_ { id } {
+      BOOST_ASSERT(id_ < pool_ctx_->thread_count_);
       pool_ctx_->schedulers_[id_] = this;
+      timers_.install();
       pool_ctx_->barrier_.wait();
     }
 
 
   ~pooled_work_stealing() {
+    timers_.uninstall();
     // Wait for all thread of the pool such that pointers in pool_ctx_
     // stay valid while still in use
     pool_ctx_->barrier_.wait();
@@ -124,48 +252,91 @@ class BOOST_FIBERS_DECL pooled_work_stealing : public algorithm {
   pooled_work_stealing & operator=(pooled_work_stealing &&) = delete;
 
 
+  /** Change the number of active workers
+
+      The workers with an id from \p active on are retired and the other
+      ones are brought back to work. It must not be called concurrently.
+  */
+  static void set_active(const ctx &pc, std::uint32_t active) noexcept {
+    BOOST_ASSERT(active >= 1 && active <= pc->thread_count_);
+    pc->active_.store(active, std::memory_order_release);
+    for (std::uint32_t id = 0; id < pc->thread_count_; ++id)
+      pc->schedulers_[id]->waiter_.retire(id >= active);
+  }
+
+
+  /// Number of fibers ready to run in the queues of the active workers
+  static std::size_t ready_fibers(const ctx &pc) noexcept {
+    std::size_t n = 0;
+    auto active = pc->active_.load(std::memory_order_acquire);
+    for (std::uint32_t id = 0; id < active; ++id)
+#ifdef BOOST_FIBERS_USE_SPMC_QUEUE
+      n += !pc->schedulers_[id]->rqueue_.empty();
+#else
+      n += pc->schedulers_[id]->rqueue_.size();
+#endif
+    return n;
+  }
+
+
   void awakened(boost::fibers::context * ctx) noexcept override {
-    if (!ctx->is_context(boost::fibers::type::pinned_context))
+    if (!ctx->is_context(boost::fibers::type::pinned_context)) {
       ctx->detach();
+      fiber_trace::record(fiber_trace::event::yield, ctx);
+#ifndef BOOST_FIBERS_USE_SPMC_QUEUE
+      if (BOOST_UNLIKELY(waiter_.retired())) {
+        // Hand the fiber over to an active worker, which attaches it
+        // when picking it, so that this one can park
+        auto &target = pool_ctx_->schedulers_
+          [random_() % pool_ctx_->active_.load(std::memory_order_acquire)];
+        target->rqueue_.push(ctx);
+        target->notify();
+        return;
+      }
+#endif
+    }
+    // Some other worker could help if there is already some work
+    bool surplus = !rqueue_.empty();
     rqueue_.push(ctx);
+    if (surplus)
+      pool_ctx_->idle_workers_.wake_one();
   }
 
 
   context * pick_next() noexcept override {
+    timers_.tick();
     context * victim = rqueue_.pop();
     if (nullptr != victim) {
+      waiter_.working();
+      pool_ctx_->stats_[id_].local_pop();
       boost::context::detail::prefetch_range(victim, sizeof(*victim));
       if (!victim->is_context(type::pinned_context)) {
         context::active()->attach(victim);
+        fiber_trace::record(fiber_trace::event::resume, victim);
       }
     }
     else {
-      std::size_t size = pool_ctx_->thread_count_;
-      //  Work stealing is only possible with more than 1 thread
-      if (BOOST_LIKELY(size > 1)) {
-        std::size_t count = 0;
-        static thread_local std::minstd_rand generator { std::random_device{}() };
-        std::uniform_int_distribution< std::uint32_t > distribution
-          { 0, static_cast<std::uint32_t>(size - 1) };
-        do {
-          std::uint32_t id = 0;
-          do {
-            ++count;
-            // Random selection of one logical CPU that belongs to the
-            // local NUMA node
-            id = distribution(generator);
-            // Prevent stealing from own scheduler
-          } while (id == id_);
-          // Steal context from other scheduler
-          victim = pool_ctx_->schedulers_[id]->steal();
-        } while (nullptr == victim && count < size);
+      //  Work stealing is only possible with more than 1 thread and a
+      //  retired worker does not look for more work
+      if (BOOST_LIKELY(pool_ctx_->thread_count_ > 1)
+          && !waiter_.retired()) {
+        if (!pool_ctx_->node_of_worker_.empty())
+          victim = steal_numa();
+        else if (pool_ctx_->victims_ == victim_selection::neighbours)
+          victim = steal_neighbours();
+        else
+          victim = steal_random();
         if (nullptr != victim) {
+          waiter_.working();
           boost::context::detail::prefetch_range(victim, sizeof(context));
           BOOST_ASSERT(!victim->is_context(type::pinned_context));
           context::active()->attach(victim);
+          fiber_trace::record(fiber_trace::event::resume, victim);
         }
       }
     }
+    if (nullptr != victim)
+      pool_ctx_->stats_[id_].context_switch();
     return victim;
   }
 
@@ -175,6 +346,27 @@ class BOOST_FIBERS_DECL pooled_work_stealing : public algorithm {
   }
 
 
+  /** Steal up to half of the runnable fibers
+
+      \param[out] out receives the stolen fibers
+
+      \param[in] max is the maximum number of fibers to steal
+
+      \return the number of stolen fibers
+  */
+  virtual std::size_t steal_half(context ** out, std::size_t max) noexcept {
+#ifdef BOOST_FIBERS_USE_SPMC_QUEUE
+    // This queue can only give its fibers one by one
+    if (max == 0)
+      return 0;
+    out[0] = rqueue_.steal();
+    return out[0] != nullptr;
+#else
+    return rqueue_.steal_half(out, max);
+#endif
+  }
+
+
   bool has_ready_fibers() const noexcept override {
     return !rqueue_.empty();
   }
@@ -182,28 +374,114 @@ class BOOST_FIBERS_DECL pooled_work_stealing : public algorithm {
 
   void suspend_until(std::chrono::steady_clock::time_point const& time_point)
     noexcept override {
-    if (pool_ctx_->suspend_) {
-      if (std::chrono::steady_clock::time_point::max() == time_point) {
-        std::unique_lock lk { mtx_ };
-        cnd_.wait(lk, [&] { return flag_; });
-        flag_ = false;
-      }
-      else {
-        std::unique_lock lk { mtx_ };
-        cnd_.wait_until(lk, time_point, [&] { return flag_; });
-        flag_ = false;
-      }
-    }
+    // Wake up in time for the next sleeping fiber
+    waiter_.suspend_until(timers_.deadline(time_point));
   }
 
 
   void notify() noexcept override {
-    if (pool_ctx_->suspend_) {
-      std::unique_lock lk { mtx_ };
-      flag_ = true;
-      lk.unlock();
-      cnd_.notify_all();
+    waiter_.notify();
+  }
+
+
+ private:
+
+  /** Steal some work from the worker \p id
+
+      In batch mode, the extra fibers are queued locally where they can
+      run next or be stolen again by another thief.
+  */
+  context * steal_from(std::uint32_t id) noexcept {
+    auto &victim_scheduler = pool_ctx_->schedulers_[id];
+    auto &stats = pool_ctx_->stats_[id_];
+    if (!pool_ctx_->steal_half_) {
+      auto victim = victim_scheduler->steal();
+      stats.steal(victim != nullptr);
+      if (victim)
+        fiber_trace::record(fiber_trace::event::steal, victim);
+      return victim;
+    }
+    context * batch[max_steal_batch];
+    auto n = victim_scheduler->steal_half(batch, max_steal_batch);
+    stats.steal(n != 0);
+    if (n == 0)
+      return nullptr;
+    for (std::size_t i = 0; i < n; ++i)
+      fiber_trace::record(fiber_trace::event::steal, batch[i]);
+    for (std::size_t i = 1; i < n; ++i)
+      rqueue_.push(batch[i]);
+    if (n > 2)
+      pool_ctx_->idle_workers_.wake_one();
+    return batch[0];
+  }
+
+
+  /// Try to steal some work from other workers picked at random
+  context * steal_random() noexcept {
+    std::size_t size = pool_ctx_->thread_count_;
+    std::size_t count = 0;
+    context * victim = nullptr;
+    do {
+      std::uint32_t id = 0;
+      do {
+        ++count;
+        // Random selection of one logical CPU
+        id = random_() % size;
+        // Prevent stealing from own scheduler
+      } while (id == id_);
+      // Steal context from other scheduler
+      victim = steal_from(id);
+    } while (nullptr == victim && count < size);
+    return victim;
+  }
+
+
+  /** Try to steal some work from the nearest workers first, in the
+      order id + 1, id - 1, id + 2, id - 2... modulo the pool size
+
+      Each worker is tried once.
+  */
+  context * steal_neighbours() noexcept {
+    std::uint32_t size = pool_ctx_->thread_count_;
+    for (std::uint32_t k = 1; k < size; ++k) {
+      auto distance = (k + 1)/2;
+      auto id = k % 2 ? (id_ + distance) % size
+                      : (id_ + size - distance) % size;
+      if (auto victim = steal_from(id))
+        return victim;
+    }
+    return nullptr;
+  }
+
+
+  /** Try to steal some work from the workers of the local NUMA node
+      first and then from the other nodes in the order of node_order_,
+      by increasing sysfs distance when it is known
+
+      Each worker is tried once, starting from a random one inside each
+      node to spread the thieves.
+  */
+  context * steal_numa() noexcept {
+    auto &nodes = pool_ctx_->node_workers_;
+    auto local = pool_ctx_->node_of_worker_[id_];
+    for (auto node : pool_ctx_->node_order_[local]) {
+      if (node >= nodes.size())
+        continue;
+      auto &workers = nodes[node];
+      auto size = workers.size();
+      if (size == 0)
+        continue;
+      auto start = random_() % size;
+      for (std::size_t i = 0; i < size; ++i) {
+        auto id = workers[(start + i) % size];
+        // Prevent stealing from own scheduler
+        if (id == id_)
+          continue;
+        if (auto victim = steal_from(id))
+          return victim;
+      }
     }
+    return nullptr;
   }
 
 };
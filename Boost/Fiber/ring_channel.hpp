@@ -0,0 +1,443 @@
+/** \file
+
+    A bounded channel between fibers, possibly running in different
+    threads, with the same push/pop interface as
+    boost::fibers::buffered_channel
+
+    The values go through a lock-free ring, see bounded_mpmc_queue.hpp,
+    so a push into a channel which is not full or a pop from a channel
+    which is not empty takes no lock. The spinlock is only taken to put
+    a fiber to sleep on a full or empty channel and to wake it up, the
+    same way as in buffered_channel.
+
+    A burst of values can be moved with push_n() and pop_n() for about
+    the synchronization cost of a single value.
+
+    The producer or the consumer side can be declared single to save a
+    CAS on each operation, with for example spsc_ring_channel<T> when a
+    single fiber writes and a single fiber reads.
+*/
+
+#ifndef FIBER_POOL_RING_CHANNEL_HPP
+#define FIBER_POOL_RING_CHANNEL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <system_error>
+#include <utility>
+
+#include <boost/fiber/channel_op_status.hpp>
+#include <boost/fiber/context.hpp>
+#include <boost/fiber/detail/convert.hpp>
+#include <boost/fiber/detail/spinlock.hpp>
+#include <boost/fiber/exceptions.hpp>
+
+#include "bounded_mpmc_queue.hpp"
+
+template <typename T,
+          bool single_producer = false,
+          bool single_consumer = false>
+class ring_channel {
+
+  using channel_op_status = boost::fibers::channel_op_status;
+  using context = boost::fibers::context;
+  using time_point = std::chrono::steady_clock::time_point;
+
+  bounded_mpmc_queue<T, single_producer, single_consumer> queue_;
+
+  /// Whether the channel is closed in the lowest bit and the number of
+  /// pushes in progress in the other bits, so that a consumer never sees
+  /// the channel closed and empty while a value is still arriving
+  std::atomic<std::size_t> state_ { 0 };
+
+  static constexpr std::size_t closed_bit = 1;
+
+  static constexpr std::size_t one_push = 2;
+
+  /// The fibers sleeping on one side of the channel
+  struct sleepers {
+    /// Number of fibers in queue or about to sleep, only changed with
+    /// the lock but read without it on the fast path
+    std::atomic<unsigned> waiting { 0 };
+
+    context::wait_queue_t queue;
+
+    void add(int n) noexcept {
+      waiting.store(waiting.load(std::memory_order_relaxed) + n,
+                    std::memory_order_relaxed);
+    }
+  };
+
+  /// Protect the sleeping fibers, only used on the slow path
+  alignas(cache_line_size) boost::fibers::detail::spinlock splk_;
+
+  /// The fibers waiting on a full channel
+  sleepers producers_;
+
+  /// The fibers waiting on an empty channel
+  sleepers consumers_;
+
+  /** Take a sleeping fiber out of its queue, with the lock held
+
+      \return the fiber to schedule or nullptr if none is waiting
+  */
+  context * dequeue(sleepers &s) noexcept {
+    while (!s.queue.empty()) {
+      auto ctx = &s.queue.front();
+      s.queue.pop_front();
+      s.add(-1);
+      // Skip a timed wait which has already expired
+      auto expected = reinterpret_cast<std::intptr_t>(this);
+      if (ctx->twstatus.compare_exchange_strong(expected,
+                                                std::intptr_t { -1 },
+                                                std::memory_order_acq_rel)
+          || expected == 0)
+        return ctx;
+    }
+    return nullptr;
+  }
+
+
+  /// Wake up to \p n fibers waiting for the change just made to the
+  /// queue
+  void wake(sleepers &s, std::size_t n = 1) noexcept {
+    // Pairs with the fence in wait() so that either the waiter sees the
+    // change or it is seen as waiting here
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for (; n != 0 && s.waiting.load(std::memory_order_relaxed) != 0; --n) {
+      boost::fibers::detail::spinlock_lock lk { splk_ };
+      auto ctx = dequeue(s);
+      if (!ctx)
+        return;
+      lk.unlock();
+      context::active()->schedule(ctx);
+    }
+  }
+
+
+  /** Sleep until an operation does not return \p busy any more
+
+      \param[in] attempt tries the operation without sleeping
+
+      \param[in] deadline is when to give up, time_point::max() to wait
+      forever
+
+      \return the status of the last attempt or timeout
+  */
+  template <typename Attempt>
+  channel_op_status wait(sleepers &s,
+                         channel_op_status busy,
+                         Attempt attempt,
+                         time_point deadline) {
+    auto active_ctx = context::active();
+    for (;;) {
+      boost::fibers::detail::spinlock_lock lk { splk_ };
+      s.add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (auto status = attempt(); status != busy) {
+        s.add(-1);
+        return status;
+      }
+      active_ctx->wait_link(s.queue);
+      if (deadline == time_point::max()) {
+        active_ctx->twstatus.store(0, std::memory_order_release);
+        active_ctx->suspend(lk);
+      }
+      else {
+        active_ctx->twstatus.store(reinterpret_cast<std::intptr_t>(this),
+                                   std::memory_order_release);
+        if (!active_ctx->wait_until(deadline, lk)) {
+          lk.lock();
+          if (active_ctx->wait_is_linked()) {
+            s.queue.remove(*active_ctx);
+            s.add(-1);
+          }
+          return channel_op_status::timeout;
+        }
+      }
+    }
+  }
+
+
+  /** Run a push into the queue unless the channel is closed
+
+      The push is registered in state_ while it runs, so a consumer
+      looking at the channel in the meantime does not give up on it, and
+      after_push() has to be called once the spinlock is released.
+  */
+  template <typename Push>
+  channel_op_status push_registered(Push push) {
+    auto s = state_.fetch_add(one_push, std::memory_order_acquire)
+      & closed_bit ? channel_op_status::closed : push();
+    state_.fetch_sub(one_push, std::memory_order_release);
+    return s;
+  }
+
+
+  /// Wake up the consumers for the \p n values just pushed
+  void after_push(std::size_t n) noexcept {
+    if (is_closed())
+      // The consumers woken up by close() may have gone back to sleep
+      // while a push was in progress, so wake them up again to see its
+      // value or the end of the channel
+      wake(consumers_, std::numeric_limits<std::size_t>::max());
+    else if (n)
+      wake(consumers_, n);
+  }
+
+
+  /// Whether the channel is closed with no push in progress, so that a
+  /// queue found empty afterwards stays empty
+  bool closed_for_good() const noexcept {
+    // Synchronizes with the end of the last push
+    return state_.load(std::memory_order_acquire) == closed_bit;
+  }
+
+
+  /// Push without waking up a consumer
+  template <typename U>
+  channel_op_status push_once(U && value) {
+    return push_registered([&] {
+      return queue_.try_push(std::forward<U>(value))
+        ? channel_op_status::success : channel_op_status::full;
+    });
+  }
+
+
+  /// Pop without waking up a producer
+  channel_op_status pop_once(T &value) {
+    if (queue_.try_pop(value))
+      return channel_op_status::success;
+    return closed_for_good() && queue_.empty_approx()
+      ? channel_op_status::closed : channel_op_status::empty;
+  }
+
+
+  /// Push a burst without waking up a consumer
+  channel_op_status push_once_n(std::span<T> values, std::size_t &n) {
+    return push_registered([&] {
+      n = queue_.try_push_n(values);
+      return n ? channel_op_status::success : channel_op_status::full;
+    });
+  }
+
+
+  /// Pop a burst without waking up a producer
+  channel_op_status pop_once_n(std::span<T> out, std::size_t &n) {
+    if ((n = queue_.try_pop_n(out)))
+      return channel_op_status::success;
+    return closed_for_good() && queue_.empty_approx()
+      ? channel_op_status::closed : channel_op_status::empty;
+  }
+
+
+  template <typename U>
+  channel_op_status push_until(U && value, time_point deadline) {
+    auto s = push_once(std::forward<U>(value));
+    if (s == channel_op_status::full)
+      // The value is only moved by a successful push
+      s = wait(producers_, channel_op_status::full,
+               [&] { return push_once(std::forward<U>(value)); }, deadline);
+    after_push(s == channel_op_status::success);
+    return s;
+  }
+
+
+  channel_op_status pop_until(T &value, time_point deadline) {
+    auto s = pop_once(value);
+    if (s == channel_op_status::empty)
+      s = wait(consumers_, channel_op_status::empty,
+               [&] { return pop_once(value); }, deadline);
+    if (s == channel_op_status::success)
+      wake(producers_);
+    return s;
+  }
+
+public:
+
+  using value_type = T;
+
+  /** Create a channel
+
+      \param[in] capacity is the maximum number of values in flight,
+      which has to be a power of 2
+  */
+  explicit ring_channel(std::size_t capacity)
+    : queue_ { capacity } {}
+
+  ring_channel(const ring_channel &) = delete;
+  ring_channel & operator=(const ring_channel &) = delete;
+
+
+  bool is_closed() const noexcept {
+    return state_.load(std::memory_order_acquire) & closed_bit;
+  }
+
+
+  /** Refuse any new value and wake up all the sleeping fibers
+
+      A push already in progress may still complete, and its value can
+      be popped like the other ones left in the channel.
+  */
+  void close() noexcept {
+    state_.fetch_or(closed_bit, std::memory_order_seq_cst);
+    auto active_ctx = context::active();
+    boost::fibers::detail::spinlock_lock lk { splk_ };
+    for (auto s : { &producers_, &consumers_ })
+      while (auto ctx = dequeue(*s))
+        active_ctx->schedule(ctx);
+  }
+
+
+  template <typename U>
+  channel_op_status try_push(U && value) {
+    auto s = push_once(std::forward<U>(value));
+    after_push(s == channel_op_status::success);
+    return s;
+  }
+
+
+  /// Push a value, sleeping while the channel is full
+  template <typename U>
+  channel_op_status push(U && value) {
+    return push_until(std::forward<U>(value), time_point::max());
+  }
+
+
+  template <typename U, typename Clock, typename Duration>
+  channel_op_status
+  push_wait_until(U && value,
+                  const std::chrono::time_point<Clock, Duration> &t) {
+    return push_until(std::forward<U>(value),
+                      boost::fibers::detail::convert(t));
+  }
+
+
+  template <typename U, typename Rep, typename Period>
+  channel_op_status
+  push_wait_for(U && value, const std::chrono::duration<Rep, Period> &d) {
+    return push_until(std::forward<U>(value),
+                      std::chrono::steady_clock::now() + d);
+  }
+
+
+  /** Pop a value if there is one
+
+      The values still in the channel can be popped after it is closed.
+  */
+  channel_op_status try_pop(T &value) {
+    auto s = pop_once(value);
+    if (s == channel_op_status::success)
+      wake(producers_);
+    return s;
+  }
+
+
+  /// Pop a value, sleeping while the channel is empty and not closed
+  channel_op_status pop(T &value) {
+    return pop_until(value, time_point::max());
+  }
+
+
+  /** Pop a value, sleeping while the channel is empty and not closed
+
+      \throw boost::fibers::fiber_error if the channel is closed and
+      empty
+  */
+  T value_pop() {
+    T value {};
+    if (pop(value) == channel_op_status::closed)
+      throw boost::fibers::fiber_error {
+        std::make_error_code(std::errc::operation_not_permitted),
+        "ring_channel is closed" };
+    return value;
+  }
+
+
+  /** Push some values, moving as many as possible at once and sleeping
+      while the channel is full
+
+      \return the number of values pushed, which is less than the size
+      of \p values only if the channel is closed
+  */
+  std::size_t push_n(std::span<T> values) {
+    std::size_t pushed = 0;
+    while (pushed != values.size()) {
+      std::size_t n = 0;
+      auto attempt = [&] { return push_once_n(values.subspan(pushed), n); };
+      auto s = attempt();
+      if (s == channel_op_status::full)
+        s = wait(producers_, channel_op_status::full, attempt,
+                 time_point::max());
+      after_push(n);
+      if (s != channel_op_status::success)
+        break;
+      pushed += n;
+    }
+    return pushed;
+  }
+
+
+  /// Push as many values as possible without sleeping
+  std::size_t try_push_n(std::span<T> values) {
+    std::size_t n = 0;
+    push_once_n(values, n);
+    after_push(n);
+    return n;
+  }
+
+
+  /** Pop as many values as available, up to the size of \p out,
+      sleeping while the channel is empty and not closed
+
+      \return the number of values moved to the front of \p out, 0 only
+      if the channel is closed and empty
+  */
+  std::size_t pop_n(std::span<T> out) {
+    std::size_t n = 0;
+    auto attempt = [&] { return pop_once_n(out, n); };
+    auto s = attempt();
+    if (s == channel_op_status::empty)
+      s = wait(consumers_, channel_op_status::empty, attempt,
+               time_point::max());
+    if (s != channel_op_status::success)
+      return 0;
+    wake(producers_, n);
+    return n;
+  }
+
+
+  /// Pop as many values as available, up to the size of \p out,
+  /// without sleeping
+  std::size_t try_pop_n(std::span<T> out) {
+    std::size_t n = 0;
+    if (pop_once_n(out, n) == channel_op_status::success)
+      wake(producers_, n);
+    return n;
+  }
+
+
+  template <typename Clock, typename Duration>
+  channel_op_status
+  pop_wait_until(T &value, const std::chrono::time_point<Clock, Duration> &t) {
+    return pop_until(value, boost::fibers::detail::convert(t));
+  }
+
+
+  template <typename Rep, typename Period>
+  channel_op_status
+  pop_wait_for(T &value, const std::chrono::duration<Rep, Period> &d) {
+    return pop_until(value, std::chrono::steady_clock::now() + d);
+  }
+};
+
+
+/// A channel between a single producer fiber and a single consumer fiber
+template <typename T>
+using spsc_ring_channel = ring_channel<T, true, true>;
+
+#endif // FIBER_POOL_RING_CHANNEL_HPP
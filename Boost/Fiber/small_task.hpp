@@ -0,0 +1,133 @@
+/** \file
+
+    A move-only type-erased void() callable with a small-buffer
+    optimization
+
+    Unlike std::function it accepts move-only callables and it stores
+    small callables inside the object itself instead of allocating
+    them on the heap.
+*/
+
+#ifndef FIBER_POOL_SMALL_TASK_HPP
+#define FIBER_POOL_SMALL_TASK_HPP
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+class small_task {
+
+public:
+
+  /// The size available for a callable stored without allocation
+  static constexpr std::size_t inline_size = 64;
+
+private:
+
+  /// The operations depending on the erased type
+  struct vtable {
+    void (*invoke)(void *);
+    /// Move-construct into raw storage and destroy the source
+    void (*relocate)(void * from, void * to) noexcept;
+    void (*destroy)(void *) noexcept;
+  };
+
+  template <typename F>
+  static constexpr bool fits_inline = sizeof(F) <= inline_size
+    && alignof(F) <= alignof(std::max_align_t)
+    && std::is_nothrow_move_constructible_v<F>;
+
+  template <typename F>
+  static constexpr vtable inline_vtable {
+    [] (void * p) { std::invoke(*static_cast<F *>(p)); },
+    [] (void * from, void * to) noexcept {
+      ::new (to) F { std::move(*static_cast<F *>(from)) };
+      static_cast<F *>(from)->~F();
+    },
+    [] (void * p) noexcept { static_cast<F *>(p)->~F(); }
+  };
+
+  /// For the big callables, the storage only contains a pointer
+  template <typename F>
+  static constexpr vtable heap_vtable {
+    [] (void * p) { std::invoke(**static_cast<F **>(p)); },
+    [] (void * from, void * to) noexcept {
+      *static_cast<F **>(to) = *static_cast<F **>(from);
+    },
+    [] (void * p) noexcept { delete *static_cast<F **>(p); }
+  };
+
+  alignas(std::max_align_t) std::byte storage_[inline_size];
+
+  /// nullptr when there is no callable
+  const vtable * vt_ = nullptr;
+
+  void reset() noexcept {
+    if (vt_)
+      std::exchange(vt_, nullptr)->destroy(storage_);
+  }
+
+public:
+
+  /// Whether a callable of type F is stored without any allocation
+  template <typename F>
+  static constexpr bool stored_inline = fits_inline<std::decay_t<F>>;
+
+
+  small_task() noexcept = default;
+
+
+  template <typename F>
+  requires (!std::is_same_v<std::decay_t<F>, small_task>
+            && std::is_invocable_v<std::decay_t<F> &>)
+  small_task(F && f) {
+    using callable = std::decay_t<F>;
+    if constexpr (fits_inline<callable>) {
+      ::new (storage_) callable { std::forward<F>(f) };
+      vt_ = &inline_vtable<callable>;
+    }
+    else {
+      ::new (storage_) callable * { new callable { std::forward<F>(f) } };
+      vt_ = &heap_vtable<callable>;
+    }
+  }
+
+
+  small_task(small_task && other) noexcept : vt_ { other.vt_ } {
+    if (vt_) {
+      vt_->relocate(other.storage_, storage_);
+      other.vt_ = nullptr;
+    }
+  }
+
+
+  small_task & operator=(small_task && other) noexcept {
+    if (this != &other) {
+      reset();
+      if (other.vt_) {
+        other.vt_->relocate(other.storage_, storage_);
+        vt_ = std::exchange(other.vt_, nullptr);
+      }
+    }
+    return *this;
+  }
+
+
+  ~small_task() {
+    reset();
+  }
+
+
+  explicit operator bool() const noexcept {
+    return vt_ != nullptr;
+  }
+
+
+  void operator()() {
+    vt_->invoke(storage_);
+  }
+};
+
+#endif // FIBER_POOL_SMALL_TASK_HPP
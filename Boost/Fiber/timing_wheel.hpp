@@ -0,0 +1,470 @@
+/** \file
+
+    A hierarchical timing wheel putting the fibers of a worker to sleep,
+    as a scalable replacement of the ordered sleep queue of the Boost.Fiber
+    schedulers
+
+    The time is cut in ticks of a fixed resolution. A timer goes into a
+    slot of the level given by the highest group of tick bits in which
+    its expiry differs from the current tick, so inserting and cancelling
+    a timer only link or unlink it in a doubly linked list. When the
+    current tick enters a slot of an upper level, the slot is cascaded
+    to the lower levels, and all the fibers of a level 0 slot are woken
+    up at once on their tick. A bitmap of the occupied slots per level
+    gives the next tick with something to do, so the empty ticks are
+    skipped and an idle worker only wakes up when needed.
+
+    A fiber never wakes up before its deadline but up to one tick after
+    it, plus the time for its worker to notice it.
+
+    The wheel belongs to the scheduler of a worker thread, which ticks
+    it when picking the next fiber and sleeps until its next deadline
+    when idle. The fibers of this thread sleep on it with sleep_until(),
+    parked directly the same way as in fiber_clock.hpp, and a sleeping
+    fiber can be woken up early from any thread through a stop token.
+    The token watched by the wheel, such as the one of a fiber pool,
+    has a single stop callback waking up all the fibers of the wheel,
+    so the sleeps with it do not register anything on its shared stop
+    state.
+*/
+
+#ifndef BOOST_FIBERS_ALGO_TIMING_WHEEL_H
+#define BOOST_FIBERS_ALGO_TIMING_WHEEL_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <stop_token>
+
+#include <boost/fiber/context.hpp>
+#include <boost/fiber/detail/spinlock.hpp>
+#include <boost/fiber/operations.hpp>
+
+namespace boost::fibers::algo {
+
+class timing_wheel {
+
+ public:
+
+  using clock_type = std::chrono::steady_clock;
+
+  /// The default duration of a tick
+  static constexpr clock_type::duration default_resolution =
+    std::chrono::microseconds { 100 };
+
+  /// Number of bits of the tick number handled by each level
+  static constexpr unsigned slot_bits = 6;
+
+  static constexpr unsigned slots = 1U << slot_bits;
+
+  /// The levels cover 2^24 ticks, about 28 minutes with the default
+  /// resolution, and the later timers wait in an overflow list
+  static constexpr unsigned levels = 4;
+
+ private:
+
+  /// A sleeping fiber, living on its own stack
+  struct timer {
+    timer * prev = nullptr;
+    timer * next = nullptr;
+
+    /// The tick at which the fiber is woken up
+    std::uint64_t expiry;
+
+    context * ctx;
+
+    /// Whether the timer is in the wheel, only changed with the lock
+    bool linked = false;
+  };
+
+  /// A doubly linked list of timers
+  struct timer_list {
+    timer * head = nullptr;
+
+
+    void push(timer * t) noexcept {
+      t->prev = nullptr;
+      t->next = head;
+      if (head)
+        head->prev = t;
+      head = t;
+    }
+
+
+    void erase(timer * t) noexcept {
+      (t->prev ? t->prev->next : head) = t->next;
+      if (t->next)
+        t->next->prev = t->prev;
+    }
+  };
+
+  /// The wheel of the fibers running on this thread, if any
+  static inline thread_local timing_wheel * current_ = nullptr;
+
+  /// Protect the slots against the wake-ups from other threads
+  boost::fibers::detail::spinlock splk_;
+
+  const clock_type::duration resolution_;
+
+  /// The time of tick 0
+  const clock_type::time_point origin_;
+
+  /// All the timers up to this tick have expired
+  std::uint64_t now_ = 0;
+
+  /// The slots of each level
+  std::array<std::array<timer_list, slots>, levels> slots_ {};
+
+  /// The occupied slots of each level
+  std::array<std::uint64_t, levels> occupied_ {};
+
+  /// The timers beyond the last level
+  timer_list overflow_;
+
+  /// Number of timers in the wheel, to check it without the lock
+  std::atomic<std::size_t> size_ { 0 };
+
+  /// The next time something has to be done, only used by the owner
+  /// thread and maybe too early after a timer has been cancelled
+  clock_type::time_point next_deadline_ = clock_type::time_point::max();
+
+  /// Wake up all the fibers of the wheel on a stop request
+  struct stop_waker {
+    timing_wheel * wheel;
+
+    void operator()() const noexcept {
+      wheel->wake_all();
+    }
+  };
+
+  /// The token whose stop wakes up the whole wheel, see watch()
+  std::stop_token watched_;
+
+  std::optional<std::stop_callback<stop_waker>> stop_callback_;
+
+
+  /// The bit group of \p tick used at \p level
+  static unsigned slot_of(std::uint64_t tick, unsigned level) noexcept {
+    return (tick >> (level*slot_bits)) & (slots - 1);
+  }
+
+
+  /** Link a timer in its slot, with the lock held
+
+      \return false if it has already expired
+  */
+  bool link(timer * t) noexcept {
+    if (t->expiry <= now_)
+      return false;
+    auto level = (std::bit_width(t->expiry ^ now_) - 1)/slot_bits;
+    if (level >= levels)
+      overflow_.push(t);
+    else {
+      auto slot = slot_of(t->expiry, level);
+      slots_[level][slot].push(t);
+      occupied_[level] |= std::uint64_t { 1 } << slot;
+    }
+    return true;
+  }
+
+
+  /// Unlink a timer, with the lock held
+  void unlink(timer * t) noexcept {
+    auto level = (std::bit_width(t->expiry ^ now_) - 1)/slot_bits;
+    if (level >= levels)
+      overflow_.erase(t);
+    else {
+      auto slot = slot_of(t->expiry, level);
+      auto &list = slots_[level][slot];
+      list.erase(t);
+      if (!list.head)
+        occupied_[level] &= ~(std::uint64_t { 1 } << slot);
+    }
+    t->linked = false;
+    size_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+
+  /// The next tick after now_ entering an occupied slot, with the lock
+  /// held
+  std::uint64_t next_event() const noexcept {
+    auto next = ~std::uint64_t { 0 };
+    if (overflow_.head)
+      next = ((now_ >> (levels*slot_bits)) + 1) << (levels*slot_bits);
+    for (unsigned level = 0; level < levels; ++level) {
+      auto current = slot_of(now_, level);
+      if (current == slots - 1)
+        continue;
+      auto later = occupied_[level]
+        & (~std::uint64_t { 0 } << (current + 1));
+      if (!later)
+        continue;
+      auto shift = (level + 1)*slot_bits;
+      next = std::min(next,
+                      ((now_ >> shift) << shift)
+                      | std::uint64_t(std::countr_zero(later))
+                        << (level*slot_bits));
+    }
+    return next;
+  }
+
+
+  clock_type::time_point time_of(std::uint64_t tick) const noexcept {
+    if (tick == ~std::uint64_t { 0 })
+      return clock_type::time_point::max();
+    return origin_ + static_cast<clock_type::rep>(tick)*resolution_;
+  }
+
+
+  /** Move the wheel up to tick \p target, with the lock held
+
+      \param[out] expired receives the fibers to wake up
+  */
+  void advance(std::uint64_t target, timer_list &expired) noexcept {
+    for (;;) {
+      auto next = next_event();
+      if (next > target) {
+        now_ = target;
+        return;
+      }
+      now_ = next;
+      // Redistribute the upper slots entered by now_, from the top so
+      // that a timer can fall through several levels
+      timer_list cascade;
+      auto take = [&] (timer_list &list) {
+        while (auto t = list.head) {
+          list.erase(t);
+          cascade.push(t);
+        }
+      };
+      auto entered = [&] (unsigned level) {
+        return (now_ & ((std::uint64_t { 1 } << (level*slot_bits)) - 1)) == 0;
+      };
+      if (entered(levels))
+        take(overflow_);
+      for (unsigned level = levels; --level > 0;)
+        if (entered(level)) {
+          auto slot = slot_of(now_, level);
+          take(slots_[level][slot]);
+          occupied_[level] &= ~(std::uint64_t { 1 } << slot);
+        }
+      while (auto t = cascade.head) {
+        cascade.erase(t);
+        if (!link(t))
+          expire(t, expired);
+      }
+      // All the fibers of this tick are woken up in one batch
+      auto slot = slot_of(now_, 0);
+      auto &list = slots_[0][slot];
+      while (auto t = list.head) {
+        list.erase(t);
+        expire(t, expired);
+      }
+      occupied_[0] &= ~(std::uint64_t { 1 } << slot);
+    }
+  }
+
+
+  void expire(timer * t, timer_list &expired) noexcept {
+    t->linked = false;
+    size_.fetch_sub(1, std::memory_order_relaxed);
+    expired.push(t);
+  }
+
+
+  /// Wake up all the sleeping fibers, from any thread
+  void wake_all() noexcept {
+    timer_list expired;
+    {
+      boost::fibers::detail::spinlock_lock lk { splk_ };
+      auto take = [&] (timer_list &list) {
+        while (auto t = list.head) {
+          list.erase(t);
+          expire(t, expired);
+        }
+      };
+      for (unsigned level = 0; level < levels; ++level) {
+        for (auto &list : slots_[level])
+          take(list);
+        occupied_[level] = 0;
+      }
+      take(overflow_);
+    }
+    wake(expired);
+  }
+
+
+  /// Wake up some unlinked fibers, without the lock
+  static void wake(timer_list &expired) noexcept {
+    auto active_ctx = context::active();
+    while (auto t = expired.head) {
+      // The timer goes away with its fiber as soon as it is scheduled
+      expired.head = t->next;
+      active_ctx->schedule(t->ctx);
+    }
+  }
+
+ public:
+
+  explicit timing_wheel(clock_type::duration resolution
+                          = default_resolution)
+    : resolution_ { resolution }
+    , origin_ { clock_type::now() } {}
+
+  timing_wheel(timing_wheel const&) = delete;
+  timing_wheel & operator=(timing_wheel const&) = delete;
+
+
+  /// Make the fibers of the calling thread sleep on this wheel
+  void install() noexcept {
+    current_ = this;
+  }
+
+
+  /// Stop using this wheel from the calling thread
+  void uninstall() noexcept {
+    if (current_ == this)
+      current_ = nullptr;
+  }
+
+
+  /** Wake up all the fibers of the wheel as soon as a stop is requested
+      on \p token, with a single callback
+
+      To be called by the owner thread before any fiber sleeps with this
+      token.
+  */
+  void watch(std::stop_token token) {
+    watched_ = std::move(token);
+    stop_callback_.emplace(watched_, stop_waker { this });
+  }
+
+
+  /// The wheel of the calling thread, if any
+  static timing_wheel * current() noexcept {
+    return current_;
+  }
+
+
+  bool empty() const noexcept {
+    return size_.load(std::memory_order_relaxed) == 0;
+  }
+
+
+  /** Wake up the fibers whose deadline has passed
+
+      To be called by the owner thread when picking the next fiber. It
+      does nothing when the wheel is busy, for example because the
+      fiber going to sleep holds the lock until it is switched out, and
+      it is just tried again at the next pick.
+  */
+  void tick() noexcept {
+    if (empty())
+      return;
+    auto now = clock_type::now();
+    if (now < next_deadline_)
+      return;
+    timer_list expired;
+    {
+      if (!splk_.try_lock())
+        return;
+      std::lock_guard lk { splk_, std::adopt_lock };
+      advance(std::uint64_t((now - origin_)/resolution_), expired);
+      next_deadline_ = time_of(next_event());
+    }
+    wake(expired);
+  }
+
+
+  /// The earliest of \p time_point and the next deadline of the wheel,
+  /// for the owner thread to know how long it can be idle
+  clock_type::time_point
+  deadline(clock_type::time_point const& time_point) const noexcept {
+    if (empty())
+      return time_point;
+    return std::min(time_point, next_deadline_);
+  }
+
+
+  /** Make the calling fiber sleep until \p time_point on the wheel of
+      its thread, or with this_fiber::sleep_until() if there is none
+
+      \param[in] token wakes up the fiber early when a stop is requested
+
+      \return false if woken up early or if the stop was already
+      requested
+  */
+  static bool sleep_until(clock_type::time_point const& time_point,
+                          std::stop_token token = {}) {
+    auto wheel = current();
+    if (!wheel) {
+      if (token.stop_requested())
+        return false;
+      boost::this_fiber::sleep_until(time_point);
+      return true;
+    }
+    return wheel->park(time_point, token);
+  }
+
+
+  /// Make the calling fiber sleep for \p duration, see sleep_until()
+  template <typename Rep, typename Period>
+  static bool sleep_for(std::chrono::duration<Rep, Period> const& duration,
+                        std::stop_token token = {}) {
+    return sleep_until(clock_type::now()
+                       + std::chrono::ceil<clock_type::duration>(duration),
+                       token);
+  }
+
+ private:
+
+  /// Park the calling fiber on this wheel, which belongs to its thread
+  bool park(clock_type::time_point const& time_point,
+            std::stop_token const& token) {
+    auto active_ctx = context::active();
+    timer t { .expiry = 0, .ctx = active_ctx };
+    // Run by the thread requesting the stop
+    auto early = [&] {
+      boost::fibers::detail::spinlock_lock lk { splk_ };
+      if (!t.linked)
+        // Already expired, or not even parked yet
+        return;
+      unlink(&t);
+      lk.unlock();
+      context::active()->schedule(t.ctx);
+    };
+    // Registered before parking, so that a stop requested in the
+    // meantime is noticed under the lock. The watched token needs none
+    // since its stop wakes up the whole wheel under the lock
+    std::optional<std::stop_callback<decltype(early)>> cb;
+    if (token.stop_possible() && token != watched_)
+      cb.emplace(token, early);
+    boost::fibers::detail::spinlock_lock lk { splk_ };
+    if (token.stop_requested())
+      return false;
+    auto now = clock_type::now();
+    if (time_point <= now)
+      return true;
+    // Round up so that the fiber never wakes up early
+    t.expiry = std::max(now_ + 1,
+                        std::uint64_t((time_point - origin_ + resolution_
+                                       - clock_type::duration { 1 })
+                                      /resolution_));
+    link(&t);
+    t.linked = true;
+    size_.fetch_add(1, std::memory_order_relaxed);
+    next_deadline_ = std::min(next_deadline_, time_of(next_event()));
+    // The lock is released once this fiber is switched out
+    active_ctx->suspend(lk);
+    return !token.stop_requested();
+  }
+};
+
+}
+
+#endif // BOOST_FIBERS_ALGO_TIMING_WHEEL_H
@@ -0,0 +1,138 @@
+/** \file
+
+    Cheap per-worker counters of the pooled schedulers, to understand
+    why a given number of threads stops scaling
+
+    Each worker only updates its own counters, which live on their own
+    cache line, so there is no atomic read-modify-write and no false
+    sharing. The counters can be read at any time from any thread.
+*/
+
+#ifndef BOOST_FIBERS_ALGO_WORKER_STATS_H
+#define BOOST_FIBERS_ALGO_WORKER_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace boost::fibers::algo {
+
+/// A snapshot of the activity of a worker thread
+struct worker_stats {
+  /// Number of contexts picked to run by the scheduler
+  std::uint64_t context_switches = 0;
+
+  /// Number of fibers taken from the own queue of the worker, or from
+  /// the global queue of the work-sharing schedulers
+  std::uint64_t local_pops = 0;
+
+  /// Number of steal attempts which got some work
+  std::uint64_t steals = 0;
+
+  /// Number of steal attempts from a worker without work to give
+  std::uint64_t failed_steals = 0;
+
+  /// Number of times the thread went to sleep
+  std::uint64_t parks = 0;
+
+  /// Number of times the thread was woken up by a notification rather
+  /// than by a time-out
+  std::uint64_t wakeups = 0;
+
+  /// Time spent without work, whatever the idle mode, including the
+  /// current idle period
+  std::chrono::nanoseconds idle_time { 0 };
+
+
+  /// Accumulate the statistics of another worker
+  worker_stats & operator+=(const worker_stats &other) noexcept {
+    context_switches += other.context_switches;
+    local_pops += other.local_pops;
+    steals += other.steals;
+    failed_steals += other.failed_steals;
+    parks += other.parks;
+    wakeups += other.wakeups;
+    idle_time += other.idle_time;
+    return *this;
+  }
+};
+
+
+/// The counters of a worker, only written by the worker itself
+class alignas(64) worker_counters {
+
+  using counter = std::atomic<std::uint64_t>;
+
+  /// Increment without a locked instruction since there is one writer
+  static void bump(counter &c, std::uint64_t n = 1) noexcept {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  counter context_switches_ { 0 };
+  counter local_pops_ { 0 };
+  counter steals_ { 0 };
+  counter failed_steals_ { 0 };
+  counter parks_ { 0 };
+  counter wakeups_ { 0 };
+  /// In nanoseconds
+  counter idle_time_ { 0 };
+  /// Start of the current idle period in steady_clock nanoseconds, 0
+  /// while working
+  counter idle_start_ { 0 };
+
+  static std::uint64_t ns(std::chrono::steady_clock::time_point t) noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+      (t.time_since_epoch()).count();
+  }
+
+ public:
+
+  void context_switch() noexcept { bump(context_switches_); }
+
+  void local_pop() noexcept { bump(local_pops_); }
+
+  void steal(bool succeeded) noexcept {
+    bump(succeeded ? steals_ : failed_steals_);
+  }
+
+  void park() noexcept { bump(parks_); }
+
+  void wakeup() noexcept { bump(wakeups_); }
+
+  void idle_begin(std::chrono::steady_clock::time_point t) noexcept {
+    idle_start_.store(ns(t), std::memory_order_relaxed);
+  }
+
+
+  /// End the current idle period
+  void idle(std::chrono::steady_clock::duration d) noexcept {
+    // Forget the period before accounting for it, so that a concurrent
+    // snapshot rather misses it than counts it twice
+    idle_start_.store(0, std::memory_order_relaxed);
+    bump(idle_time_,
+         std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+  }
+
+
+  worker_stats snapshot() const noexcept {
+    auto get = [] (const counter &c) {
+      return c.load(std::memory_order_relaxed);
+    };
+    auto idle = get(idle_time_);
+    if (auto start = get(idle_start_))
+      if (auto now = ns(std::chrono::steady_clock::now()); now > start)
+        idle += now - start;
+    return { .context_switches = get(context_switches_),
+             .local_pops = get(local_pops_),
+             .steals = get(steals_),
+             .failed_steals = get(failed_steals_),
+             .parks = get(parks_),
+             .wakeups = get(wakeups_),
+             .idle_time = std::chrono::nanoseconds {
+               static_cast<std::int64_t>(idle) } };
+  }
+};
+
+}
+
+#endif // BOOST_FIBERS_ALGO_WORKER_STATS_H
@@ -0,0 +1,41 @@
+/** \file
+
+    A tiny pseudo-random generator, used to pick the steal victims or to
+    make up some traffic
+
+    It is Marsaglia's 32-bit xorshift, which is much cheaper than a
+    standard engine behind a thread_local access and good enough to
+    spread the workers over each other.
+*/
+
+#ifndef FIBER_POOL_XORSHIFT_HPP
+#define FIBER_POOL_XORSHIFT_HPP
+
+#include <cstdint>
+
+class xorshift32 {
+
+  /// Never 0, which would be a fixed point
+  std::uint32_t state;
+
+public:
+
+  /** Create a generator
+
+      \param[in] seed gives different sequences for example to
+      different workers
+  */
+  explicit xorshift32(std::uint32_t seed = 0) noexcept
+    : state { (2463534242U ^ (seed * 0x9E3779B9U)) | 1U } {}
+
+
+  /// The next pseudo-random number
+  std::uint32_t operator()() noexcept {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+};
+
+#endif // FIBER_POOL_XORSHIFT_HPP